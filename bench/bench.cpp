@@ -0,0 +1,615 @@
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../msgpack.hpp"
+#include "../tests/alloc_count.hpp"
+
+// Decode and encode throughput over synthetic corpora. Every corpus is
+// generated from a fixed seed so runs are comparable between builds. Each
+// mode runs in a forked child so its peak RSS is its own. Objects are the
+// top level messages of a corpus, allocations are counted per message.
+// Usage: bench [filter on "corpus/mode"] [seconds per mode, default 0.5]
+
+typedef struct
+{
+    std::string name;
+    std::vector<std::vector<unsigned char>> messages;
+    std::vector<unsigned char> stream; // The messages concatenated
+    std::vector<std::string> paths;    // Looked up by the extractor, the first one alone by path
+} Corpus;
+
+typedef struct
+{
+    std::string name;
+    std::function<size_t(const Corpus &)> run; // One pass, returns a checksum
+} Mode;
+
+static volatile size_t sink = 0;
+
+static std::string random_text(std::mt19937 &rng, size_t length)
+{
+    // Mostly ASCII with some two and three byte UTF-8 sequences
+    static const char *pieces[] = {"a", "b", "c", "d", "e", " ", "0", "Z", "\xc3\xa9", "\xe2\x82\xac"};
+    std::string text;
+    while (text.size() < length)
+        text += pieces[rng() % 10];
+    return text;
+}
+
+static Corpus small_maps(std::mt19937 &rng)
+{
+    Corpus corpus;
+    corpus.name = "small_maps";
+    for (int i = 0; i < 20000; i++)
+    {
+        std::vector<unsigned char> msg;
+        MsgPackEncoder encoder(msg);
+        encoder.pack_map(5);
+        encoder.pack_str("id");
+        encoder.pack_int(i);
+        encoder.pack_str("name");
+        encoder.pack_str(random_text(rng, 4 + rng() % 12));
+        encoder.pack_str("score");
+        encoder.pack_double((double)(rng() % 10000) / 100);
+        encoder.pack_str("active");
+        encoder.pack_bool(rng() % 2);
+        encoder.pack_str("tags");
+        encoder.pack_array(2);
+        encoder.pack_str("alpha");
+        encoder.pack_str("beta");
+        corpus.messages.push_back(msg);
+    }
+    corpus.paths = {"/name", "/id", "/score", "/tags/1"};
+    return corpus;
+}
+
+static Corpus wide_maps(std::mt19937 &rng)
+{
+    Corpus corpus;
+    corpus.name = "wide_maps";
+    for (int i = 0; i < 100; i++)
+    {
+        std::vector<unsigned char> msg;
+        MsgPackEncoder encoder(msg);
+        encoder.pack_map(2000);
+        for (int j = 0; j < 2000; j++)
+        {
+            encoder.pack_str("field_" + std::to_string(j));
+            encoder.pack_int((int64_t)(rng() % 100000) - 50000);
+        }
+        corpus.messages.push_back(msg);
+    }
+    corpus.paths = {"/field_1999", "/field_0", "/field_1000"};
+    return corpus;
+}
+
+static Corpus deep_nesting(std::mt19937 &rng)
+{
+    Corpus corpus;
+    corpus.name = "deep_nesting";
+    for (int i = 0; i < 5000; i++)
+    {
+        std::vector<unsigned char> msg;
+        MsgPackEncoder encoder(msg);
+        for (int depth = 0; depth < 64; depth++)
+        {
+            encoder.pack_array(2);
+            encoder.pack_int(rng() % 128);
+        }
+        encoder.pack_nil();
+        corpus.messages.push_back(msg);
+    }
+    std::string innermost;
+    for (int depth = 0; depth < 63; depth++)
+        innermost += "/1";
+    corpus.paths = {innermost + "/0", "/0", "/1/0"};
+    return corpus;
+}
+
+static Corpus numeric_arrays(std::mt19937 &rng)
+{
+    Corpus corpus;
+    corpus.name = "numeric_arrays";
+    for (int i = 0; i < 100; i++)
+    {
+        std::vector<unsigned char> msg;
+        MsgPackEncoder encoder(msg);
+        encoder.pack_array(10000);
+        for (int j = 0; j < 10000; j++)
+        {
+            if (j % 2)
+                encoder.pack_double((double)rng() / 1000);
+            else
+                encoder.pack_int((int64_t)rng() >> (rng() % 32));
+        }
+        corpus.messages.push_back(msg);
+    }
+    corpus.paths = {"/9999", "/0", "/5000"};
+    return corpus;
+}
+
+static Corpus string_heavy(std::mt19937 &rng)
+{
+    Corpus corpus;
+    corpus.name = "string_heavy";
+    for (int i = 0; i < 500; i++)
+    {
+        std::vector<unsigned char> msg;
+        MsgPackEncoder encoder(msg);
+        encoder.pack_map(1);
+        encoder.pack_str("text");
+        encoder.pack_array(50);
+        for (int j = 0; j < 50; j++)
+            encoder.pack_str(random_text(rng, 8 + rng() % 248));
+        corpus.messages.push_back(msg);
+    }
+    corpus.paths = {"/text/49", "/text/0", "/text/25"};
+    return corpus;
+}
+
+static Corpus binary_heavy(std::mt19937 &rng)
+{
+    Corpus corpus;
+    corpus.name = "binary_heavy";
+    std::vector<unsigned char> payload(65536);
+    for (auto &b : payload)
+        b = (unsigned char)rng();
+    for (int i = 0; i < 50; i++)
+    {
+        std::vector<unsigned char> msg;
+        MsgPackEncoder encoder(msg);
+        encoder.pack_array(8);
+        for (int j = 0; j < 8; j++)
+            encoder.pack_bin(payload.data(), 16384 + rng() % 49152);
+        corpus.messages.push_back(msg);
+    }
+    corpus.paths = {"/7", "/0", "/4"};
+    return corpus;
+}
+
+// Re-encodes a decoded document, so encoding is measured on the same shapes
+static void encode(MsgPackEncoder &encoder, MsgPackRef ref)
+{
+    switch (ref.type())
+    {
+    case MsgpackType::NIL:
+        encoder.pack_nil();
+        break;
+    case MsgpackType::BOOL:
+        encoder.pack_bool(ref.as_bool());
+        break;
+    case MsgpackType::FLOAT32:
+        encoder.pack_float((float)ref.as_double());
+        break;
+    case MsgpackType::FLOAT64:
+        encoder.pack_double(ref.as_double());
+        break;
+    case MsgpackType::STR:
+        encoder.pack_str(ref.as_string());
+        break;
+    case MsgpackType::BIN:
+        encoder.pack_bin(ref.as_bin().data(), ref.as_bin().size());
+        break;
+    case MsgpackType::EXT:
+        encoder.pack_ext(ref.ext_type(), ref.as_bin().data(), ref.as_bin().size());
+        break;
+    case MsgpackType::ARRAY:
+        encoder.pack_array((uint32_t)ref.size());
+        for (size_t i = 0; i < ref.size(); i++)
+            encode(encoder, ref[i]);
+        break;
+    case MsgpackType::MAP:
+        encoder.pack_map((uint32_t)ref.size());
+        for (size_t i = 0; i < ref.size(); i++)
+        {
+            encode(encoder, ref.key(i));
+            encode(encoder, ref.value(i));
+        }
+        break;
+    case MsgpackType::POSITIVE_FIXINT:
+    case MsgpackType::UINT8:
+    case MsgpackType::UINT16:
+    case MsgpackType::UINT32:
+    case MsgpackType::UINT64:
+        encoder.pack_uint(ref.as_uint64());
+        break;
+    default:
+        encoder.pack_int(ref.as_int64());
+        break;
+    }
+}
+
+#if defined(__cpp_impl_coroutine) && __cplusplus >= 202002L
+
+// Hands out the stream in socket sized reads and never suspends, so the
+// async mode times the reader rather than an event loop
+struct MemorySource
+{
+    const std::vector<unsigned char> *data;
+    size_t position;
+
+    MsgPackTask<size_t> read(unsigned char *buffer, size_t size)
+    {
+        size_t n = std::min<size_t>({size, 65536, data->size() - position});
+        memcpy(buffer, data->data() + position, n);
+        position += n;
+        co_return n;
+    }
+};
+
+static MsgPackTask<size_t> read_frames(MemorySource &source)
+{
+    MsgPackAsyncReader<MemorySource> reader(source);
+    std::vector<unsigned char> frame;
+    size_t frames = 0;
+    while (co_await reader.next_frame(frame))
+        frames++;
+    co_return frames;
+}
+
+#endif
+
+static std::vector<Mode> modes(const Corpus &corpus)
+{
+    std::vector<Mode> out;
+
+    out.push_back({"MsgPack", [](const Corpus &c)
+                   {
+                       size_t sum = 0;
+                       for (const auto &msg : c.messages)
+                           sum += MsgPack::try_decode(msg.data(), msg.size())->objects.size();
+                       return sum;
+                   }});
+
+    out.push_back({"MsgPack strict", [](const Corpus &c)
+                   {
+                       MsgPackOptions options;
+                       options.strict = true;
+                       size_t sum = 0;
+                       for (const auto &msg : c.messages)
+                           sum += MsgPack::try_decode(msg.data(), msg.size(), options)->objects.size();
+                       return sum;
+                   }});
+
+    out.push_back({"document", [](const Corpus &c)
+                   {
+                       size_t sum = 0;
+                       for (const auto &msg : c.messages)
+                       {
+                           MsgPackDocument document;
+                           document.parse(msg.data(), msg.size());
+                           sum += document.node_count();
+                       }
+                       return sum;
+                   }});
+
+    out.push_back({"document strict", [](const Corpus &c)
+                   {
+                       size_t sum = 0;
+                       for (const auto &msg : c.messages)
+                       {
+                           MsgPackDocument document;
+                           document.set_strict(true);
+                           document.parse(msg.data(), msg.size());
+                           sum += document.node_count();
+                       }
+                       return sum;
+                   }});
+
+    out.push_back({"decoder", [](const Corpus &c)
+                   {
+                       MsgPackDecoder &decoder = MsgPackDecoder::local();
+                       size_t sum = 0;
+                       for (const auto &msg : c.messages)
+                           sum += decoder.decode(msg).size();
+                       return sum;
+                   }});
+
+    // Fixed storage sized for the largest message of the corpus
+    size_t max_bytes = 0;
+    size_t max_nodes = 0;
+    for (const auto &msg : corpus.messages)
+    {
+        MsgPackDocument document(msg);
+        max_bytes = std::max(max_bytes, msg.size());
+        max_nodes = std::max(max_nodes, document.node_count());
+    }
+    auto bytes = std::make_shared<std::vector<unsigned char>>(max_bytes);
+    auto nodes = std::make_shared<std::vector<MsgPackNode>>(max_nodes);
+    auto children = std::make_shared<std::vector<uint32_t>>(max_nodes);
+    out.push_back({"fixed document", [bytes, nodes, children](const Corpus &c)
+                   {
+                       MsgPackFixedDocument document(MsgPackFixedTable<unsigned char>(bytes->data(), bytes->size()),
+                                                     MsgPackFixedTable<MsgPackNode>(nodes->data(), nodes->size()),
+                                                     MsgPackFixedTable<uint32_t>(children->data(), children->size()));
+                       size_t sum = 0;
+                       for (const auto &msg : c.messages)
+                       {
+                           document.parse(msg.data(), msg.size());
+                           sum += document.node_count();
+                       }
+                       return sum;
+                   }});
+
+    out.push_back({"validate", [](const Corpus &c)
+                   {
+                       MsgPackValidateOptions options;
+                       options.max_depth = MSGPACK_VALIDATE_MAX_DEPTH;
+                       size_t sum = 0;
+                       for (const auto &msg : c.messages)
+                       {
+                           size_t current = 0;
+                           sum += msgpack_validate(msg.data(), msg.size(), current, options);
+                       }
+                       return sum;
+                   }});
+
+    out.push_back({"validate utf8", [](const Corpus &c)
+                   {
+                       MsgPackValidateOptions options;
+                       options.max_depth = MSGPACK_VALIDATE_MAX_DEPTH;
+                       options.utf8 = true;
+                       size_t sum = 0;
+                       for (const auto &msg : c.messages)
+                       {
+                           size_t current = 0;
+                           sum += msgpack_validate(msg.data(), msg.size(), current, options);
+                       }
+                       return sum;
+                   }});
+
+    // Raw lookups, nothing is decoded but what the paths lead to
+    auto path = std::make_shared<MsgPackPath>(corpus.paths[0]);
+    out.push_back({"path", [path](const Corpus &c)
+                   {
+                       size_t sum = 0;
+                       for (const auto &msg : c.messages)
+                       {
+                           size_t offset = 0;
+                           MsgPackRawValue value;
+                           if (path->find(msg.data(), msg.size(), offset) && msgpack_read_value(msg.data(), msg.size(), offset, value))
+                               sum += offset;
+                       }
+                       return sum;
+                   }});
+
+    auto extractor = std::make_shared<MsgPackExtractor>();
+    for (const auto &p : corpus.paths)
+        extractor->add(p);
+    auto fields = std::make_shared<std::vector<MsgPackRawValue>>(corpus.paths.size());
+    out.push_back({"extractor", [extractor, fields](const Corpus &c)
+                   {
+                       size_t sum = 0;
+                       for (const auto &msg : c.messages)
+                           sum += extractor->extract(msg.data(), msg.size(), fields->data());
+                       return sum;
+                   }});
+
+    auto json = std::make_shared<std::string>();
+    out.push_back({"json", [json](const Corpus &c)
+                   {
+                       size_t sum = 0;
+                       for (const auto &msg : c.messages)
+                       {
+                           json->clear();
+                           msgpack_to_json(msg.data(), msg.size(), *json);
+                           sum += json->size();
+                       }
+                       return sum;
+                   }});
+
+    auto texts = std::make_shared<std::vector<std::string>>();
+    for (const auto &msg : corpus.messages)
+    {
+        texts->emplace_back();
+        msgpack_to_json(msg.data(), msg.size(), texts->back());
+    }
+    auto converted = std::make_shared<std::vector<unsigned char>>();
+    out.push_back({"from json", [texts, converted](const Corpus &)
+                   {
+                       size_t sum = 0;
+                       for (const auto &text : *texts)
+                       {
+                           converted->clear();
+                           msgpack_from_json(text, *converted);
+                           sum += converted->size();
+                       }
+                       return sum;
+                   }});
+
+    auto documents = std::make_shared<std::vector<MsgPackDocument>>();
+    for (const auto &msg : corpus.messages)
+        documents->emplace_back(msg);
+    auto buffer = std::make_shared<std::vector<unsigned char>>();
+    out.push_back({"encode", [documents, buffer](const Corpus &)
+                   {
+                       size_t sum = 0;
+                       for (const auto &document : *documents)
+                       {
+                           buffer->clear();
+                           MsgPackEncoder encoder(*buffer);
+                           encode(encoder, document.root());
+                           sum += buffer->size();
+                       }
+                       return sum;
+                   }});
+
+    // Concatenated streams, the whole corpus in one call
+    out.push_back({"stream", [](const Corpus &c)
+                   {
+                       return MsgPack::try_decode(c.stream.data(), c.stream.size())->objects.size();
+                   }});
+
+    // Borrows the stream, copying it would be timed too
+    out.push_back({"stream parallel", [](const Corpus &c)
+                   {
+                       return MsgPack(c.stream.data(), c.stream.size(), MsgPackParallel()).objects.size();
+                   }});
+
+    // Boundaries only: header by header scanning, then framing fed in
+    // socket sized chunks
+    out.push_back({"scanner", [](const Corpus &c)
+                   {
+                       MsgPackStreamScanner scanner;
+                       size_t start = 0;
+                       size_t frames = 0;
+                       while (start < c.stream.size() && scanner.scan(c.stream.data() + start, c.stream.size() - start) == MSGPACK_SCAN_COMPLETE)
+                       {
+                           start += scanner.size();
+                           scanner.reset();
+                           frames++;
+                       }
+                       return frames;
+                   }});
+
+    auto framer = std::make_shared<MsgPackFramer>();
+    out.push_back({"framer", [framer](const Corpus &c)
+                   {
+                       size_t frames = 0;
+                       for (size_t offset = 0; offset < c.stream.size(); offset += 65536)
+                       {
+                           size_t n = std::min<size_t>(65536, c.stream.size() - offset);
+                           frames += framer->feed(c.stream.data() + offset, n, [](const MsgPackSlice &) {});
+                       }
+                       return frames;
+                   }});
+
+    out.push_back({"index", [](const Corpus &c)
+                   {
+                       MsgPackIndex index;
+                       return index.update(c.stream.data(), c.stream.size());
+                   }});
+
+#if defined(__cpp_impl_coroutine) && __cplusplus >= 202002L
+    out.push_back({"async", [](const Corpus &c)
+                   {
+                       MemorySource source = {&c.stream, 0};
+                       auto task = read_frames(source);
+                       task.start();
+                       return task.result();
+                   }});
+#endif
+
+    // Every message sent as the single parameter of a request, the handler
+    // only reads the envelope so this times parsing, lookup and the reply
+    auto requests = std::make_shared<std::vector<std::vector<unsigned char>>>();
+    for (size_t i = 0; i < corpus.messages.size(); i++)
+    {
+        std::vector<unsigned char> request;
+        MsgPackEncoder encoder(request);
+        encoder.pack_array(4);
+        encoder.pack_uint(MSGPACK_RPC_REQUEST);
+        encoder.pack_uint(i);
+        encoder.pack_str("echo");
+        encoder.pack_array(1);
+        request.insert(request.end(), corpus.messages[i].begin(), corpus.messages[i].end());
+        requests->push_back(std::move(request));
+    }
+    auto server = std::make_shared<MsgPackRpcServer>();
+    server->add("echo", [](const MsgPackRpcMessage &request, MsgPackEncoder &result)
+                { result.pack_uint(request.params.size()); });
+    out.push_back({"rpc dispatch", [requests, server](const Corpus &)
+                   {
+                       size_t sum = 0;
+                       MsgPackRpcServer::Buffer response;
+                       for (const auto &request : *requests)
+                       {
+                           if (server->try_dispatch(request.data(), request.size(), response))
+                               sum += response->size();
+                       }
+                       return sum;
+                   }});
+
+    return out;
+}
+
+static void measure(const Corpus &corpus, const Mode &mode, double seconds)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    long baseline = usage.ru_maxrss;
+
+    sink += mode.run(corpus); // Warm up, reused buffers reach their size
+
+    size_t before = allocations;
+    size_t passes = 0;
+    auto start = std::chrono::steady_clock::now();
+    double elapsed = 0;
+    do
+    {
+        sink += mode.run(corpus);
+        passes++;
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    } while (elapsed < seconds);
+    size_t allocated = allocations - before;
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    double objects = (double)passes * corpus.messages.size();
+    printf("%-16s %-16s %10.1f %12.1f %12.2f %12.1f %10.1f\n",
+           corpus.name.c_str(), mode.name.c_str(),
+           (double)passes * corpus.stream.size() / elapsed / 1e6,
+           elapsed * 1e9 / objects,
+           allocated / objects,
+           usage.ru_maxrss / 1024.0,
+           (usage.ru_maxrss - baseline) / 1024.0);
+}
+
+int main(int argc, char **argv)
+{
+    std::string filter = argc > 1 ? argv[1] : "";
+    double seconds = argc > 2 ? atof(argv[2]) : 0.5;
+
+    std::mt19937 rng(42);
+    std::vector<Corpus> corpora;
+    corpora.push_back(small_maps(rng));
+    corpora.push_back(wide_maps(rng));
+    corpora.push_back(deep_nesting(rng));
+    corpora.push_back(numeric_arrays(rng));
+    corpora.push_back(string_heavy(rng));
+    corpora.push_back(binary_heavy(rng));
+    for (auto &corpus : corpora)
+    {
+        for (const auto &msg : corpus.messages)
+            corpus.stream.insert(corpus.stream.end(), msg.begin(), msg.end());
+    }
+
+    // Peak RSS counts the corpora the child shares with this process,
+    // growth is what the mode needed on top
+    printf("%-16s %-16s %10s %12s %12s %12s %10s\n", "corpus", "mode", "MB/s", "ns/object", "allocs/msg", "peak RSS MB", "growth MB");
+
+    for (const auto &corpus : corpora)
+    {
+        for (const auto &mode : modes(corpus))
+        {
+            if ((corpus.name + "/" + mode.name).find(filter) == std::string::npos)
+                continue;
+
+            fflush(stdout);
+            pid_t child = fork();
+            if (child == 0)
+            {
+                measure(corpus, mode, seconds);
+                fflush(stdout);
+                _exit(0);
+            }
+            if (child < 0)
+                measure(corpus, mode, seconds);
+            else
+                waitpid(child, nullptr, 0);
+        }
+    }
+
+    return 0;
+}
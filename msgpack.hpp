@@ -1,13 +1,75 @@
 #ifndef _MSGPACK_HPP_
 #define _MSGPACK_HPP_
 
+#include <functional>
 #include <memory>
+#include <new>
+#include <optional>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 #include <algorithm>
+#include <iterator>
+#include <limits>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <string>
+#include <type_traits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <string_view>
 
+// MSGPACK_NO_IOSTREAM leaves out MsgPackObj::to_string(), print() writes
+// with stdio instead
+#ifndef MSGPACK_NO_IOSTREAM
 #include <sstream>
 #include <iostream>
+#endif
+
+// MSGPACK_NO_EXCEPTIONS is for builds with exceptions turned off. Where the
+// library would throw it calls MSGPACK_ABORT(message) instead, which must
+// not return. On such targets use the calls that report bad input instead
+// of throwing: try_decode, parse, the MsgPackDecodeError overloads of
+// MsgPackFramer, MsgPackAsyncReader and MsgPackFile, and try_dispatch.
+// What is left aborts on misuse (bad paths, wrong types) or system errors.
+#ifdef MSGPACK_NO_EXCEPTIONS
+#ifndef MSGPACK_ABORT
+#define MSGPACK_ABORT(message) std::abort()
+#endif
+#define MSGPACK_THROW(message) MSGPACK_ABORT(message)
+#else
+#define MSGPACK_THROW(message) throw message
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// SIMD code paths for x86 are built with GCC/Clang target attributes and
+// chosen when the program runs, so they don't need -mavx2 or -mssse3
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define MSGPACK_X86_SIMD
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__cpp_impl_coroutine) && __cplusplus >= 202002L
+#include <coroutine>
+#endif
 
 typedef enum e_MsgpackType
 {
@@ -32,440 +94,5279 @@ typedef enum e_MsgpackType
     MAP,
 } MsgpackType;
 
-class MsgPackObj
+typedef enum e_MsgPackError
 {
+    MSGPACK_OK = 0,
+    MSGPACK_ERROR_TRUNCATED,    // Input ends inside an object
+    MSGPACK_ERROR_RESERVED,     // The reserved 0xc1 byte
+    MSGPACK_ERROR_INVALID_UTF8, // STR payload that is not UTF-8, strict decoding only
+    MSGPACK_ERROR_CAPACITY,     // Fixed storage is too small for the object
+    MSGPACK_ERROR_DEPTH,        // Containers nested deeper than MsgPackLimits::max_depth
+    MSGPACK_ERROR_LIMIT,        // Over another bound of MsgPackLimits
+    MSGPACK_ERROR_TIMESTAMP,    // EXT type -1 with a payload that is not a timestamp
+} MsgPackError;
 
+// What went wrong while decoding and where: the byte offset of the object
+// that could not be decoded and its path from the root as a JSON pointer,
+// so the path can be handed straight to MsgPackPath
+class MsgPackDecodeError
+{
 public:
-    bool is_nil() { return type == MsgpackType::NIL; }
-    bool is_bool() { return type == MsgpackType::BOOL; }
-    bool is_bin() { return type == MsgpackType::BIN; }
-    bool is_ext() { return type == MsgpackType::EXT; }
-    bool is_float32() { return type == MsgpackType::FLOAT32; }
-    bool is_float64() { return type == MsgpackType::FLOAT64; }
-    bool is_uint8() { return type == MsgpackType::UINT8 || type == MsgpackType::POSITIVE_FIXINT; }
-    bool is_uint16() { return type == MsgpackType::UINT16; }
-    bool is_uint32() { return type == MsgpackType::UINT32; }
-    bool is_uint64() { return type == MsgpackType::UINT64; }
-    bool is_int8() { return type == MsgpackType::INT8 || type == MsgpackType::POSITIVE_FIXINT || type == MsgpackType::NEGATIVE_FIXINT; }
-    bool is_int16() { return type == MsgpackType::INT16; }
-    bool is_int32() { return type == MsgpackType::INT32; }
-    bool is_int64() { return type == MsgpackType::INT64; }
-    bool is_str() { return type == MsgpackType::STR; }
-    bool is_array() { return type == MsgpackType::ARRAY; }
-    bool is_map() { return type == MsgpackType::MAP; }
-    bool is_str_map() { return type == MsgpackType::MAP; }
-
-    bool is_unsigned() { return type == MsgpackType::UINT16 || type == MsgpackType::UINT32 || type == MsgpackType::UINT64 || type == MsgpackType::UINT8; }
-    bool is_signed() { return !is_unsigned(); }
-
-    int32_t as_int32()
-    {
-        return as_int64();
-    }
+    MsgPackError code = MSGPACK_OK;
+    size_t offset = 0;
+    std::string path;
 
-    int32_t as_uint32()
-    {
-        return as_uint64();
-    }
+    explicit operator bool() const { return code != MSGPACK_OK; }
 
-    int64_t as_int64()
+    const char *message() const
     {
-        switch (type)
+        switch (code)
         {
-        case MsgpackType::POSITIVE_FIXINT:
-        case MsgpackType::NEGATIVE_FIXINT:
-        case MsgpackType::INT8:
-            return m_int8;
-            break;
-        case MsgpackType::UINT8:
-            return m_uint8;
-            break;
-        case MsgpackType::INT16:
-            return m_int16;
-            break;
-        case MsgpackType::UINT16:
-            return m_uint16;
-            break;
-        case MsgpackType::INT32:
-            return m_int32;
-            break;
-        case MsgpackType::UINT32:
-            return m_uint32;
-            break;
-        case MsgpackType::INT64:
-            return m_int64;
-            break;
-        case MsgpackType::UINT64:
-            return m_uint64;
-            break;
-        default:
-            return 0;
-            break;
+        case MSGPACK_OK:
+            return "no error";
+        case MSGPACK_ERROR_TRUNCATED:
+            return "truncated input";
+        case MSGPACK_ERROR_RESERVED:
+            return "reserved byte 0xc1";
+        case MSGPACK_ERROR_INVALID_UTF8:
+            return "invalid utf-8";
+        case MSGPACK_ERROR_CAPACITY:
+            return "out of capacity";
+        case MSGPACK_ERROR_DEPTH:
+            return "nesting too deep";
+        case MSGPACK_ERROR_LIMIT:
+            return "decode limit exceeded";
+        case MSGPACK_ERROR_TIMESTAMP:
+            return "invalid timestamp";
         }
+        return "unknown error";
     }
 
-    uint64_t as_uint64()
+    // Adds the segment of a parent container in front of the path
+    void prepend(std::string_view segment)
     {
-        switch (type)
+        std::string escaped = "/";
+        for (char c : segment)
         {
-        case MsgpackType::POSITIVE_FIXINT:
-        case MsgpackType::NEGATIVE_FIXINT:
-        case MsgpackType::INT8:
-            return m_int8;
-            break;
-        case MsgpackType::UINT8:
-            return m_uint8;
-            break;
-        case MsgpackType::INT16:
-            return m_int16;
-            break;
-        case MsgpackType::UINT16:
-            return m_uint16;
-            break;
-        case MsgpackType::INT32:
-            return m_int32;
-            break;
-        case MsgpackType::UINT32:
-            return m_uint32;
-            break;
-        case MsgpackType::INT64:
-            return m_int64;
-            break;
-        case MsgpackType::UINT64:
-            return m_uint64;
-            break;
-        default:
-            return 0;
-            break;
+            if (c == '~')
+                escaped += "~0";
+            else if (c == '/')
+                escaped += "~1";
+            else
+                escaped += c;
         }
+        path.insert(0, escaped);
     }
 
-    std::string as_string()
+    void prepend(size_t index)
     {
-        if (type == MsgpackType::STR)
-        {
-            return m_str;
-        }
-        return "";
+        prepend(std::to_string(index));
     }
+};
 
-    std::unordered_map<std::string, std::shared_ptr<MsgPackObj>> as_str_map()
-    {
-        if (type == MsgpackType::MAP)
-        {
-            return m_map_string;
-        }
+// Either a value or the error that prevented it, for callers that would
+// rather not catch exceptions
+template <typename T>
+class MsgPackExpected
+{
+public:
+    MsgPackExpected(T value) : m_value(std::move(value)) {}
+    MsgPackExpected(MsgPackDecodeError error) : m_error(std::move(error)) {}
 
-        throw "That went wrong";
-    }
+    bool has_value() const { return m_value.has_value(); }
+    explicit operator bool() const { return has_value(); }
 
-    std::vector<std::shared_ptr<MsgPackObj>> as_vector()
+    // Throws the error message if there is no value
+    T &value()
     {
-        if (type == MsgpackType::ARRAY)
-        {
-            return m_array;
-        }
-        throw "That went wrong";
+        if (!m_value)
+            MSGPACK_THROW(m_error.message());
+        return *m_value;
     }
 
-    void to_raw(std::vector<char> &buffer);
+    T &operator*() { return *m_value; }
+    T *operator->() { return &*m_value; }
+    const MsgPackDecodeError &error() const { return m_error; }
 
-    MsgpackType type;
-    bool m_bool;
-    std::shared_ptr<std::vector<unsigned char>> m_bin;
-    // ext
-    float m_float32;
-    double m_float64;
-    uint8_t m_uint8;
-    uint16_t m_uint16;
-    uint32_t m_uint32;
-    uint64_t m_uint64;
-    int8_t m_int8;
-    int16_t m_int16;
-    int32_t m_int32;
-    int64_t m_int64;
-    std::string m_str;
-    std::vector<std::shared_ptr<MsgPackObj>> m_array;
-    std::unordered_map<std::string, std::shared_ptr<MsgPackObj>> m_map_string;
+private:
+    std::optional<T> m_value;
+    MsgPackDecodeError m_error;
+};
 
-    MsgPackObj()
+class MsgPackObj;
+
+// Scalar map key. Integers are normalised so that the same value compares
+// equal whatever width it was encoded with (0x01, 0xcc 0x01, 0xd0 0x01...).
+class MsgPackKey
+{
+public:
+    MsgpackType type; // NIL, BOOL, INT64, UINT64 (> INT64_MAX only), FLOAT64, STR or BIN
+    bool m_bool = false;
+    int64_t m_int64 = 0;
+    uint64_t m_uint64 = 0;
+    double m_float64 = 0;
+    std::string m_str; // STR and BIN payload bytes
+
+    MsgPackKey()
     {
         type = MsgpackType::NIL;
     }
 
-    MsgPackObj(bool value)
+    MsgPackKey(bool value)
     {
         type = MsgpackType::BOOL;
         m_bool = value;
     }
 
-    MsgPackObj(int8_t value, bool fixed_positive, bool fixed_negative)
+    template <typename T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value, int>::type = 0>
+    MsgPackKey(T value)
     {
-        if (fixed_positive)
-        {
-            type = MsgpackType::POSITIVE_FIXINT;
-            m_int8 = value & 0x7f;  // Enforce 7 bit size
-            m_uint8 = value & 0x7f; // Both are valid
-        }
-        else if (fixed_negative)
+        if (std::is_signed<T>::value || (uint64_t)value <= (uint64_t)INT64_MAX)
         {
-            type = MsgpackType::NEGATIVE_FIXINT;
-            m_int8 = value | 0xE0; // Enforce first three bits as 1's
+            type = MsgpackType::INT64;
+            m_int64 = (int64_t)value;
         }
         else
         {
-            type = MsgpackType::INT8;
-            m_int8 = value;
+            type = MsgpackType::UINT64;
+            m_uint64 = (uint64_t)value;
         }
     }
-    MsgPackObj(int16_t value)
-    {
-        type = MsgpackType::INT16;
-        m_int16 = value;
-    }
 
-    MsgPackObj(int32_t value)
+    MsgPackKey(double value)
     {
-        type = MsgpackType::INT32;
-        m_int32 = value;
+        type = MsgpackType::FLOAT64;
+        m_float64 = value;
     }
 
-    MsgPackObj(int64_t value)
+    MsgPackKey(const std::string &value)
     {
-        type = MsgpackType::INT64;
-        m_int64 = value;
+        type = MsgpackType::STR;
+        m_str = value;
     }
 
-    MsgPackObj(uint8_t value)
+    MsgPackKey(const char *value)
     {
-
-        type = MsgpackType::UINT8;
-        m_uint8 = value;
+        type = MsgpackType::STR;
+        m_str = value;
     }
 
-    MsgPackObj(uint16_t value)
-    {
-        type = MsgpackType::UINT16;
-        m_uint16 = value;
-    }
+    MsgPackKey(const MsgPackObj &obj);
 
-    MsgPackObj(uint32_t value)
+    static MsgPackKey bin(const std::vector<unsigned char> &value)
     {
-        type = MsgpackType::UINT32;
-        m_uint32 = value;
+        MsgPackKey key;
+        key.type = MsgpackType::BIN;
+        key.m_str.assign(value.begin(), value.end());
+        return key;
     }
 
-    MsgPackObj(uint64_t value)
-    {
-        type = MsgpackType::UINT64;
-        m_uint64 = value;
-    }
+    bool is_int() const { return type == MsgpackType::INT64; }
 
-    MsgPackObj(float value)
+    bool operator==(const MsgPackKey &other) const
     {
-        type = MsgpackType::FLOAT32;
-        m_float32 = value;
-    }
+        if (type != other.type)
+            return false;
 
-    MsgPackObj(double value)
-    {
-        type = MsgpackType::FLOAT64;
-        m_float64 = value;
+        switch (type)
+        {
+        case MsgpackType::NIL:
+            return true;
+        case MsgpackType::BOOL:
+            return m_bool == other.m_bool;
+        case MsgpackType::INT64:
+            return m_int64 == other.m_int64;
+        case MsgpackType::UINT64:
+            return m_uint64 == other.m_uint64;
+        case MsgpackType::FLOAT64:
+            return m_float64 == other.m_float64;
+        default:
+            return m_str == other.m_str;
+        }
     }
 
-    MsgPackObj(std::string value)
+    bool operator!=(const MsgPackKey &other) const { return !(*this == other); }
+
+    size_t hash() const
     {
-        type = MsgpackType::STR;
-        m_str = value;
+        switch (type)
+        {
+        case MsgpackType::BOOL:
+            return m_bool ? 1 : 2;
+        case MsgpackType::INT64:
+            return std::hash<int64_t>()(m_int64);
+        case MsgpackType::UINT64:
+            return std::hash<uint64_t>()(m_uint64);
+        case MsgpackType::FLOAT64:
+            return m_float64 == 0 ? 0 : std::hash<double>()(m_float64); // 0.0 == -0.0
+        case MsgpackType::STR:
+        case MsgpackType::BIN:
+            return std::hash<std::string>()(m_str) ^ (size_t)type;
+        default:
+            return 0;
+        }
     }
+};
 
-    MsgPackObj(std::shared_ptr<std::vector<unsigned char>> value)
+namespace std
+{
+    template <>
+    struct hash<MsgPackKey>
     {
-        type = MsgpackType::BIN;
-        m_bin = value;
-    }
+        size_t operator()(const MsgPackKey &key) const { return key.hash(); }
+    };
+}
 
-    MsgPackObj(std::unordered_map<std::string, std::shared_ptr<MsgPackObj>> value)
+// Integer keyed index into a map's pair list. Small non-negative key sets
+// (the common compact protocol case) are held in a dense table, anything
+// else uses open addressing with linear probing.
+class MsgPackIntMap
+{
+public:
+    static constexpr uint32_t npos = 0xFFFFFFFF;
+
+    void build(const std::vector<std::pair<int64_t, uint32_t>> &entries)
     {
-        type = MsgpackType::MAP;
-        for (const auto &n : value)
+        m_size = 0;
+        m_slots.clear();
+        m_keys.clear();
+
+        if (entries.empty())
         {
-            m_map_string[n.first] = n.second;
+            m_dense = true;
+            return;
         }
-    }
 
-    MsgPackObj(std::vector<std::shared_ptr<MsgPackObj>> value)
-    {
-        type = MsgpackType::ARRAY;
-        m_array = value;
+        int64_t min = entries[0].first;
+        int64_t max = entries[0].first;
+        for (const auto &e : entries)
+        {
+            min = std::min(min, e.first);
+            max = std::max(max, e.first);
+        }
+
+        m_dense = min >= 0 && (uint64_t)max < std::max<uint64_t>(16, entries.size() * 2);
+        if (m_dense)
+        {
+            m_slots.assign((size_t)max + 1, npos);
+            for (const auto &e : entries)
+            {
+                if (m_slots[e.first] == npos)
+                    m_size++;
+                m_slots[e.first] = e.second;
+            }
+            return;
+        }
+
+        size_t capacity = 16;
+        while (capacity < entries.size() * 2)
+            capacity <<= 1;
+        m_mask = capacity - 1;
+        m_slots.assign(capacity, npos);
+        m_keys.assign(capacity, 0);
+
+        for (const auto &e : entries)
+        {
+            size_t slot = probe(e.first);
+            if (m_slots[slot] == npos)
+                m_size++;
+            m_keys[slot] = e.first;
+            m_slots[slot] = e.second;
+        }
     }
 
-    ~MsgPackObj()
+    // Returns the index of the pair holding key, or npos
+    uint32_t find(int64_t key) const
     {
-        if (type == MsgpackType::MAP)
+        if (m_dense)
         {
-            /*for (const auto &n : m_map_string)
-            {
-                delete n.second;
-            }*/
+            if (key < 0 || (uint64_t)key >= m_slots.size())
+                return npos;
+            return m_slots[key];
         }
+        return m_slots[probe(key)];
     }
 
-    std::stringstream to_string(bool new_line = true)
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    bool is_dense() const { return m_dense; }
+
+private:
+    size_t probe(int64_t key) const
     {
-        std::stringstream ret;
+        size_t slot = (size_t)(((uint64_t)key * 0x9E3779B97F4A7C15ull) >> 32) & m_mask;
+        while (m_slots[slot] != npos && m_keys[slot] != key)
+            slot = (slot + 1) & m_mask;
+        return slot;
+    }
 
-        switch (type)
+    bool m_dense = true;
+    size_t m_size = 0;
+    size_t m_mask = 0;
+    std::vector<uint32_t> m_slots;
+    std::vector<int64_t> m_keys;
+};
+
+inline uint16_t msgpack_load16(const unsigned char *p)
+{
+    return (uint16_t)((uint16_t)p[0] << 8 | (uint16_t)p[1]);
+}
+
+inline uint32_t msgpack_load32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+inline uint64_t msgpack_load64(const unsigned char *p)
+{
+    return (uint64_t)msgpack_load32(p) << 32 | (uint64_t)msgpack_load32(p + 4);
+}
+
+// Header of a single object in a raw buffer. For scalars header_size covers
+// the whole object, for STR/BIN/EXT length is the payload size that follows
+// the header, for ARRAY/MAP length is the element/pair count.
+typedef struct
+{
+    MsgpackType type;
+    uint8_t header_size;
+    int8_t ext_type;
+    uint32_t length;
+} MsgPackHeader;
+
+// Reads the header at current, returns false if it is truncated or reserved
+inline bool msgpack_read_header(const unsigned char *raw, size_t size, size_t current, MsgPackHeader &header)
+{
+    if (current >= size)
+        return false;
+
+    const unsigned char *p = raw + current;
+    size_t available = size - current;
+    uint8_t tag = p[0];
+
+    header.ext_type = 0;
+    header.length = 0;
+
+    if (tag <= 0x7f)
+    {
+        header.type = MsgpackType::POSITIVE_FIXINT;
+        header.header_size = 1;
+        return true;
+    }
+    if (tag >= 0xe0)
+    {
+        header.type = MsgpackType::NEGATIVE_FIXINT;
+        header.header_size = 1;
+        return true;
+    }
+    if (tag <= 0x8f)
+    {
+        header.type = MsgpackType::MAP;
+        header.header_size = 1;
+        header.length = tag & 0x0F;
+        return true;
+    }
+    if (tag <= 0x9f)
+    {
+        header.type = MsgpackType::ARRAY;
+        header.header_size = 1;
+        header.length = tag & 0x0F;
+        return true;
+    }
+    if (tag <= 0xbf)
+    {
+        header.type = MsgpackType::STR;
+        header.header_size = 1;
+        header.length = tag & 0x1F;
+        return true;
+    }
+
+    // Size of the fixed part following the tag
+    static const uint8_t extra[32] = {
+        0, 0, 0, 0,    // c0 nil, c1 reserved, c2 false, c3 true
+        1, 2, 4,       // c4-c6 bin
+        2, 3, 5,       // c7-c9 ext
+        4, 8,          // ca-cb float
+        1, 2, 4, 8,    // cc-cf uint
+        1, 2, 4, 8,    // d0-d3 int
+        2, 3, 5, 9, 17, // d4-d8 fixext (type + data)
+        1, 2, 4,       // d9-db str
+        2, 4,          // dc-dd array
+        2, 4,          // de-df map
+    };
+    static const MsgpackType types[32] = {
+        MsgpackType::NIL, MsgpackType::NIL, MsgpackType::BOOL, MsgpackType::BOOL,
+        MsgpackType::BIN, MsgpackType::BIN, MsgpackType::BIN,
+        MsgpackType::EXT, MsgpackType::EXT, MsgpackType::EXT,
+        MsgpackType::FLOAT32, MsgpackType::FLOAT64,
+        MsgpackType::UINT8, MsgpackType::UINT16, MsgpackType::UINT32, MsgpackType::UINT64,
+        MsgpackType::INT8, MsgpackType::INT16, MsgpackType::INT32, MsgpackType::INT64,
+        MsgpackType::EXT, MsgpackType::EXT, MsgpackType::EXT, MsgpackType::EXT, MsgpackType::EXT,
+        MsgpackType::STR, MsgpackType::STR, MsgpackType::STR,
+        MsgpackType::ARRAY, MsgpackType::ARRAY,
+        MsgpackType::MAP, MsgpackType::MAP,
+    };
+
+    if (tag == 0xc1)
+        return false;
+
+    uint8_t index = tag - 0xc0;
+    if (available < 1u + extra[index])
+        return false;
+
+    header.type = types[index];
+    header.header_size = 1 + extra[index];
+
+    switch (tag)
+    {
+    case 0xc4:
+    case 0xd9:
+        header.length = p[1];
+        break;
+    case 0xc5:
+    case 0xda:
+    case 0xdc:
+    case 0xde:
+        header.length = msgpack_load16(p + 1);
+        break;
+    case 0xc6:
+    case 0xdb:
+    case 0xdd:
+    case 0xdf:
+        header.length = msgpack_load32(p + 1);
+        break;
+    case 0xc7:
+        header.length = p[1];
+        header.ext_type = (int8_t)p[2];
+        break;
+    case 0xc8:
+        header.length = msgpack_load16(p + 1);
+        header.ext_type = (int8_t)p[3];
+        break;
+    case 0xc9:
+        header.length = msgpack_load32(p + 1);
+        header.ext_type = (int8_t)p[5];
+        break;
+    case 0xd4:
+    case 0xd5:
+    case 0xd6:
+    case 0xd7:
+    case 0xd8:
+        // Fixext payload is counted as part of the header
+        header.header_size = 2;
+        header.length = extra[index] - 1;
+        header.ext_type = (int8_t)p[1];
+        break;
+    default:
+        break;
+    }
+
+    return true;
+}
+
+// Advances current past one complete object (including nested objects)
+// without decoding it. Returns false if the object is malformed or truncated.
+inline bool msgpack_skip(const unsigned char *raw, size_t size, size_t &current)
+{
+    uint64_t remaining = 1;
+    MsgPackHeader header;
+    size_t position = current;
+
+    while (remaining > 0)
+    {
+        if (!msgpack_read_header(raw, size, position, header))
+            return false;
+        remaining--;
+        position += header.header_size;
+
+        if (header.type == MsgpackType::ARRAY)
+        {
+            remaining += header.length;
+        }
+        else if (header.type == MsgpackType::MAP)
+        {
+            remaining += (uint64_t)header.length * 2;
+        }
+        else
+        {
+            if (header.length > size - position)
+                return false;
+            position += header.length;
+        }
+    }
+
+    current = position;
+    return true;
+}
+
+// Timestamp extension (type -1) payload in its 32, 64 or 96 bit form.
+// Fails on a nanoseconds field over 999999999, as the spec requires.
+inline bool msgpack_read_timestamp(const unsigned char *payload, size_t size, int64_t &seconds, uint32_t &nanoseconds)
+{
+    switch (size)
+    {
+    case 4:
+        seconds = msgpack_load32(payload);
+        nanoseconds = 0;
+        return true;
+    case 8:
+    {
+        uint64_t value = msgpack_load64(payload);
+        nanoseconds = (uint32_t)(value >> 34);
+        seconds = (int64_t)(value & 0x3ffffffffull);
+        return nanoseconds <= 999999999;
+    }
+    case 12:
+        nanoseconds = msgpack_load32(payload);
+        seconds = (int64_t)msgpack_load64(payload + 4);
+        return nanoseconds <= 999999999;
+    default:
+        return false;
+    }
+}
+
+// Nanoseconds since the epoch, false if that does not fit an int64_t
+// (about 292 years either side of 1970, the 96 bit form reaches further)
+inline bool msgpack_timestamp_ns(int64_t seconds, uint32_t nanoseconds, int64_t &out)
+{
+    const int64_t max_seconds = INT64_MAX / 1000000000;
+    const int64_t min_seconds = INT64_MIN / 1000000000 - 1;
+    if (nanoseconds > 999999999 || seconds > max_seconds || seconds < min_seconds)
+        return false;
+    if (seconds == max_seconds && nanoseconds > INT64_MAX % 1000000000)
+        return false;
+    if (seconds == min_seconds)
+    {
+        // seconds * 1000000000 alone would overflow, add the nanoseconds first
+        if (nanoseconds < 1000000000 + INT64_MIN % 1000000000)
+            return false;
+        out = (seconds + 1) * 1000000000 - (int64_t)(1000000000 - nanoseconds);
+        return true;
+    }
+    out = seconds * 1000000000 + nanoseconds;
+    return true;
+}
+
+// Decodes an array of timestamps at current in to nanoseconds since the
+// epoch. Fails if the array holds anything else, a timestamp out of range
+// or more than capacity items.
+inline bool msgpack_read_timestamps(const unsigned char *raw, size_t size, size_t &current, int64_t *out, size_t capacity, size_t &count)
+{
+    MsgPackHeader header;
+    if (!msgpack_read_header(raw, size, current, header) || header.type != MsgpackType::ARRAY || header.length > capacity)
+        return false;
+
+    size_t position = current + header.header_size;
+    for (uint32_t i = 0; i < header.length; i++)
+    {
+        if (position + 6 > size)
+            return false;
+
+        const unsigned char *p = raw + position;
+        int64_t seconds;
+        uint32_t nanoseconds;
+        if (p[0] == 0xd6 && p[1] == 0xff)
+        {
+            seconds = msgpack_load32(p + 2);
+            nanoseconds = 0;
+            position += 6;
+        }
+        else if (p[0] == 0xd7 && p[1] == 0xff && position + 10 <= size)
+        {
+            uint64_t value = msgpack_load64(p + 2);
+            nanoseconds = (uint32_t)(value >> 34);
+            seconds = (int64_t)(value & 0x3ffffffffull);
+            position += 10;
+        }
+        else if (p[0] == 0xc7 && p[1] == 12 && p[2] == 0xff && position + 15 <= size)
+        {
+            nanoseconds = msgpack_load32(p + 3);
+            seconds = (int64_t)msgpack_load64(p + 7);
+            position += 15;
+        }
+        else
+        {
+            return false;
+        }
+        if (!msgpack_timestamp_ns(seconds, nanoseconds, out[i]))
+            return false;
+    }
+
+    count = header.length;
+    current = position;
+    return true;
+}
+
+inline bool msgpack_read_timestamps(const unsigned char *raw, size_t size, size_t &current, std::vector<int64_t> &out)
+{
+    MsgPackHeader header;
+    if (!msgpack_read_header(raw, size, current, header) || header.type != MsgpackType::ARRAY)
+        return false;
+
+    // Smallest timestamp is 6 bytes, don't trust the count beyond that
+    if (header.length > (size - current) / 6)
+        return false;
+
+    size_t count = 0;
+    out.resize(header.length);
+    bool ok = msgpack_read_timestamps(raw, size, current, out.data(), out.size(), count);
+    out.resize(count);
+    return ok;
+}
+
+// Default MsgPackLimits::max_depth. The decoders recurse once per level of
+// nesting, so the depth is bounded even when no other limit is set. Lower
+// it for threads with small stacks.
+#ifndef MSGPACK_DEFAULT_MAX_DEPTH
+#define MSGPACK_DEFAULT_MAX_DEPTH 256
+#endif
+
+typedef enum e_MsgPackScanStatus
+{
+    MSGPACK_SCAN_NEED_MORE,
+    MSGPACK_SCAN_COMPLETE,
+    MSGPACK_SCAN_MALFORMED, // The reserved 0xc1 byte
+    MSGPACK_SCAN_TOO_DEEP,  // Containers nested deeper than the scanner's max_depth
+} MsgPackScanStatus;
+
+// The decode error a failed scan is reported as
+inline MsgPackError msgpack_scan_error(MsgPackScanStatus status)
+{
+    switch (status)
+    {
+    case MSGPACK_SCAN_NEED_MORE:
+        return MSGPACK_ERROR_TRUNCATED;
+    case MSGPACK_SCAN_MALFORMED:
+        return MSGPACK_ERROR_RESERVED;
+    case MSGPACK_SCAN_TOO_DEEP:
+        return MSGPACK_ERROR_DEPTH;
+    default:
+        return MSGPACK_OK;
+    }
+}
+
+// Finds where an object ends in a buffer that is still being filled, one
+// header at a time. When more bytes are needed the scanner keeps its place,
+// so calling scan() again with a longer buffer carries on from there
+// instead of starting over. Nesting is bounded as in the decoders, 0 for
+// no bound.
+class MsgPackStreamScanner
+{
+public:
+    MsgPackStreamScanner(size_t max_depth = MSGPACK_DEFAULT_MAX_DEPTH) : m_max_depth(max_depth) {}
+
+    // data must start at the first byte of the object every call
+    MsgPackScanStatus scan(const unsigned char *data, size_t size)
+    {
+        MsgPackHeader header;
+        while (!m_complete)
+        {
+            if (m_position >= size)
+                return MSGPACK_SCAN_NEED_MORE;
+            if (data[m_position] == 0xc1)
+                return MSGPACK_SCAN_MALFORMED;
+            if (!msgpack_read_header(data, size, m_position, header))
+                return MSGPACK_SCAN_NEED_MORE;
+
+            if (header.type == MsgpackType::ARRAY || header.type == MsgpackType::MAP)
+            {
+                if (m_max_depth && m_open.size() >= m_max_depth)
+                    return MSGPACK_SCAN_TOO_DEEP;
+                m_position += header.header_size;
+                uint64_t children = header.type == MsgpackType::MAP ? (uint64_t)header.length * 2 : header.length;
+                if (children > 0)
+                {
+                    m_open.push_back(children);
+                    continue;
+                }
+            }
+            else
+            {
+                if (header.length > size - m_position - header.header_size)
+                    return MSGPACK_SCAN_NEED_MORE; // Header is read again next time
+                m_position += header.header_size + header.length;
+            }
+
+            // An object ended, close the containers it was the last child of
+            while (!m_open.empty() && --m_open.back() == 0)
+                m_open.pop_back();
+            m_complete = m_open.empty();
+        }
+        return MSGPACK_SCAN_COMPLETE;
+    }
+
+    // Size of the object once scan() returned MSGPACK_SCAN_COMPLETE
+    size_t size() const { return m_position; }
+
+    void reset()
+    {
+        m_position = 0;
+        m_complete = false;
+        m_open.clear();
+    }
+
+private:
+    size_t m_max_depth;
+    size_t m_position = 0;
+    bool m_complete = false;
+    std::vector<uint64_t> m_open; // Children left in each open container
+};
+
+// True if s is well formed UTF-8: no overlong forms, surrogates or code
+// points past U+10FFFF. Runs of ASCII are skipped 16 bytes at a time with
+// SSE2. Used as is where SSSE3 is not available and for short strings.
+inline bool msgpack_utf8_valid_scalar(const unsigned char *s, size_t size)
+{
+    size_t i = 0;
+    while (i < size)
+    {
+#if defined(__SSE2__)
+        while (i + 16 <= size && !_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i))))
+            i += 16;
+        if (i == size)
+            break;
+#endif
+        unsigned char c = s[i];
+        if (c < 0x80)
+        {
+            i++;
+            continue;
+        }
+
+        size_t length;
+        unsigned char low = 0x80; // Range of the second byte
+        unsigned char high = 0xbf;
+        if (c >= 0xc2 && c <= 0xdf)
+            length = 2;
+        else if (c >= 0xe0 && c <= 0xef)
+        {
+            length = 3;
+            if (c == 0xe0)
+                low = 0xa0;
+            else if (c == 0xed)
+                high = 0x9f;
+        }
+        else if (c >= 0xf0 && c <= 0xf4)
+        {
+            length = 4;
+            if (c == 0xf0)
+                low = 0x90;
+            else if (c == 0xf4)
+                high = 0x8f;
+        }
+        else
+            return false;
+
+        if (size - i < length || s[i + 1] < low || s[i + 1] > high)
+            return false;
+        for (size_t k = 2; k < length; k++)
+        {
+            if ((s[i + k] & 0xc0) != 0x80)
+                return false;
+        }
+        i += length;
+    }
+    return true;
+}
+
+#if defined(MSGPACK_X86_SIMD)
+
+// Vectorised UTF-8 check after Keiser and Lemire, "Validating UTF-8 In Less
+// Than One Instruction Per Byte". Three 16 entry tables, indexed by the
+// nibbles of each byte and the byte before it, flag every invalid two byte
+// combination; the third and fourth bytes of long sequences are checked
+// against the lead bytes two and three positions back.
+static const uint8_t s_msgpack_utf8_tables[3][16] = {
+    // High nibble of the previous byte
+    {0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x80, 0x80, 0x80, 0x80, 0x21, 0x01, 0x15, 0x49},
+    // Low nibble of the previous byte
+    {0xe7, 0xa3, 0x83, 0x83, 0x8b, 0xcb, 0xcb, 0xcb, 0xcb, 0xcb, 0xcb, 0xcb, 0xcb, 0xdb, 0xcb, 0xcb},
+    // High nibble of the current byte
+    {0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0xe6, 0xae, 0xba, 0xba, 0x01, 0x01, 0x01, 0x01},
+};
+
+// Largest byte that may end a block in each position without leaving a
+// sequence open, the last three positions are the interesting ones
+static const uint8_t s_msgpack_utf8_incomplete[32] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xef, 0xdf, 0xbf};
+
+// Every member carries its target so the check can be built for AVX2 and
+// SSSE3 whatever the compiler targets, and picked when the program runs
+#define MSGPACK_AVX2 __attribute__((target("avx2")))
+
+struct MsgPackUtf8Avx2
+{
+    typedef __m256i Vector;
+    static const size_t width = 32;
+
+    MSGPACK_AVX2 static Vector load(const unsigned char *p) { return _mm256_loadu_si256((const __m256i *)p); }
+    MSGPACK_AVX2 static void store(unsigned char *p, Vector v) { _mm256_storeu_si256((__m256i *)p, v); }
+    MSGPACK_AVX2 static Vector splat(uint8_t v) { return _mm256_set1_epi8((char)v); }
+    MSGPACK_AVX2 static Vector table(const uint8_t *t) { return _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)t)); }
+    MSGPACK_AVX2 static Vector lookup(Vector t, Vector index) { return _mm256_shuffle_epi8(t, index); }
+    MSGPACK_AVX2 static Vector high_nibble(Vector v) { return _mm256_and_si256(_mm256_srli_epi16(v, 4), splat(0x0f)); }
+    MSGPACK_AVX2 static Vector low_nibble(Vector v) { return _mm256_and_si256(v, splat(0x0f)); }
+    MSGPACK_AVX2 static Vector bit_and(Vector a, Vector b) { return _mm256_and_si256(a, b); }
+    MSGPACK_AVX2 static Vector bit_or(Vector a, Vector b) { return _mm256_or_si256(a, b); }
+    MSGPACK_AVX2 static Vector bit_xor(Vector a, Vector b) { return _mm256_xor_si256(a, b); }
+    MSGPACK_AVX2 static Vector sub_saturate(Vector a, Vector b) { return _mm256_subs_epu8(a, b); }
+    MSGPACK_AVX2 static Vector positive(Vector v) { return _mm256_cmpgt_epi8(v, _mm256_setzero_si256()); }
+    MSGPACK_AVX2 static bool ascii(Vector v) { return _mm256_movemask_epi8(v) == 0; }
+    MSGPACK_AVX2 static bool zero(Vector v) { return _mm256_testz_si256(v, v); }
+
+    // input shifted right by N bytes, the gap filled from the previous block
+    template <int N>
+    MSGPACK_AVX2 static Vector prev(Vector input, Vector previous)
+    {
+        return _mm256_alignr_epi8(input, _mm256_permute2x128_si256(previous, input, 0x21), 16 - N);
+    }
+};
+
+#define MSGPACK_SSSE3 __attribute__((target("ssse3")))
+
+struct MsgPackUtf8Ssse3
+{
+    typedef __m128i Vector;
+    static const size_t width = 16;
+
+    MSGPACK_SSSE3 static Vector load(const unsigned char *p) { return _mm_loadu_si128((const __m128i *)p); }
+    MSGPACK_SSSE3 static void store(unsigned char *p, Vector v) { _mm_storeu_si128((__m128i *)p, v); }
+    MSGPACK_SSSE3 static Vector splat(uint8_t v) { return _mm_set1_epi8((char)v); }
+    MSGPACK_SSSE3 static Vector table(const uint8_t *t) { return _mm_loadu_si128((const __m128i *)t); }
+    MSGPACK_SSSE3 static Vector lookup(Vector t, Vector index) { return _mm_shuffle_epi8(t, index); }
+    MSGPACK_SSSE3 static Vector high_nibble(Vector v) { return _mm_and_si128(_mm_srli_epi16(v, 4), splat(0x0f)); }
+    MSGPACK_SSSE3 static Vector low_nibble(Vector v) { return _mm_and_si128(v, splat(0x0f)); }
+    MSGPACK_SSSE3 static Vector bit_and(Vector a, Vector b) { return _mm_and_si128(a, b); }
+    MSGPACK_SSSE3 static Vector bit_or(Vector a, Vector b) { return _mm_or_si128(a, b); }
+    MSGPACK_SSSE3 static Vector bit_xor(Vector a, Vector b) { return _mm_xor_si128(a, b); }
+    MSGPACK_SSSE3 static Vector sub_saturate(Vector a, Vector b) { return _mm_subs_epu8(a, b); }
+    MSGPACK_SSSE3 static Vector positive(Vector v) { return _mm_cmpgt_epi8(v, _mm_setzero_si128()); }
+    MSGPACK_SSSE3 static bool ascii(Vector v) { return _mm_movemask_epi8(v) == 0; }
+    MSGPACK_SSSE3 static bool zero(Vector v) { return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) == 0xffff; }
+
+    template <int N>
+    MSGPACK_SSSE3 static Vector prev(Vector input, Vector previous)
+    {
+        return _mm_alignr_epi8(input, previous, 16 - N);
+    }
+};
+
+// The check for one vector type. Only called from the target specific
+// functions below, which inline all of it, so GCC's note that passing AVX
+// vectors here would change the ABI does not apply. With out set, every
+// block is also stored there so the text is copied in the same pass.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+template <typename V>
+inline bool msgpack_utf8_valid_simd(const unsigned char *s, size_t size, unsigned char *out)
+{
+    const typename V::Vector previous_high = V::table(s_msgpack_utf8_tables[0]);
+    const typename V::Vector previous_low = V::table(s_msgpack_utf8_tables[1]);
+    const typename V::Vector current_high = V::table(s_msgpack_utf8_tables[2]);
+    const typename V::Vector incomplete_max = V::load(s_msgpack_utf8_incomplete + 32 - V::width);
+
+    typename V::Vector error = V::splat(0);
+    typename V::Vector incomplete = V::splat(0);
+
+    // prev1, prev2 and prev3 are input shifted by one to three bytes, with
+    // the bytes before the block shifted in
+    auto check = [&](const typename V::Vector &input, const typename V::Vector &prev1,
+                     const typename V::Vector &prev2, const typename V::Vector &prev3)
+    {
+        if (V::ascii(input))
+        {
+            // Only an error if the previous block left a sequence open
+            error = V::bit_or(error, incomplete);
+        }
+        else
+        {
+            typename V::Vector special = V::bit_and(V::bit_and(V::lookup(previous_high, V::high_nibble(prev1)),
+                                                               V::lookup(previous_low, V::low_nibble(prev1))),
+                                                    V::lookup(current_high, V::high_nibble(input)));
+
+            // Bytes that must be the third or fourth of a sequence
+            typename V::Vector third = V::sub_saturate(prev2, V::splat(0xe0 - 1));
+            typename V::Vector fourth = V::sub_saturate(prev3, V::splat(0xf0 - 1));
+            typename V::Vector continuation = V::bit_and(V::positive(V::bit_or(third, fourth)), V::splat(0x80));
+
+            error = V::bit_or(error, V::bit_xor(continuation, special));
+            incomplete = V::sub_saturate(input, incomplete_max);
+        }
+    };
+
+    typename V::Vector previous = V::splat(0);
+    size_t i = 0;
+    for (; i + V::width <= size; i += V::width)
+    {
+        typename V::Vector input = V::load(s + i);
+        if (out)
+            V::store(out + i, input);
+        check(input, V::template prev<1>(input, previous), V::template prev<2>(input, previous), V::template prev<3>(input, previous));
+        previous = input;
+    }
+    if (i == size)
+        return V::zero(V::bit_or(error, incomplete));
+
+    if (i >= V::width && size - V::width >= 3)
+    {
+        // The last block overlaps the one before it, checking bytes twice
+        // gives the same answer. Shifted copies are loaded straight from s.
+        const unsigned char *last = s + size - V::width;
+        typename V::Vector input = V::load(last);
+        if (out)
+            V::store(out + size - V::width, input);
+        check(input, V::load(last - 1), V::load(last - 2), V::load(last - 3));
+    }
+    else
+    {
+        // Zero padding is ASCII, so a sequence cut off at the end shows up
+        unsigned char tail[V::width] = {0};
+        memcpy(tail, s + i, size - i);
+        if (out)
+            memcpy(out + i, tail, size - i);
+        typename V::Vector input = V::load(tail);
+        check(input, V::template prev<1>(input, previous), V::template prev<2>(input, previous), V::template prev<3>(input, previous));
+    }
+    return V::zero(V::bit_or(error, incomplete));
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+MSGPACK_AVX2 __attribute__((flatten)) inline bool msgpack_utf8_valid_avx2(const unsigned char *s, size_t size, unsigned char *out = nullptr)
+{
+    return msgpack_utf8_valid_simd<MsgPackUtf8Avx2>(s, size, out);
+}
+
+MSGPACK_SSSE3 __attribute__((flatten)) inline bool msgpack_utf8_valid_ssse3(const unsigned char *s, size_t size, unsigned char *out = nullptr)
+{
+    return msgpack_utf8_valid_simd<MsgPackUtf8Ssse3>(s, size, out);
+}
+
+typedef enum e_MsgPackSimdLevel
+{
+    MSGPACK_SIMD_NONE,
+    MSGPACK_SIMD_SSSE3,
+    MSGPACK_SIMD_AVX2,
+} MsgPackSimdLevel;
+
+// What the CPU running the program supports, looked up once
+inline MsgPackSimdLevel msgpack_simd_level()
+{
+#if defined(__AVX2__)
+    return MSGPACK_SIMD_AVX2;
+#else
+    static const MsgPackSimdLevel level = []()
+    {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return MSGPACK_SIMD_AVX2;
+        if (__builtin_cpu_supports("ssse3"))
+            return MSGPACK_SIMD_SSSE3;
+        return MSGPACK_SIMD_NONE;
+    }();
+    return level;
+#endif
+}
+
+#endif
+
+// True if s is well formed UTF-8. On x86 the check is vectorised with AVX2
+// or SSSE3, whichever the CPU has, and is scalar otherwise and for short
+// strings.
+inline bool msgpack_utf8_valid(const unsigned char *s, size_t size)
+{
+#if defined(MSGPACK_X86_SIMD)
+    if (size >= 32)
+    {
+        MsgPackSimdLevel level = msgpack_simd_level();
+        if (level == MSGPACK_SIMD_AVX2)
+            return msgpack_utf8_valid_avx2(s, size);
+        if (level == MSGPACK_SIMD_SSSE3)
+            return msgpack_utf8_valid_ssse3(s, size);
+    }
+#endif
+    return msgpack_utf8_valid_scalar(s, size);
+}
+
+// Copies size bytes of s to out and checks them as msgpack_utf8_valid()
+// does, reading s only once
+inline bool msgpack_utf8_copy(const unsigned char *s, size_t size, unsigned char *out)
+{
+#if defined(MSGPACK_X86_SIMD)
+    if (size >= 32)
+    {
+        MsgPackSimdLevel level = msgpack_simd_level();
+        if (level == MSGPACK_SIMD_AVX2)
+            return msgpack_utf8_valid_avx2(s, size, out);
+        if (level == MSGPACK_SIMD_SSSE3)
+            return msgpack_utf8_valid_ssse3(s, size, out);
+    }
+#endif
+    memcpy(out, s, size);
+    return msgpack_utf8_valid_scalar(out, size);
+}
+
+#define MSGPACK_VALIDATE_MAX_DEPTH 256
+
+typedef struct
+{
+    size_t max_depth = 64; // Nested containers allowed, up to MSGPACK_VALIDATE_MAX_DEPTH
+    bool utf8 = false;     // Check STR payloads are valid UTF-8
+} MsgPackValidateOptions;
+
+// Checks the object at current is well formed without decoding it: every
+// header is valid (0xc1 is rejected), payloads and container counts fit in
+// the buffer and nesting stays within max_depth. Allocates nothing. On
+// success current is past the object, on failure it is the offset of the
+// offending header.
+inline bool msgpack_validate(const unsigned char *raw, size_t size, size_t &current, const MsgPackValidateOptions &options = MsgPackValidateOptions())
+{
+    uint64_t levels[MSGPACK_VALIDATE_MAX_DEPTH]; // Items left in each open container
+    size_t max_depth = std::min<size_t>(options.max_depth, MSGPACK_VALIDATE_MAX_DEPTH);
+    size_t depth = 0;
+    uint64_t remaining = 1;
+
+    for (;;)
+    {
+        if (remaining == 0)
+        {
+            if (depth == 0)
+                return true;
+            remaining = levels[--depth];
+            continue;
+        }
+
+        MsgPackHeader header;
+        if (!msgpack_read_header(raw, size, current, header))
+            return false;
+        size_t available = size - current - header.header_size;
+        remaining--;
+
+        if (header.type == MsgpackType::ARRAY || header.type == MsgpackType::MAP)
+        {
+            // Every item takes at least a byte
+            uint64_t count = header.type == MsgpackType::MAP ? (uint64_t)header.length * 2 : header.length;
+            if (count > available || depth >= max_depth)
+                return false;
+            if (count > 0)
+            {
+                levels[depth++] = remaining;
+                remaining = count;
+            }
+            current += header.header_size;
+        }
+        else
+        {
+            if (header.length > available)
+                return false;
+            if (options.utf8 && header.type == MsgpackType::STR && !msgpack_utf8_valid(raw + current + header.header_size, header.length))
+                return false;
+            current += header.header_size + header.length;
+        }
+    }
+}
+
+// Checks raw holds exactly one well formed object
+inline bool msgpack_validate(const unsigned char *raw, size_t size, size_t *error_offset = nullptr, const MsgPackValidateOptions &options = MsgPackValidateOptions())
+{
+    size_t current = 0;
+    bool valid = msgpack_validate(raw, size, current, options) && current == size;
+    if (!valid && error_offset)
+        *error_offset = current;
+    return valid;
+}
+
+// Stores an integer in T if T can hold it. Negative values come in
+// signed_value, everything else in unsigned_value.
+template <typename T>
+inline bool msgpack_integer_to(bool negative, int64_t signed_value, uint64_t unsigned_value, T &out)
+{
+    if (negative)
+    {
+        if constexpr (std::is_unsigned<T>::value)
+            return false;
+        else if (signed_value < (int64_t)std::numeric_limits<T>::min())
+            return false;
+        out = (T)signed_value;
+        return true;
+    }
+    if (unsigned_value > (uint64_t)std::numeric_limits<T>::max())
+        return false;
+    out = (T)unsigned_value;
+    return true;
+}
+
+// Scalar view of an object in a raw buffer. STR, BIN and EXT payloads point
+// in to the buffer, ARRAY and MAP report their element/pair count in size.
+class MsgPackRawValue
+{
+public:
+    MsgpackType type = MsgpackType::NIL;
+    int8_t ext_type = 0;
+    bool m_bool = false;
+    int64_t m_int64 = 0;
+    uint64_t m_uint64 = 0;
+    double m_float64 = 0;
+    const unsigned char *data = nullptr;
+    size_t size = 0;
+    size_t offset = 0;
+
+    bool is_nil() const { return type == MsgpackType::NIL; }
+    bool is_str() const { return type == MsgpackType::STR; }
+    bool is_array() const { return type == MsgpackType::ARRAY; }
+    bool is_map() const { return type == MsgpackType::MAP; }
+    bool is_float() const { return type == MsgpackType::FLOAT32 || type == MsgpackType::FLOAT64; }
+    bool is_integer() const { return type == MsgpackType::POSITIVE_FIXINT || type == MsgpackType::NEGATIVE_FIXINT || (type >= MsgpackType::UINT8 && type <= MsgpackType::INT64); }
+
+    std::string_view as_string_view() const
+    {
+        return std::string_view((const char *)data, size);
+    }
+
+    // Converts to T, returns false if the stored type or value does not fit
+    template <typename T>
+    bool get(T &out) const
+    {
+        if constexpr (std::is_same<T, bool>::value)
+        {
+            if (type != MsgpackType::BOOL)
+                return false;
+            out = m_bool;
+            return true;
+        }
+        else if constexpr (std::is_integral<T>::value)
+        {
+            if (!is_integer())
+                return false;
+            bool is_unsigned = type >= MsgpackType::UINT8 && type <= MsgpackType::UINT64;
+            return msgpack_integer_to(!is_unsigned && m_int64 < 0, m_int64, m_uint64, out);
+        }
+        else if constexpr (std::is_floating_point<T>::value)
+        {
+            if (is_float())
+                out = (T)m_float64;
+            else if (type == MsgpackType::UINT64)
+                out = (T)m_uint64;
+            else if (is_integer())
+                out = (T)m_int64;
+            else
+                return false;
+            return true;
+        }
+        else if constexpr (std::is_same<T, std::string>::value)
+        {
+            if (type != MsgpackType::STR)
+                return false;
+            out.assign((const char *)data, size);
+            return true;
+        }
+        else if constexpr (std::is_same<T, std::string_view>::value)
+        {
+            if (type != MsgpackType::STR && type != MsgpackType::BIN && type != MsgpackType::EXT)
+                return false;
+            out = as_string_view();
+            return true;
+        }
+        else
+        {
+            static_assert(std::is_same<T, MsgPackRawValue>::value, "unsupported type");
+            out = *this;
+            return true;
+        }
+    }
+};
+
+// Reads the object at current without decoding nested objects
+inline bool msgpack_read_value(const unsigned char *raw, size_t size, size_t current, MsgPackRawValue &value)
+{
+    MsgPackHeader header;
+    if (!msgpack_read_header(raw, size, current, header))
+        return false;
+
+    const unsigned char *p = raw + current;
+    value.type = header.type;
+    value.ext_type = header.ext_type;
+    value.offset = current;
+    value.data = nullptr;
+    value.size = 0;
+
+    switch (p[0])
+    {
+    case 0xc2:
+    case 0xc3:
+        value.m_bool = p[0] == 0xc3;
+        break;
+    case 0xca:
+    {
+        uint32_t bits = msgpack_load32(p + 1);
+        float f;
+        memcpy(&f, &bits, 4);
+        value.m_float64 = f;
+        break;
+    }
+    case 0xcb:
+    {
+        uint64_t bits = msgpack_load64(p + 1);
+        memcpy(&value.m_float64, &bits, 8);
+        break;
+    }
+    case 0xcc:
+        value.m_uint64 = p[1];
+        break;
+    case 0xcd:
+        value.m_uint64 = msgpack_load16(p + 1);
+        break;
+    case 0xce:
+        value.m_uint64 = msgpack_load32(p + 1);
+        break;
+    case 0xcf:
+        value.m_uint64 = msgpack_load64(p + 1);
+        break;
+    case 0xd0:
+        value.m_int64 = (int8_t)p[1];
+        break;
+    case 0xd1:
+        value.m_int64 = (int16_t)msgpack_load16(p + 1);
+        break;
+    case 0xd2:
+        value.m_int64 = (int32_t)msgpack_load32(p + 1);
+        break;
+    case 0xd3:
+        value.m_int64 = (int64_t)msgpack_load64(p + 1);
+        break;
+    default:
+        if (header.type == MsgpackType::POSITIVE_FIXINT || header.type == MsgpackType::NEGATIVE_FIXINT)
+        {
+            value.m_int64 = (int8_t)p[0];
+        }
+        else if (header.type == MsgpackType::ARRAY || header.type == MsgpackType::MAP)
+        {
+            value.size = header.length;
+        }
+        else if (header.type == MsgpackType::STR || header.type == MsgpackType::BIN || header.type == MsgpackType::EXT)
+        {
+            if (header.length > size - current - header.header_size)
+                return false;
+            value.data = p + header.header_size;
+            value.size = header.length;
+        }
+        break;
+    }
+
+    if (header.type >= MsgpackType::UINT8 && header.type <= MsgpackType::UINT64)
+        value.m_int64 = (int64_t)value.m_uint64;
+    else if (value.is_integer())
+        value.m_uint64 = (uint64_t)value.m_int64;
+
+    return true;
+}
+
+// View of bytes inside a larger buffer. The owner keeps the buffer alive,
+// a slice without an owner borrows memory the caller keeps alive.
+class MsgPackSlice
+{
+public:
+    std::shared_ptr<const void> owner;
+
+    MsgPackSlice() {}
+
+    MsgPackSlice(std::shared_ptr<const void> owner, const unsigned char *data, size_t size)
+        : owner(std::move(owner)), m_data(data), m_size(size)
+    {
+    }
+
+    // Takes ownership of a whole vector
+    MsgPackSlice(std::shared_ptr<std::vector<unsigned char>> value)
+        : owner(value), m_data(value ? value->data() : nullptr), m_size(value ? value->size() : 0)
+    {
+    }
+
+    const unsigned char *data() const { return m_data; }
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    bool is_borrowed() const { return !owner; }
+
+    const unsigned char *begin() const { return m_data; }
+    const unsigned char *end() const { return m_data + m_size; }
+    unsigned char operator[](size_t index) const { return m_data[index]; }
+
+    MsgPackSlice subslice(size_t offset, size_t size) const
+    {
+        return MsgPackSlice(owner, m_data + offset, size);
+    }
+
+    std::vector<unsigned char> to_vector() const
+    {
+        return std::vector<unsigned char>(begin(), end());
+    }
+
+private:
+    const unsigned char *m_data = nullptr;
+    size_t m_size = 0;
+};
+
+// Index of the first '"', '\\' or control character at or after i, size
+// if there is none. With SSE2, 16 bytes are checked at a time.
+inline size_t msgpack_json_special(const char *s, size_t i, size_t size)
+{
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1f);
+    for (; i + 16 <= size; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i special = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, control), v),
+                                       _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)));
+        int mask = _mm_movemask_epi8(special);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+    while (i < size && (unsigned char)s[i] >= 0x20 && s[i] != '"' && s[i] != '\\')
+        i++;
+    return i;
+}
+
+// Appends s as a quoted JSON string. Bytes >= 0x80 are copied as they are,
+// so valid UTF-8 stays valid.
+inline void msgpack_json_escape(std::string &out, const char *s, size_t size)
+{
+    static const char hex[] = "0123456789abcdef";
+    out.push_back('"');
+    size_t start = 0;
+    size_t i = 0;
+    while ((i = msgpack_json_special(s, i, size)) < size)
+    {
+        out.append(s + start, i - start);
+        unsigned char c = s[i];
+        switch (c)
+        {
+        case '"':
+            out.append("\\\"");
+            break;
+        case '\\':
+            out.append("\\\\");
+            break;
+        case '\n':
+            out.append("\\n");
+            break;
+        case '\r':
+            out.append("\\r");
+            break;
+        case '\t':
+            out.append("\\t");
+            break;
+        case '\b':
+            out.append("\\b");
+            break;
+        case '\f':
+            out.append("\\f");
+            break;
+        default:
+            out.append("\\u00");
+            out.push_back(hex[c >> 4]);
+            out.push_back(hex[c & 0xf]);
+        }
+        start = ++i;
+    }
+    out.append(s + start, size - start);
+    out.push_back('"');
+}
+
+inline void msgpack_base64(std::string &out, const unsigned char *data, size_t size)
+{
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t i = 0;
+    for (; i + 3 <= size; i += 3)
+    {
+        uint32_t n = (uint32_t)data[i] << 16 | (uint32_t)data[i + 1] << 8 | data[i + 2];
+        out.push_back(table[n >> 18]);
+        out.push_back(table[(n >> 12) & 63]);
+        out.push_back(table[(n >> 6) & 63]);
+        out.push_back(table[n & 63]);
+    }
+    if (i < size)
+    {
+        uint32_t n = (uint32_t)data[i] << 16 | (i + 1 < size ? (uint32_t)data[i + 1] << 8 : 0);
+        out.push_back(table[n >> 18]);
+        out.push_back(table[(n >> 12) & 63]);
+        out.push_back(i + 1 < size ? table[(n >> 6) & 63] : '=');
+        out.push_back('=');
+    }
+}
+
+// Transcodes the object at current to JSON appended to out, straight from
+// the raw bytes, and advances current past it. BIN becomes a base64 string,
+// EXT becomes {"type":n,"data":"<base64>"}, non string map keys are written
+// as strings and NaN/infinity as null. Returns false for malformed input or
+// container map keys, out then holds a partial document.
+inline bool msgpack_to_json(const unsigned char *raw, size_t size, size_t &current, std::string &out)
+{
+    typedef struct
+    {
+        uint64_t count; // Items, keys and values counted separately
+        uint64_t next;
+        bool map;
+    } Frame;
+
+    std::vector<Frame> stack;
+    char number[32];
+
+    do
+    {
+        bool key = false;
+        if (!stack.empty())
+        {
+            Frame &frame = stack.back();
+            key = frame.map && frame.next % 2 == 0;
+            if (frame.map && !key)
+                out.push_back(':');
+            else if (frame.next > 0)
+                out.push_back(',');
+            frame.next++;
+        }
+
+        MsgPackHeader header;
+        if (!msgpack_read_header(raw, size, current, header))
+            return false;
+        if (header.type != MsgpackType::ARRAY && header.type != MsgpackType::MAP && header.length > size - current - header.header_size)
+            return false;
+        const unsigned char *payload = raw + current + header.header_size;
+
+        // Keys must be JSON strings. STR and BIN (base64) already are, EXT
+        // keys are escaped afterwards and other scalars are quoted.
+        if (key && (header.type == MsgpackType::ARRAY || header.type == MsgpackType::MAP))
+            return false;
+        bool quote = key && header.type != MsgpackType::STR && header.type != MsgpackType::BIN && header.type != MsgpackType::EXT;
+        size_t start = out.size();
+        if (quote)
+            out.push_back('"');
+
+        switch (header.type)
+        {
+        case MsgpackType::NIL:
+            out.append("null");
+            break;
+        case MsgpackType::BOOL:
+            out.append(raw[current] == 0xc3 ? "true" : "false");
+            break;
+        case MsgpackType::STR:
+            msgpack_json_escape(out, (const char *)payload, header.length);
+            break;
+        case MsgpackType::BIN:
+            out.push_back('"');
+            msgpack_base64(out, payload, header.length);
+            out.push_back('"');
+            break;
+        case MsgpackType::EXT:
+            out.append("{\"type\":");
+            out.append(number, std::to_chars(number, number + sizeof(number), (int)header.ext_type).ptr);
+            out.append(",\"data\":\"");
+            msgpack_base64(out, payload, header.length);
+            out.append("\"}");
+            break;
+        case MsgpackType::ARRAY:
+        case MsgpackType::MAP:
+            out.push_back(header.type == MsgpackType::ARRAY ? '[' : '{');
+            if (header.length == 0)
+                out.push_back(header.type == MsgpackType::ARRAY ? ']' : '}');
+            else
+                stack.push_back({header.type == MsgpackType::MAP ? (uint64_t)header.length * 2 : header.length, 0, header.type == MsgpackType::MAP});
+            break;
+        default:
+        {
+            MsgPackRawValue value;
+            msgpack_read_value(raw, size, current, value);
+            char *end;
+            if (value.is_float() && !std::isfinite(value.m_float64))
+            {
+                end = number + 4;
+                memcpy(number, "null", 4);
+            }
+            else if (header.type == MsgpackType::FLOAT32)
+                end = std::to_chars(number, number + sizeof(number), (float)value.m_float64).ptr;
+            else if (header.type == MsgpackType::FLOAT64)
+                end = std::to_chars(number, number + sizeof(number), value.m_float64).ptr;
+            else if (header.type >= MsgpackType::UINT8 && header.type <= MsgpackType::UINT64)
+                end = std::to_chars(number, number + sizeof(number), value.m_uint64).ptr;
+            else
+                end = std::to_chars(number, number + sizeof(number), value.m_int64).ptr;
+            out.append(number, end);
+        }
+        }
+
+        if (quote)
+            out.push_back('"');
+        if (key && header.type == MsgpackType::EXT)
+        {
+            std::string text = out.substr(start);
+            out.resize(start);
+            msgpack_json_escape(out, text.data(), text.size());
+        }
+
+        current += header.header_size;
+        if (header.type != MsgpackType::ARRAY && header.type != MsgpackType::MAP)
+            current += header.length;
+
+        while (!stack.empty() && stack.back().next == stack.back().count)
+        {
+            out.push_back(stack.back().map ? '}' : ']');
+            stack.pop_back();
+        }
+    } while (!stack.empty());
+
+    return true;
+}
+
+inline bool msgpack_to_json(const unsigned char *raw, size_t size, std::string &out)
+{
+    size_t current = 0;
+    return msgpack_to_json(raw, size, current, out);
+}
+
+// Decoders never reserve more elements than this for a container up front,
+// a header can claim far more than the input holds
+#define MSGPACK_MAX_RESERVE 1024
+
+// Bounds on what decoding untrusted input may build, 0 for no bound. The
+// object at which a bound is crossed is reported as the error.
+typedef struct MsgPackLimits
+{
+    size_t max_depth = MSGPACK_DEFAULT_MAX_DEPTH; // Nesting of arrays and maps
+    size_t max_container = 0;                     // Elements of an array, pairs of a map
+    size_t max_nodes = 0;                         // Objects decoded in total, containers included
+    size_t max_bytes = 0;                         // STR, BIN and EXT payload bytes in total
+} MsgPackLimits;
+
+// Node of a MsgPackDocument. Containers refer to their children through the
+// document's child table, STR/BIN/EXT payloads to the document's bytes.
+typedef struct MsgPackNode
+{
+    MsgpackType type;
+    int8_t ext_type;
+    uint32_t length; // Payload bytes for STR/BIN/EXT, elements for ARRAY, pairs for MAP
+    union
+    {
+        bool m_bool;
+        int64_t m_int64;
+        uint64_t m_uint64;
+        double m_float64;
+        uint64_t offset; // STR, BIN, EXT
+        uint64_t first;  // ARRAY, MAP
+    };
+} MsgPackNode;
+
+// Plain handle to a node of an immutable document. Copying it costs nothing
+// and reading through it needs no atomic operations, so one document can be
+// shared by any number of reader threads.
+class MsgPackRef
+{
+public:
+    MsgPackRef() {}
+    MsgPackRef(const MsgPackNode *nodes, const uint32_t *children, const unsigned char *bytes, uint32_t index)
+        : m_nodes(nodes), m_children(children), m_bytes(bytes), m_index(index) {}
+
+    bool valid() const { return m_nodes != nullptr; }
+    explicit operator bool() const { return valid(); }
+
+    inline const MsgPackNode &node() const;
+    MsgpackType type() const { return m_nodes ? node().type : MsgpackType::NIL; }
+
+    bool is_nil() const { return type() == MsgpackType::NIL; }
+    bool is_bool() const { return type() == MsgpackType::BOOL; }
+    bool is_str() const { return type() == MsgpackType::STR; }
+    bool is_bin() const { return type() == MsgpackType::BIN; }
+    bool is_ext() const { return type() == MsgpackType::EXT; }
+    bool is_array() const { return type() == MsgpackType::ARRAY; }
+    bool is_map() const { return type() == MsgpackType::MAP; }
+    bool is_float() const { return type() == MsgpackType::FLOAT32 || type() == MsgpackType::FLOAT64; }
+    bool is_integer() const { return type() == MsgpackType::POSITIVE_FIXINT || type() == MsgpackType::NEGATIVE_FIXINT || (type() >= MsgpackType::UINT8 && type() <= MsgpackType::INT64); }
+    bool is_timestamp() const { return is_ext() && node().ext_type == -1; }
+
+    bool as_bool() const { return is_bool() && node().m_bool; }
+    int64_t as_int64() const { return is_integer() ? node().m_int64 : 0; }
+    uint64_t as_uint64() const { return is_integer() ? node().m_uint64 : 0; }
+    double as_double() const
+    {
+        if (is_float())
+            return node().m_float64;
+        if (type() == MsgpackType::UINT64)
+            return (double)node().m_uint64;
+        return (double)as_int64();
+    }
+
+    // STR, BIN and EXT payloads point in to the document
+    inline std::string_view as_string() const;
+    inline MsgPackSlice as_bin() const;
+    int8_t ext_type() const { return is_ext() ? node().ext_type : 0; }
+
+    // Throws for a timestamp outside the int64_t range of nanoseconds
+    inline int64_t as_timestamp_ns() const;
+
+    // Elements of an array, pairs of a map
+    size_t size() const { return (is_array() || is_map()) ? node().length : 0; }
+
+    inline MsgPackRef operator[](size_t index) const;
+    inline MsgPackRef key(size_t index) const;
+    inline MsgPackRef value(size_t index) const;
+
+    // Map lookup, an invalid ref if absent
+    inline MsgPackRef find(std::string_view key) const;
+    inline MsgPackRef find(int64_t key) const;
+
+    template <typename T>
+    bool get(T &out) const
+    {
+        if constexpr (std::is_same<T, bool>::value)
+        {
+            if (!is_bool())
+                return false;
+            out = as_bool();
+        }
+        else if constexpr (std::is_integral<T>::value)
+        {
+            if (!is_integer())
+                return false;
+            bool is_unsigned = type() >= MsgpackType::UINT8 && type() <= MsgpackType::UINT64;
+            if (!msgpack_integer_to(!is_unsigned && as_int64() < 0, as_int64(), as_uint64(), out))
+                return false;
+        }
+        else if constexpr (std::is_floating_point<T>::value)
+        {
+            if (!is_float() && !is_integer())
+                return false;
+            out = (T)as_double();
+        }
+        else
+        {
+            static_assert(std::is_same<T, std::string>::value || std::is_same<T, std::string_view>::value, "unsupported type");
+            if (!is_str())
+                return false;
+            out = T(as_string());
+        }
+        return true;
+    }
+
+private:
+    MsgPackRef child(size_t index) const { return MsgPackRef(m_nodes, m_children, m_bytes, m_children[index]); }
+
+    const MsgPackNode *m_nodes = nullptr;
+    const uint32_t *m_children = nullptr;
+    const unsigned char *m_bytes = nullptr;
+    uint32_t m_index = 0;
+};
+
+// Storage policies of MsgPackBasicDocument, a table type for the source
+// bytes, the nodes and the child indexes. Heap tables grow as needed.
+template <typename T>
+class MsgPackHeapTable
+{
+public:
+    static constexpr bool bounded = false;
+
+    bool assign(const T *items, size_t count)
+    {
+        m_items.assign(items, items + count);
+        return true;
+    }
+
+    bool push_back(const T &item)
+    {
+        m_items.push_back(item);
+        return true;
+    }
+
+    bool resize(size_t count)
+    {
+        m_items.resize(count);
+        return true;
+    }
+
+    void clear() { m_items.clear(); }
+
+    size_t size() const { return m_items.size(); }
+    bool empty() const { return m_items.empty(); }
+    T *data() { return m_items.data(); }
+    const T *data() const { return m_items.data(); }
+    T &operator[](size_t index) { return m_items[index]; }
+    const T &operator[](size_t index) const { return m_items[index]; }
+
+    std::vector<T> &items() { return m_items; }
+
+private:
+    std::vector<T> m_items;
+};
+
+// Table in caller provided memory, it never allocates. Running out of
+// capacity fails the parse with MSGPACK_ERROR_CAPACITY.
+template <typename T>
+class MsgPackFixedTable
+{
+public:
+    static constexpr bool bounded = true;
+
+    MsgPackFixedTable() {}
+    MsgPackFixedTable(T *items, size_t capacity) : m_items(items), m_capacity(capacity) {}
+
+    template <size_t N>
+    MsgPackFixedTable(T (&items)[N]) : MsgPackFixedTable(items, N) {}
+
+    bool assign(const T *items, size_t count)
+    {
+        if (count > m_capacity)
+            return false;
+        std::copy(items, items + count, m_items);
+        m_size = count;
+        return true;
+    }
+
+    bool push_back(const T &item)
+    {
+        if (m_size == m_capacity)
+            return false;
+        m_items[m_size++] = item;
+        return true;
+    }
+
+    bool resize(size_t count)
+    {
+        if (count > m_capacity)
+            return false;
+        m_size = count;
+        return true;
+    }
+
+    void clear() { m_size = 0; }
+
+    size_t size() const { return m_size; }
+    size_t capacity() const { return m_capacity; }
+    bool empty() const { return m_size == 0; }
+    T *data() { return m_items; }
+    const T *data() const { return m_items; }
+    T &operator[](size_t index) { return m_items[index]; }
+    const T &operator[](size_t index) const { return m_items[index]; }
+
+private:
+    T *m_items = nullptr;
+    size_t m_capacity = 0;
+    size_t m_size = 0;
+};
+
+// Immutable decoded object. The source bytes are copied in once and all
+// nodes live in flat tables, there is no per node allocation or reference
+// count. parse() can be called again to reuse the capacity of the tables,
+// refs in to the previous object are then invalid.
+template <template <typename> class Table>
+class MsgPackBasicDocument
+{
+public:
+    MsgPackBasicDocument() {}
+
+    MsgPackBasicDocument(Table<unsigned char> bytes, Table<MsgPackNode> nodes, Table<uint32_t> children)
+        : m_bytes(bytes), m_nodes(nodes), m_children(children) {}
+
+    // Decodes the first object in raw, false if it is malformed
+    bool parse(const unsigned char *raw, size_t size)
+    {
+        if (!m_bytes.assign(raw, size))
+        {
+            clear();
+            m_error = MsgPackDecodeError();
+            return fail(MSGPACK_ERROR_CAPACITY, 0);
+        }
+        return build();
+    }
+
+    void clear()
+    {
+        m_bytes.clear();
+        m_nodes.clear();
+        m_children.clear();
+        m_consumed = 0;
+    }
+
+    // Strict documents fail to parse STR payloads that are not valid UTF-8
+    void set_strict(bool strict) { m_strict = strict; }
+    bool strict() const { return m_strict; }
+
+    void set_limits(const MsgPackLimits &limits) { m_limits = limits; }
+    const MsgPackLimits &limits() const { return m_limits; }
+
+    MsgPackRef root() const { return m_nodes.empty() ? MsgPackRef() : MsgPackRef(m_nodes.data(), m_children.data(), m_bytes.data(), 0); }
+
+    // Bytes of the source used by the root object
+    size_t consumed() const { return m_consumed; }
+
+    // Why the last parse() failed
+    const MsgPackDecodeError &error() const { return m_error; }
+    size_t node_count() const { return m_nodes.size(); }
+
+    const Table<unsigned char> &bytes() const { return m_bytes; }
+    const Table<MsgPackNode> &nodes() const { return m_nodes; }
+    const Table<uint32_t> &children() const { return m_children; }
+
+protected:
+    bool build()
+    {
+        m_nodes.clear();
+        m_children.clear();
+        m_consumed = 0;
+        m_depth = 0;
+        m_pending = 0;
+        m_payload_bytes = 0;
+        m_error = MsgPackDecodeError();
+
+        size_t current = 0;
+        if (!build_node(current))
+        {
+            m_nodes.clear();
+            m_children.clear();
+            return false;
+        }
+        m_consumed = current;
+        return true;
+    }
+
+    bool build_node(size_t &current)
+    {
+        const unsigned char *raw = m_bytes.data();
+        size_t size = m_bytes.size();
+
+        MsgPackRawValue value;
+        if (!msgpack_read_value(raw, size, current, value))
+            return fail(current < size && raw[current] == 0xc1 ? MSGPACK_ERROR_RESERVED : MSGPACK_ERROR_TRUNCATED, current);
+
+        size_t start = current;
+        if (m_limits.max_nodes && m_nodes.size() >= m_limits.max_nodes)
+            return fail(MSGPACK_ERROR_LIMIT, start);
+
+        MsgPackNode node;
+        node.type = value.type;
+        node.ext_type = value.ext_type;
+        node.length = 0;
+        node.m_uint64 = 0;
+
+        MsgPackHeader header;
+        msgpack_read_header(raw, size, current, header);
+        current += header.header_size;
+
+        switch (value.type)
+        {
+        case MsgpackType::BOOL:
+            node.m_bool = value.m_bool;
+            break;
+        case MsgpackType::FLOAT32:
+        case MsgpackType::FLOAT64:
+            node.m_float64 = value.m_float64;
+            break;
+        case MsgpackType::STR:
+            if (m_strict && !msgpack_utf8_valid(raw + current, header.length))
+                return fail(MSGPACK_ERROR_INVALID_UTF8, start);
+            [[fallthrough]];
+        case MsgpackType::BIN:
+        case MsgpackType::EXT:
+            int64_t seconds;
+            uint32_t nanoseconds;
+            if (value.type == MsgpackType::EXT && header.ext_type == -1 && !msgpack_read_timestamp(raw + current, header.length, seconds, nanoseconds))
+                return fail(MSGPACK_ERROR_TIMESTAMP, start);
+            m_payload_bytes += header.length;
+            if (m_limits.max_bytes && m_payload_bytes > m_limits.max_bytes)
+                return fail(MSGPACK_ERROR_LIMIT, start);
+            node.length = header.length;
+            node.offset = current;
+            current += header.length;
+            break;
+        case MsgpackType::ARRAY:
+        case MsgpackType::MAP:
+            if (m_limits.max_container && header.length > m_limits.max_container)
+                return fail(MSGPACK_ERROR_LIMIT, start);
+            if (m_limits.max_depth && m_depth >= m_limits.max_depth)
+                return fail(MSGPACK_ERROR_DEPTH, start);
+            node.length = header.length;
+            break;
+        default:
+            node.m_int64 = value.m_int64; // Integers, m_uint64 shares the bits
+            break;
+        }
+
+        uint32_t index = (uint32_t)m_nodes.size();
+        if (!m_nodes.push_back(node))
+            return fail(MSGPACK_ERROR_CAPACITY, start);
+
+        if (value.type != MsgpackType::ARRAY && value.type != MsgpackType::MAP)
+            return true;
+
+        // Every child takes at least one byte, and so does every child still
+        // to come in the enclosing containers. Don't trust the count further,
+        // the child table then never outgrows the input.
+        uint64_t count = (uint64_t)header.length * (value.type == MsgpackType::MAP ? 2 : 1);
+        if (count > size - current - m_pending)
+            return fail(MSGPACK_ERROR_TRUNCATED, start);
+
+        size_t first = m_children.size();
+        m_nodes[index].first = first;
+        if (!m_children.resize(first + (size_t)count))
+            return fail(MSGPACK_ERROR_CAPACITY, start);
+        m_depth++;
+        m_pending += count;
+        for (uint64_t i = 0; i < count; i++)
+        {
+            uint32_t child = (uint32_t)m_nodes.size();
+            m_pending--;
+            if (!build_node(current))
+            {
+                // Naming the child allocates, bounded documents leave the path empty
+                if constexpr (!Table<MsgPackNode>::bounded)
+                    prepend_path(value.type == MsgpackType::MAP, first, (size_t)i);
+                return false;
+            }
+            m_children[first + (size_t)i] = child;
+        }
+        m_depth--;
+        return true;
+    }
+
+    bool fail(MsgPackError code, size_t offset)
+    {
+        m_error.code = code;
+        m_error.offset = offset;
+        return false;
+    }
+
+    // Map values are named by their key, keys by their pair index
+    void prepend_path(bool map, size_t first, size_t failed)
+    {
+        if (!map)
+        {
+            m_error.prepend(failed);
+            return;
+        }
+
+        const MsgPackNode *key = failed % 2 ? &m_nodes[m_children[first + failed - 1]] : nullptr;
+        if (key && key->type == MsgpackType::STR)
+            m_error.prepend(std::string_view((const char *)m_bytes.data() + key->offset, key->length));
+        else if (key && (key->type == MsgpackType::POSITIVE_FIXINT || key->type == MsgpackType::NEGATIVE_FIXINT || (key->type >= MsgpackType::INT8 && key->type <= MsgpackType::INT64)))
+            m_error.prepend(std::to_string(key->m_int64));
+        else if (key && key->type >= MsgpackType::UINT8 && key->type <= MsgpackType::UINT64)
+            m_error.prepend(std::to_string(key->m_uint64));
+        else
+            m_error.prepend(failed / 2);
+    }
+
+    Table<unsigned char> m_bytes;
+    Table<MsgPackNode> m_nodes;
+    Table<uint32_t> m_children;
+    size_t m_consumed = 0;
+    bool m_strict = false;
+    MsgPackLimits m_limits;
+    size_t m_depth = 0;
+    uint64_t m_pending = 0; // Children of open containers not yet built
+    uint64_t m_payload_bytes = 0;
+    MsgPackDecodeError m_error;
+};
+
+// Document on the heap, its tables grow to fit whatever is parsed
+class MsgPackDocument : public MsgPackBasicDocument<MsgPackHeapTable>
+{
+public:
+    MsgPackDocument() {}
+
+    MsgPackDocument(const unsigned char *raw, size_t size)
+    {
+        if (!parse(raw, size))
+        {
+            MSGPACK_THROW("That went wrong");
+        }
+    }
+
+    MsgPackDocument(const std::vector<unsigned char> &raw) : MsgPackDocument(raw.data(), raw.size()) {}
+
+    using MsgPackBasicDocument::parse;
+
+    bool parse(std::vector<unsigned char> &&raw)
+    {
+        m_bytes.items() = std::move(raw);
+        return build();
+    }
+};
+
+// Document in caller provided storage, for targets that must not allocate.
+// Every node but the root is a child, so as many child slots as nodes is
+// always enough:
+//
+//     unsigned char bytes[4096];
+//     MsgPackNode nodes[256];
+//     uint32_t children[256];
+//     MsgPackFixedDocument document(bytes, nodes, children);
+typedef MsgPackBasicDocument<MsgPackFixedTable> MsgPackFixedDocument;
+
+inline const MsgPackNode &MsgPackRef::node() const
+{
+    return m_nodes[m_index];
+}
+
+inline std::string_view MsgPackRef::as_string() const
+{
+    if (!is_str() && !is_bin() && !is_ext())
+        return std::string_view();
+    const MsgPackNode &n = node();
+    return std::string_view((const char *)m_bytes + n.offset, n.length);
+}
+
+inline MsgPackSlice MsgPackRef::as_bin() const
+{
+    std::string_view bytes = as_string();
+    return MsgPackSlice(nullptr, (const unsigned char *)bytes.data(), bytes.size());
+}
+
+inline int64_t MsgPackRef::as_timestamp_ns() const
+{
+    int64_t seconds = 0;
+    uint32_t nanoseconds = 0;
+    int64_t ns = 0;
+    if (is_timestamp())
+        msgpack_read_timestamp(m_bytes + node().offset, node().length, seconds, nanoseconds);
+    if (!msgpack_timestamp_ns(seconds, nanoseconds, ns))
+        MSGPACK_THROW("timestamp out of range");
+    return ns;
+}
+
+inline MsgPackRef MsgPackRef::operator[](size_t index) const
+{
+    if (!is_array() || index >= node().length)
+        return MsgPackRef();
+    return child(node().first + index);
+}
+
+inline MsgPackRef MsgPackRef::key(size_t index) const
+{
+    if (!is_map() || index >= node().length)
+        return MsgPackRef();
+    return child(node().first + index * 2);
+}
+
+inline MsgPackRef MsgPackRef::value(size_t index) const
+{
+    if (!is_map() || index >= node().length)
+        return MsgPackRef();
+    return child(node().first + index * 2 + 1);
+}
+
+inline MsgPackRef MsgPackRef::find(std::string_view key) const
+{
+    if (!is_map())
+        return MsgPackRef();
+
+    // Last duplicate wins, as for MsgPackObj
+    for (size_t i = node().length; i-- > 0;)
+    {
+        MsgPackRef k = this->key(i);
+        if (k.is_str() && k.as_string() == key)
+            return value(i);
+    }
+    return MsgPackRef();
+}
+
+inline MsgPackRef MsgPackRef::find(int64_t key) const
+{
+    if (!is_map())
+        return MsgPackRef();
+
+    for (size_t i = node().length; i-- > 0;)
+    {
+        MsgPackRef k = this->key(i);
+        if (k.is_integer() && k.as_int64() == key && !(k.type() == MsgpackType::UINT64 && k.as_uint64() > (uint64_t)INT64_MAX))
+            return value(i);
+    }
+    return MsgPackRef();
+}
+
+// Reusable decoder, the document it decodes in to keeps its capacity so
+// after a few messages decoding no longer allocates. The root returned by
+// decode() is valid until the next call.
+class MsgPackDecoder
+{
+public:
+    MsgPackRef decode(const unsigned char *raw, size_t size)
+    {
+        return m_document.parse(raw, size) ? m_document.root() : MsgPackRef();
+    }
+
+    MsgPackRef decode(const std::vector<unsigned char> &raw)
+    {
+        return decode(raw.data(), raw.size());
+    }
+
+    const MsgPackDocument &document() const { return m_document; }
+
+    // Decoder owned by the calling thread
+    static MsgPackDecoder &local()
+    {
+        static thread_local MsgPackDecoder decoder;
+        return decoder;
+    }
+
+private:
+    MsgPackDocument m_document;
+};
+
+// Free list of reusable objects. Handles return their object to the pool
+// when destroyed, from any thread, but the pool must outlive every handle
+// it gave out. Objects come back as they were released, so callers reset
+// whatever state they need. The free list is a lock free stack, the most
+// recently released (warmest) object is handed out first.
+template <typename T>
+class MsgPackPool
+{
+public:
+    class Release
+    {
+    public:
+        Release(MsgPackPool *pool = nullptr) : m_pool(pool) {}
+
+        void operator()(T *object) const
+        {
+            if (m_pool)
+                m_pool->release(object);
+            else
+                delete object;
+        }
+
+    private:
+        MsgPackPool *m_pool;
+    };
+
+    typedef std::unique_ptr<T, Release> Handle;
+
+    MsgPackPool(size_t max_free = 64) : m_slots(new Slot[max_free])
+    {
+        // Every slot starts on the empty stack
+        for (size_t i = 0; i < max_free; i++)
+            m_slots[i].next.store(i + 1 < max_free ? (uint32_t)(i + 2) : 0, std::memory_order_relaxed);
+        m_empty.store(max_free ? 1 : 0, std::memory_order_relaxed);
+    }
+
+    ~MsgPackPool()
+    {
+        while (uint32_t slot = pop(m_full))
+            delete m_slots[slot - 1].object;
+    }
+
+    MsgPackPool(const MsgPackPool &) = delete;
+    MsgPackPool &operator=(const MsgPackPool &) = delete;
+
+    Handle acquire()
+    {
+        T *object;
+        uint32_t slot = pop(m_full);
+        if (slot)
+        {
+            object = m_slots[slot - 1].object;
+            m_free_count.fetch_sub(1, std::memory_order_relaxed);
+            push(m_empty, slot);
+        }
+        else
+        {
+            object = new T();
+        }
+        return Handle(object, Release(this));
+    }
+
+    // Objects waiting in the free list, exact once other threads are idle
+    size_t free_count() const
+    {
+        return m_free_count.load(std::memory_order_relaxed);
+    }
+
+private:
+    typedef struct
+    {
+        T *object;
+        std::atomic<uint32_t> next;
+    } Slot;
+
+    void release(T *object)
+    {
+        uint32_t slot = pop(m_empty);
+        if (!slot)
+        {
+            delete object;
+            return;
+        }
+        m_slots[slot - 1].object = object;
+        m_free_count.fetch_add(1, std::memory_order_relaxed);
+        push(m_full, slot);
+    }
+
+    // Treiber stacks of slots. A head holds slot index + 1 (0 when empty)
+    // in its low half and a counter in the high half, bumped on every
+    // change, so a slot popped and pushed back in between fails the CAS.
+    uint32_t pop(std::atomic<uint64_t> &head)
+    {
+        uint64_t old = head.load(std::memory_order_acquire);
+        for (;;)
+        {
+            uint32_t slot = (uint32_t)old;
+            if (!slot)
+                return 0;
+            uint64_t next = m_slots[slot - 1].next.load(std::memory_order_relaxed);
+            if (head.compare_exchange_weak(old, ((old >> 32) + 1) << 32 | next, std::memory_order_acquire, std::memory_order_acquire))
+                return slot;
+        }
+    }
+
+    void push(std::atomic<uint64_t> &head, uint32_t slot)
+    {
+        uint64_t old = head.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            m_slots[slot - 1].next.store((uint32_t)old, std::memory_order_relaxed);
+            if (head.compare_exchange_weak(old, ((old >> 32) + 1) << 32 | slot, std::memory_order_release, std::memory_order_relaxed))
+                return;
+        }
+    }
+
+    std::unique_ptr<Slot[]> m_slots;
+    std::atomic<uint64_t> m_full{0};  // Slots holding a free object
+    std::atomic<uint64_t> m_empty{0}; // Slots available to release()
+    std::atomic<size_t> m_free_count{0};
+};
+
+// Pool of documents for when decoded documents must outlive the next message
+class MsgPackDocumentPool : public MsgPackPool<MsgPackDocument>
+{
+public:
+    MsgPackDocumentPool(size_t max_free = 64) : MsgPackPool<MsgPackDocument>(max_free) {}
+
+    // Decodes in to a pooled document, an empty handle if raw is malformed
+    Handle decode(const unsigned char *raw, size_t size)
+    {
+        Handle document = acquire();
+        if (!document->parse(raw, size))
+            document.reset();
+        return document;
+    }
+
+    // Pool owned by the calling thread
+    static MsgPackDocumentPool &local()
+    {
+        static thread_local MsgPackDocumentPool pool;
+        return pool;
+    }
+};
+
+// Pool of encode buffers, cleared buffers keep their capacity
+typedef MsgPackPool<std::vector<unsigned char>> MsgPackBufferPool;
+
+// Bounded single producer, single consumer ring buffer. Values are moved in
+// and out, so ownership of documents, pool handles or frame buffers passes
+// cleanly from one pipeline stage to the next.
+template <typename T>
+class MsgPackSpscQueue
+{
+public:
+    MsgPackSpscQueue(size_t capacity)
+    {
+        size_t size = 2;
+        while (size < capacity)
+            size <<= 1;
+        m_mask = size - 1;
+        m_slots.reset(new Slot[size]);
+    }
+
+    ~MsgPackSpscQueue()
+    {
+        T value;
+        while (try_pop(value))
+        {
+        }
+    }
+
+    MsgPackSpscQueue(const MsgPackSpscQueue &) = delete;
+    MsgPackSpscQueue &operator=(const MsgPackSpscQueue &) = delete;
+
+    size_t capacity() const { return m_mask + 1; }
+
+    // Producer only, false if full (value is left untouched)
+    bool try_push(T &&value)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head_cache > m_mask)
+        {
+            m_head_cache = m_head.load(std::memory_order_acquire);
+            if (tail - m_head_cache > m_mask)
+                return false;
+        }
+        new (m_slots[tail & m_mask].data) T(std::move(value));
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only, false if empty
+    bool try_pop(T &out)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail_cache)
+        {
+            m_tail_cache = m_tail.load(std::memory_order_acquire);
+            if (head == m_tail_cache)
+                return false;
+        }
+        T *value = (T *)m_slots[head & m_mask].data;
+        out = std::move(*value);
+        value->~T();
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    typedef struct
+    {
+        alignas(T) unsigned char data[sizeof(T)];
+    } Slot;
+
+    // Producer and consumer state on separate cache lines
+    alignas(64) std::atomic<size_t> m_tail{0};
+    size_t m_head_cache = 0;
+    alignas(64) std::atomic<size_t> m_head{0};
+    size_t m_tail_cache = 0;
+    alignas(64) size_t m_mask;
+    std::unique_ptr<Slot[]> m_slots;
+};
+
+// Bounded multi producer, multi consumer queue (Vyukov's sequence numbered
+// ring). Each slot carries a sequence number so producers and consumers
+// only contend on their own position counter.
+template <typename T>
+class MsgPackMpmcQueue
+{
+public:
+    MsgPackMpmcQueue(size_t capacity)
+    {
+        size_t size = 2;
+        while (size < capacity)
+            size <<= 1;
+        m_mask = size - 1;
+        m_slots.reset(new Slot[size]);
+        for (size_t i = 0; i < size; i++)
+            m_slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    ~MsgPackMpmcQueue()
+    {
+        T value;
+        while (try_pop(value))
+        {
+        }
+    }
+
+    MsgPackMpmcQueue(const MsgPackMpmcQueue &) = delete;
+    MsgPackMpmcQueue &operator=(const MsgPackMpmcQueue &) = delete;
+
+    size_t capacity() const { return m_mask + 1; }
+
+    // False if full (value is left untouched)
+    bool try_push(T &&value)
+    {
+        size_t position = m_tail.load(std::memory_order_relaxed);
+        Slot *slot;
+        for (;;)
+        {
+            slot = &m_slots[position & m_mask];
+            size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)position;
+            if (diff == 0)
+            {
+                if (m_tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                position = m_tail.load(std::memory_order_relaxed);
+            }
+        }
+        new (slot->data) T(std::move(value));
+        slot->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    // False if empty
+    bool try_pop(T &out)
+    {
+        size_t position = m_head.load(std::memory_order_relaxed);
+        Slot *slot;
+        for (;;)
+        {
+            slot = &m_slots[position & m_mask];
+            size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)(position + 1);
+            if (diff == 0)
+            {
+                if (m_head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                position = m_head.load(std::memory_order_relaxed);
+            }
+        }
+        T *value = (T *)slot->data;
+        out = std::move(*value);
+        value->~T();
+        slot->sequence.store(position + m_mask + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    typedef struct
+    {
+        std::atomic<size_t> sequence;
+        alignas(T) unsigned char data[sizeof(T)];
+    } Slot;
+
+    alignas(64) std::atomic<size_t> m_tail{0};
+    alignas(64) std::atomic<size_t> m_head{0};
+    alignas(64) size_t m_mask;
+    std::unique_ptr<Slot[]> m_slots;
+};
+
+// Queues of pooled documents and of raw frames between pipeline stages
+typedef MsgPackMpmcQueue<MsgPackDocumentPool::Handle> MsgPackDocumentQueue;
+typedef MsgPackMpmcQueue<std::vector<unsigned char>> MsgPackFrameQueue;
+
+// Truncation for MsgPackObj::format(), 0 means no limit
+typedef struct
+{
+    size_t max_depth = 0; // Containers deeper than this are written as (...)
+    size_t max_items = 0; // Entries written per container
+    size_t max_bytes = 0; // Bytes written per STR, BIN or EXT payload
+} MsgPackFormatOptions;
+
+class MsgPackObj
+{
+
+public:
+    bool is_nil() { return type == MsgpackType::NIL; }
+    bool is_bool() { return type == MsgpackType::BOOL; }
+    bool is_bin() { return type == MsgpackType::BIN; }
+    bool is_ext() { return type == MsgpackType::EXT; }
+    bool is_float32() { return type == MsgpackType::FLOAT32; }
+    bool is_float64() { return type == MsgpackType::FLOAT64; }
+    bool is_uint8() { return type == MsgpackType::UINT8 || type == MsgpackType::POSITIVE_FIXINT; }
+    bool is_uint16() { return type == MsgpackType::UINT16; }
+    bool is_uint32() { return type == MsgpackType::UINT32; }
+    bool is_uint64() { return type == MsgpackType::UINT64; }
+    bool is_int8() { return type == MsgpackType::INT8 || type == MsgpackType::POSITIVE_FIXINT || type == MsgpackType::NEGATIVE_FIXINT; }
+    bool is_int16() { return type == MsgpackType::INT16; }
+    bool is_int32() { return type == MsgpackType::INT32; }
+    bool is_int64() { return type == MsgpackType::INT64; }
+    bool is_str() const { return type == MsgpackType::STR; }
+    bool is_array() { return type == MsgpackType::ARRAY; }
+    bool is_map() { return type == MsgpackType::MAP; }
+    bool is_str_map() { return type == MsgpackType::MAP; }
+
+    bool is_unsigned() { return type == MsgpackType::UINT16 || type == MsgpackType::UINT32 || type == MsgpackType::UINT64 || type == MsgpackType::UINT8; }
+    bool is_signed() { return !is_unsigned(); }
+    bool is_integer() const { return type == MsgpackType::POSITIVE_FIXINT || type == MsgpackType::NEGATIVE_FIXINT || (type >= MsgpackType::UINT8 && type <= MsgpackType::INT64); }
+
+    int32_t as_int32()
+    {
+        return as_int64();
+    }
+
+    int32_t as_uint32()
+    {
+        return as_uint64();
+    }
+
+    int64_t as_int64() const
+    {
+        switch (type)
+        {
+        case MsgpackType::POSITIVE_FIXINT:
+        case MsgpackType::NEGATIVE_FIXINT:
+        case MsgpackType::INT8:
+            return m_int8;
+            break;
+        case MsgpackType::UINT8:
+            return m_uint8;
+            break;
+        case MsgpackType::INT16:
+            return m_int16;
+            break;
+        case MsgpackType::UINT16:
+            return m_uint16;
+            break;
+        case MsgpackType::INT32:
+            return m_int32;
+            break;
+        case MsgpackType::UINT32:
+            return m_uint32;
+            break;
+        case MsgpackType::INT64:
+            return m_int64;
+            break;
+        case MsgpackType::UINT64:
+            return m_uint64;
+            break;
+        default:
+            return 0;
+            break;
+        }
+    }
+
+    uint64_t as_uint64() const
+    {
+        switch (type)
+        {
+        case MsgpackType::POSITIVE_FIXINT:
+        case MsgpackType::NEGATIVE_FIXINT:
+        case MsgpackType::INT8:
+            return m_int8;
+            break;
+        case MsgpackType::UINT8:
+            return m_uint8;
+            break;
+        case MsgpackType::INT16:
+            return m_int16;
+            break;
+        case MsgpackType::UINT16:
+            return m_uint16;
+            break;
+        case MsgpackType::INT32:
+            return m_int32;
+            break;
+        case MsgpackType::UINT32:
+            return m_uint32;
+            break;
+        case MsgpackType::INT64:
+            return m_int64;
+            break;
+        case MsgpackType::UINT64:
+            return m_uint64;
+            break;
+        default:
+            return 0;
+            break;
+        }
+    }
+
+    std::string as_string()
+    {
+        if (type == MsgpackType::STR)
+        {
+            return m_str;
+        }
+        return "";
+    }
+
+    std::unordered_map<std::string, std::shared_ptr<MsgPackObj>> as_str_map()
+    {
+        if (type == MsgpackType::MAP)
+        {
+            return m_map_string;
+        }
+
+        MSGPACK_THROW("That went wrong");
+    }
+
+    // All pairs of a map keyed by any scalar type
+    std::unordered_map<MsgPackKey, std::shared_ptr<MsgPackObj>> as_map()
+    {
+        if (type == MsgpackType::MAP)
+        {
+            std::unordered_map<MsgPackKey, std::shared_ptr<MsgPackObj>> ret;
+            ret.reserve(m_map.size());
+            for (const auto &n : m_map)
+            {
+                ret[MsgPackKey(*n.first)] = n.second;
+            }
+            return ret;
+        }
+
+        MSGPACK_THROW("That went wrong");
+    }
+
+    // Look up a map value by key without copying the map, nullptr if absent
+    std::shared_ptr<MsgPackObj> find(const MsgPackKey &key) const
+    {
+        if (type != MsgpackType::MAP)
+            return nullptr;
+
+        if (key.type == MsgpackType::INT64)
+        {
+            uint32_t index = m_map_int.find(key.m_int64);
+            return index == MsgPackIntMap::npos ? nullptr : m_map[index].second;
+        }
+
+        if (key.type == MsgpackType::STR)
+        {
+            auto it = m_map_string.find(key.m_str);
+            return it == m_map_string.end() ? nullptr : it->second;
+        }
+
+        for (auto it = m_map.rbegin(); it != m_map.rend(); ++it)
+        {
+            if (MsgPackKey(*it->first) == key)
+                return it->second;
+        }
+        return nullptr;
+    }
+
+    bool is_timestamp() const { return type == MsgpackType::EXT && m_ext_type == -1; }
+
+    // Timestamp extension as nanoseconds since the epoch, throws if that is
+    // out of the int64_t range
+    int64_t as_timestamp_ns() const
+    {
+        int64_t ns = 0;
+        if (is_timestamp())
+        {
+            if (!msgpack_timestamp_ns(m_int64, m_uint32, ns))
+                MSGPACK_THROW("timestamp out of range");
+            return ns;
+        }
+        MSGPACK_THROW("That went wrong");
+    }
+
+    timespec as_timespec() const
+    {
+        if (is_timestamp())
+        {
+            timespec ret;
+            ret.tv_sec = (time_t)m_int64;
+            ret.tv_nsec = (long)m_uint32;
+            return ret;
+        }
+        MSGPACK_THROW("That went wrong");
+    }
+
+    // std::chrono::sys_time<std::chrono::nanoseconds> in C++20 terms
+    std::chrono::time_point<std::chrono::system_clock, std::chrono::nanoseconds> as_sys_time() const
+    {
+        return std::chrono::time_point<std::chrono::system_clock, std::chrono::nanoseconds>(std::chrono::nanoseconds(as_timestamp_ns()));
+    }
+
+    // Binary payload, a view of the decoded buffer
+    MsgPackSlice as_bin()
+    {
+        if (type == MsgpackType::BIN)
+        {
+            return m_bin;
+        }
+        MSGPACK_THROW("That went wrong");
+    }
+
+    // Extension payload, a view of the decoded buffer
+    MsgPackSlice as_ext()
+    {
+        if (type == MsgpackType::EXT)
+        {
+            return m_ext;
+        }
+        MSGPACK_THROW("That went wrong");
+    }
+
+    std::vector<std::shared_ptr<MsgPackObj>> as_vector()
+    {
+        if (type == MsgpackType::ARRAY)
+        {
+            return m_array;
+        }
+        MSGPACK_THROW("That went wrong");
+    }
+
+    // Converts to T, returns false if the stored type or value does not fit
+    template <typename T>
+    bool get(T &out) const
+    {
+        if constexpr (std::is_same<T, bool>::value)
+        {
+            if (type != MsgpackType::BOOL)
+                return false;
+            out = m_bool;
+            return true;
+        }
+        else if constexpr (std::is_integral<T>::value)
+        {
+            if (!is_integer())
+                return false;
+            bool is_unsigned = type >= MsgpackType::UINT8 && type <= MsgpackType::UINT64;
+            return msgpack_integer_to(!is_unsigned && as_int64() < 0, as_int64(), as_uint64(), out);
+        }
+        else if constexpr (std::is_floating_point<T>::value)
+        {
+            if (type == MsgpackType::FLOAT32)
+                out = (T)m_float32;
+            else if (type == MsgpackType::FLOAT64)
+                out = (T)m_float64;
+            else if (type == MsgpackType::UINT64)
+                out = (T)m_uint64;
+            else if (is_integer())
+                out = (T)as_int64();
+            else
+                return false;
+            return true;
+        }
+        else
+        {
+            static_assert(std::is_same<T, std::string>::value, "unsupported type");
+            if (type != MsgpackType::STR)
+                return false;
+            out = m_str;
+            return true;
+        }
+    }
+
+    void to_raw(std::vector<char> &buffer);
+
+    MsgpackType type;
+    bool m_bool;
+    MsgPackSlice m_bin;
+    int8_t m_ext_type;
+    MsgPackSlice m_ext;
+    float m_float32;
+    double m_float64;
+    uint8_t m_uint8;
+    uint16_t m_uint16;
+    uint32_t m_uint32;
+    uint64_t m_uint64;
+    int8_t m_int8;
+    int16_t m_int16;
+    int32_t m_int32;
+    int64_t m_int64;
+    std::string m_str;
+    std::vector<std::shared_ptr<MsgPackObj>> m_array;
+    std::unordered_map<std::string, std::shared_ptr<MsgPackObj>> m_map_string; // STR keys
+    std::vector<std::pair<std::shared_ptr<MsgPackObj>, std::shared_ptr<MsgPackObj>>> m_map; // All pairs, wire order
+    MsgPackIntMap m_map_int; // Integer keys, indexes in to m_map
+
+    MsgPackObj()
+    {
+        type = MsgpackType::NIL;
+    }
+
+    MsgPackObj(bool value)
+    {
+        type = MsgpackType::BOOL;
+        m_bool = value;
+    }
+
+    MsgPackObj(int8_t value, bool fixed_positive, bool fixed_negative)
+    {
+        if (fixed_positive)
+        {
+            type = MsgpackType::POSITIVE_FIXINT;
+            m_int8 = value & 0x7f;  // Enforce 7 bit size
+            m_uint8 = value & 0x7f; // Both are valid
+        }
+        else if (fixed_negative)
+        {
+            type = MsgpackType::NEGATIVE_FIXINT;
+            m_int8 = value | 0xE0; // Enforce first three bits as 1's
+        }
+        else
+        {
+            type = MsgpackType::INT8;
+            m_int8 = value;
+        }
+    }
+    MsgPackObj(int16_t value)
+    {
+        type = MsgpackType::INT16;
+        m_int16 = value;
+    }
+
+    MsgPackObj(int32_t value)
+    {
+        type = MsgpackType::INT32;
+        m_int32 = value;
+    }
+
+    MsgPackObj(int64_t value)
+    {
+        type = MsgpackType::INT64;
+        m_int64 = value;
+    }
+
+    MsgPackObj(uint8_t value)
+    {
+
+        type = MsgpackType::UINT8;
+        m_uint8 = value;
+    }
+
+    MsgPackObj(uint16_t value)
+    {
+        type = MsgpackType::UINT16;
+        m_uint16 = value;
+    }
+
+    MsgPackObj(uint32_t value)
+    {
+        type = MsgpackType::UINT32;
+        m_uint32 = value;
+    }
+
+    MsgPackObj(uint64_t value)
+    {
+        type = MsgpackType::UINT64;
+        m_uint64 = value;
+    }
+
+    MsgPackObj(float value)
+    {
+        type = MsgpackType::FLOAT32;
+        m_float32 = value;
+    }
+
+    MsgPackObj(double value)
+    {
+        type = MsgpackType::FLOAT64;
+        m_float64 = value;
+    }
+
+    MsgPackObj(std::string value)
+    {
+        type = MsgpackType::STR;
+        m_str = value;
+    }
+
+    MsgPackObj(MsgPackSlice value)
+    {
+        type = MsgpackType::BIN;
+        m_bin = value;
+    }
+
+    MsgPackObj(int8_t ext_type, MsgPackSlice payload)
+    {
+        type = MsgpackType::EXT;
+        m_ext_type = ext_type;
+        m_ext = std::move(payload);
+
+        // Timestamps are unpacked up front in to seconds and nanoseconds
+        if (ext_type == -1 && !msgpack_read_timestamp(m_ext.data(), m_ext.size(), m_int64, m_uint32))
+        {
+            MSGPACK_THROW("invalid timestamp");
+        }
+    }
+
+    MsgPackObj(std::unordered_map<std::string, std::shared_ptr<MsgPackObj>> value)
+    {
+        type = MsgpackType::MAP;
+        m_map.reserve(value.size());
+        for (const auto &n : value)
+        {
+            m_map_string[n.first] = n.second;
+            m_map.emplace_back(std::make_shared<MsgPackObj>(n.first), n.second);
+        }
+    }
+
+    MsgPackObj(std::vector<std::pair<std::shared_ptr<MsgPackObj>, std::shared_ptr<MsgPackObj>>> value)
+    {
+        type = MsgpackType::MAP;
+        m_map = std::move(value);
+
+        std::vector<std::pair<int64_t, uint32_t>> int_keys;
+        for (uint32_t i = 0; i < m_map.size(); i++)
+        {
+            const auto &key = m_map[i].first;
+            if (key->is_str())
+            {
+                m_map_string[key->m_str] = m_map[i].second;
+            }
+            else if (key->is_integer() && !(key->type == MsgpackType::UINT64 && key->m_uint64 > (uint64_t)INT64_MAX))
+            {
+                int_keys.emplace_back(key->as_int64(), i);
+            }
+        }
+        m_map_int.build(int_keys);
+    }
+
+    MsgPackObj(std::vector<std::shared_ptr<MsgPackObj>> value)
+    {
+        type = MsgpackType::ARRAY;
+        m_array = value;
+    }
+
+    ~MsgPackObj()
+    {
+        if (type == MsgpackType::MAP)
+        {
+            /*for (const auto &n : m_map_string)
+            {
+                delete n.second;
+            }*/
+        }
+    }
+
+    // Writes a readable form of the whole tree, e.g. MAP(id : UINT16(300), tags : ARRAY(STR(a))),
+    // to an output iterator and returns the iterator past it
+    template <typename OutputIt>
+    OutputIt format_to(OutputIt out, const MsgPackFormatOptions &options = MsgPackFormatOptions(), size_t depth = 0) const
+    {
+        char number[32];
+        auto put = [&out](std::string_view text)
+        {
+            out = std::copy(text.begin(), text.end(), out);
+        };
+        auto put_number = [&](const char *name, auto value)
+        {
+            put(name);
+            put("(");
+            put(std::string_view(number, std::to_chars(number, number + sizeof(number), value).ptr - number));
+            put(")");
+        };
+        auto put_bytes = [&](const MsgPackSlice &bytes)
+        {
+            static const char hex[] = "0123456789abcdef";
+            size_t size = options.max_bytes && bytes.size() > options.max_bytes ? options.max_bytes : bytes.size();
+            for (size_t i = 0; i < size; i++)
+            {
+                // Same as streaming std::hex, no leading zero
+                put("0x");
+                if (bytes[i] >= 0x10)
+                    put(std::string_view(hex + (bytes[i] >> 4), 1));
+                put(std::string_view(hex + (bytes[i] & 0xf), 1));
+                put(",");
+            }
+            if (size < bytes.size())
+                put("...");
+        };
+
+        switch (type)
+        {
+        case MsgpackType::NIL:
+            put("NIL");
+            break;
+        case MsgpackType::BOOL:
+            put(m_bool ? "BOOL(true)" : "BOOL(false)");
+            break;
+        case MsgpackType::POSITIVE_FIXINT:
+            put_number("POSITIVE_FIXINT", (int)m_int8);
+            break;
+        case MsgpackType::NEGATIVE_FIXINT:
+            put_number("NEGATIVE_FIXINT", (int)m_int8);
+            break;
+        case MsgpackType::INT8:
+            put_number("INT8", (int)m_int8);
+            break;
+        case MsgpackType::INT16:
+            put_number("INT16", m_int16);
+            break;
+        case MsgpackType::INT32:
+            put_number("INT32", m_int32);
+            break;
+        case MsgpackType::INT64:
+            put_number("INT64", m_int64);
+            break;
+        case MsgpackType::UINT8:
+            put_number("UINT8", (unsigned)m_uint8);
+            break;
+        case MsgpackType::UINT16:
+            put_number("UINT16", m_uint16);
+            break;
+        case MsgpackType::UINT32:
+            put_number("UINT32", m_uint32);
+            break;
+        case MsgpackType::UINT64:
+            put_number("UINT64", m_uint64);
+            break;
+        case MsgpackType::FLOAT32:
+            put_number("FLOAT32", m_float32);
+            break;
+        case MsgpackType::FLOAT64:
+            put_number("FLOAT64", m_float64);
+            break;
+        case MsgpackType::BIN:
+            put("BIN(");
+            put_bytes(m_bin);
+            put(")");
+            break;
+        case MsgpackType::STR:
+            put("STR(");
+            if (options.max_bytes && m_str.size() > options.max_bytes)
+            {
+                put(std::string_view(m_str.data(), options.max_bytes));
+                put("...");
+            }
+            else
+                put(m_str);
+            put(")");
+            break;
+        case MsgpackType::EXT:
+            put("EXT(");
+            put(std::string_view(number, std::to_chars(number, number + sizeof(number), (int)m_ext_type).ptr - number));
+            put(", ");
+            put_bytes(m_ext);
+            put(")");
+            break;
+        case MsgpackType::ARRAY:
+        case MsgpackType::MAP:
+        {
+            bool map = type == MsgpackType::MAP;
+            size_t count = map ? m_map.size() : m_array.size();
+            put(map ? "MAP(" : "ARRAY(");
+            if (options.max_depth && depth >= options.max_depth && count > 0)
+            {
+                put("...)");
+                break;
+            }
+            for (size_t i = 0; i < count; i++)
+            {
+                if (i > 0)
+                    put(", ");
+                if (options.max_items && i == options.max_items)
+                {
+                    put("...");
+                    break;
+                }
+                if (!map)
+                {
+                    out = m_array[i]->format_to(out, options, depth + 1);
+                    continue;
+                }
+                // String keys are written bare
+                const MsgPackObj &key = *m_map[i].first;
+                if (key.type == MsgpackType::STR)
+                    put(key.m_str);
+                else
+                    out = key.format_to(out, options, depth + 1);
+                put(" : ");
+                out = m_map[i].second->format_to(out, options, depth + 1);
+            }
+            put(")");
+            break;
+        }
+        default:
+            put("??");
+            break;
+        }
+        return out;
+    }
+
+    // Appends format_to() output to a string, which can be reused
+    void format(std::string &out, const MsgPackFormatOptions &options = MsgPackFormatOptions()) const
+    {
+        format_to(std::back_inserter(out), options);
+    }
+
+    std::string format(const MsgPackFormatOptions &options = MsgPackFormatOptions()) const
+    {
+        std::string out;
+        format(out, options);
+        return out;
+    }
+
+#ifndef MSGPACK_NO_IOSTREAM
+    std::stringstream to_string(bool new_line = true)
+    {
+        std::string out = format();
+        if (new_line)
+            out.push_back('\n');
+        return std::stringstream(out);
+    }
+#endif
+
+    void print(bool new_line = true)
+    {
+        std::string out = format();
+        if (new_line)
+            out.push_back('\n');
+#ifndef MSGPACK_NO_IOSTREAM
+        std::cout << out;
+#else
+        std::fwrite(out.data(), 1, out.size(), stdout);
+#endif
+    }
+};
+
+// Compiled path in to a document, either a JSON pointer ("/records/3/name")
+// or a dotted path ("$.records[3].name"). Numeric segments match array
+// indexes and integer map keys as well as string keys.
+class MsgPackPath
+{
+public:
+    typedef struct
+    {
+        std::string key;
+        int64_t index;
+        bool is_index; // Segment can be used as an array index / integer key
+        bool is_key;   // Segment can be used as a string key
+    } Segment;
+
+    std::vector<Segment> segments;
+
+    MsgPackPath() {}
+
+    MsgPackPath(const char *path) : MsgPackPath(std::string(path)) {}
+
+    MsgPackPath(const std::string &path)
+    {
+        if (path.empty() || path == "$")
+            return;
+
+        if (path[0] == '/')
+            parse_pointer(path);
+        else if (path[0] == '$')
+            parse_dotted(path);
+        else
+            add_segment(path, true, false); // Plain top level key
+    }
+
+    // Walks a decoded tree, nullptr if the path does not exist
+    std::shared_ptr<MsgPackObj> find(const std::shared_ptr<MsgPackObj> &root) const
+    {
+        std::shared_ptr<MsgPackObj> node = root;
+        for (const auto &segment : segments)
+        {
+            if (!node)
+                return nullptr;
+
+            if (node->is_map())
+            {
+                std::shared_ptr<MsgPackObj> next;
+                if (segment.is_key)
+                    next = node->find(MsgPackKey(segment.key));
+                if (!next && segment.is_index)
+                    next = node->find(MsgPackKey(segment.index));
+                node = next;
+            }
+            else if (node->is_array() && segment.is_index)
+            {
+                if (segment.index < 0 || (uint64_t)segment.index >= node->m_array.size())
+                    return nullptr;
+                node = node->m_array[segment.index];
+            }
+            else
+            {
+                return nullptr;
+            }
+        }
+        return node;
+    }
+
+    // Walks an immutable document, an invalid ref if the path does not exist
+    MsgPackRef find(MsgPackRef node) const
+    {
+        for (const auto &segment : segments)
+        {
+            if (node.is_map())
+            {
+                MsgPackRef next;
+                if (segment.is_key)
+                    next = node.find(std::string_view(segment.key));
+                if (!next && segment.is_index)
+                    next = node.find(segment.index);
+                node = next;
+            }
+            else if (node.is_array() && segment.is_index)
+            {
+                node = segment.index < 0 ? MsgPackRef() : node[(size_t)segment.index];
+            }
+            else
+            {
+                return MsgPackRef();
+            }
+            if (!node)
+                return node;
+        }
+        return node;
+    }
+
+    template <typename T>
+    bool get(const MsgPackRef &root, T &out) const
+    {
+        MsgPackRef node = find(root);
+        return node && node.get(out);
+    }
+
+    // Walks a raw buffer from the object at offset, skipping everything that
+    // is not on the path. On success offset is left at the target object.
+    bool find(const unsigned char *raw, size_t size, size_t &offset) const
+    {
+        size_t current = offset;
+        MsgPackHeader header;
+
+        for (const auto &segment : segments)
+        {
+            if (!msgpack_read_header(raw, size, current, header))
+                return false;
+
+            if (header.type == MsgpackType::MAP)
+            {
+                // The whole map is read, the last duplicate key wins and a
+                // string key is preferred to an integer one as in the tree
+                current += header.header_size;
+                size_t str_value = 0, int_value = 0;
+                for (uint32_t i = 0; i < header.length; i++)
+                {
+                    KeyMatch match = key_matches(raw, size, current, segment);
+                    if (!msgpack_skip(raw, size, current))
+                        return false;
+                    if (match == KeyMatch::STR)
+                        str_value = current;
+                    else if (match == KeyMatch::INT)
+                        int_value = current;
+                    if (!msgpack_skip(raw, size, current))
+                        return false;
+                }
+                if (!str_value && !int_value)
+                    return false;
+                current = str_value ? str_value : int_value;
+            }
+            else if (header.type == MsgpackType::ARRAY && segment.is_index)
+            {
+                if (segment.index < 0 || (uint64_t)segment.index >= header.length)
+                    return false;
+                current += header.header_size;
+                for (int64_t i = 0; i < segment.index; i++)
+                {
+                    if (!msgpack_skip(raw, size, current))
+                        return false;
+                }
+            }
+            else
+            {
+                return false;
+            }
+        }
+
+        offset = current;
+        return true;
+    }
+
+    template <typename T>
+    bool get(const std::shared_ptr<MsgPackObj> &root, T &out) const
+    {
+        auto node = find(root);
+        return node && node->get(out);
+    }
+
+    template <typename T>
+    bool get(const unsigned char *raw, size_t size, T &out) const
+    {
+        size_t offset = 0;
+        MsgPackRawValue value;
+        return find(raw, size, offset) && msgpack_read_value(raw, size, offset, value) && value.get(out);
+    }
+
+    template <typename T>
+    bool get(const std::vector<unsigned char> &raw, T &out) const
+    {
+        return get(raw.data(), raw.size(), out);
+    }
+
+private:
+    void add_segment(const std::string &key, bool is_key, bool must_be_index)
+    {
+        Segment segment;
+        segment.key = key;
+        segment.index = 0;
+        segment.is_key = is_key;
+        segment.is_index = !key.empty() && key.size() < 19 && std::all_of(key.begin(), key.end(), ::isdigit);
+        if (segment.is_index)
+            segment.index = std::stoll(key);
+        else if (must_be_index)
+            MSGPACK_THROW("invalid path index");
+        segments.push_back(segment);
+    }
+
+    void parse_pointer(const std::string &path)
+    {
+        size_t start = 1;
+        while (start <= path.size())
+        {
+            size_t end = path.find('/', start);
+            if (end == std::string::npos)
+                end = path.size();
+
+            std::string key;
+            for (size_t i = start; i < end; i++)
+            {
+                if (path[i] == '~' && i + 1 < end && (path[i + 1] == '0' || path[i + 1] == '1'))
+                {
+                    key += path[i + 1] == '0' ? '~' : '/';
+                    i++;
+                }
+                else
+                {
+                    key += path[i];
+                }
+            }
+            add_segment(key, true, false);
+            start = end + 1;
+        }
+    }
+
+    void parse_dotted(const std::string &path)
+    {
+        size_t i = 1;
+        while (i < path.size())
+        {
+            if (path[i] == '.')
+            {
+                size_t end = path.find_first_of(".[", i + 1);
+                if (end == std::string::npos)
+                    end = path.size();
+                if (end == i + 1)
+                    MSGPACK_THROW("invalid path");
+                add_segment(path.substr(i + 1, end - i - 1), true, false);
+                i = end;
+            }
+            else if (path[i] == '[')
+            {
+                size_t end = path.find(']', i);
+                if (end == std::string::npos)
+                    MSGPACK_THROW("invalid path");
+                std::string inner = path.substr(i + 1, end - i - 1);
+                if (inner.size() >= 2 && (inner[0] == '\'' || inner[0] == '"') && inner.back() == inner[0])
+                {
+                    add_segment(inner.substr(1, inner.size() - 2), true, false);
+                    segments.back().is_index = false;
+                }
+                else
+                {
+                    add_segment(inner, false, true);
+                }
+                i = end + 1;
+            }
+            else
+            {
+                MSGPACK_THROW("invalid path");
+            }
+        }
+    }
+
+    enum class KeyMatch
+    {
+        NONE,
+        STR,
+        INT,
+    };
+
+    static KeyMatch key_matches(const MsgPackRawValue &key, const Segment &segment)
+    {
+        if (key.is_str())
+            return segment.is_key && key.size == segment.key.size() && memcmp(key.data, segment.key.data(), key.size) == 0 ? KeyMatch::STR : KeyMatch::NONE;
+        if (key.is_integer() && segment.is_index)
+        {
+            bool equal = key.type == MsgpackType::UINT64 ? key.m_uint64 == (uint64_t)segment.index : key.m_int64 == segment.index;
+            return equal ? KeyMatch::INT : KeyMatch::NONE;
+        }
+        return KeyMatch::NONE;
+    }
+
+    static KeyMatch key_matches(const unsigned char *raw, size_t size, size_t current, const Segment &segment)
+    {
+        MsgPackRawValue key;
+        if (!msgpack_read_value(raw, size, current, key))
+            return KeyMatch::NONE;
+        return key_matches(key, segment);
+    }
+
+    friend class MsgPackExtractor;
+};
+
+// Extracts many paths in a single pass over a raw buffer. Paths are merged
+// in to a trie, subtrees that no path goes through are skipped and the scan
+// stops once every field has been reported.
+class MsgPackExtractor
+{
+public:
+    MsgPackExtractor()
+    {
+        m_nodes.emplace_back();
+    }
+
+    // Adds a path, returns the index of the field it is reported as
+    size_t add(const MsgPackPath &path)
+    {
+        uint32_t node = 0;
+        for (const auto &segment : path.segments)
+        {
+            uint32_t next = child(node, segment);
+            if (next == npos)
+            {
+                next = (uint32_t)m_nodes.size();
+                m_nodes.emplace_back();
+                m_nodes[node].edges.emplace_back(segment, next);
+            }
+            node = next;
+        }
+        m_nodes[node].fields.push_back((uint32_t)m_setters.size());
+        m_setters.emplace_back();
+        return m_setters.size() - 1;
+    }
+
+    // Adds a path that is written to member of the struct passed to extract()
+    template <typename S, typename T>
+    size_t add(const MsgPackPath &path, T S::*member)
+    {
+        size_t field = add(path);
+        m_setters[field] = [member](void *out, const MsgPackRawValue &value)
+        {
+            value.get(((S *)out)->*member);
+        };
+        return field;
+    }
+
+    size_t size() const { return m_setters.size(); }
+
+    // Calls callback(field, value) for every field found, in document order.
+    // Each field is reported once, keys are matched as MsgPackPath does: the
+    // last duplicate wins and a string key is preferred to an integer one.
+    template <typename F>
+    bool scan(const unsigned char *raw, size_t size, F &&callback) const
+    {
+        size_t current = 0;
+        size_t remaining = m_setters.size();
+        if (remaining == 0)
+            return true;
+
+        // Where each node's value was found in its container, a slot per node
+        Match small[128];
+        std::vector<Match> large;
+        Match *matches = small;
+        if (m_nodes.size() > 128)
+        {
+            large.resize(m_nodes.size());
+            matches = large.data();
+        }
+        return visit(raw, size, current, 0, remaining, matches, callback) != Status::ERROR;
+    }
+
+    // Fills out[field] for each field found, others are left untouched.
+    // Returns the number of fields found.
+    size_t extract(const unsigned char *raw, size_t size, MsgPackRawValue *out) const
+    {
+        size_t found = 0;
+        scan(raw, size, [&](size_t field, const MsgPackRawValue &value)
+             {
+                 out[field] = value;
+                 found++;
+             });
+        return found;
+    }
+
+    // Fills the members registered with add(path, member)
+    template <typename S>
+    size_t extract(const unsigned char *raw, size_t size, S &out) const
+    {
+        size_t found = 0;
+        scan(raw, size, [&](size_t field, const MsgPackRawValue &value)
+             {
+                 if (m_setters[field])
+                 {
+                     m_setters[field](&out, value);
+                     found++;
+                 }
+             });
+        return found;
+    }
+
+private:
+    static constexpr uint32_t npos = 0xFFFFFFFF;
+
+    enum class Status
+    {
+        ERROR,
+        CONTINUE,
+        DONE,
+    };
+
+    typedef struct
+    {
+        std::vector<std::pair<MsgPackPath::Segment, uint32_t>> edges; // Segment and the node it leads to
+        std::vector<uint32_t> fields;
+    } Node;
+
+    typedef struct
+    {
+        size_t offset; // 0 if not found
+        bool is_str;   // Found by a string key
+    } Match;
+
+    // Segments only share a node if they match the same keys
+    uint32_t child(uint32_t node, const MsgPackPath::Segment &segment) const
+    {
+        for (const auto &edge : m_nodes[node].edges)
+        {
+            const MsgPackPath::Segment &s = edge.first;
+            if (s.is_key == segment.is_key && s.is_index == segment.is_index && (!s.is_key || s.key == segment.key) && (!s.is_index || s.index == segment.index))
+                return edge.second;
+        }
+        return npos;
+    }
+
+    // Reports the fields at node and advances current past the object. A map
+    // is read to the end before its children are visited, so that a later
+    // duplicate key replaces an earlier one.
+    template <typename F>
+    Status visit(const unsigned char *raw, size_t size, size_t &current, uint32_t node_index, size_t &remaining, Match *matches, F &callback) const
+    {
+        const Node &node = m_nodes[node_index];
+        MsgPackRawValue value;
+        if (!msgpack_read_value(raw, size, current, value))
+            return Status::ERROR;
+
+        if (!node.fields.empty())
+        {
+            for (uint32_t field : node.fields)
+                callback(field, value);
+            remaining -= node.fields.size();
+            if (remaining == 0)
+                return Status::DONE;
+        }
+
+        if (node.edges.empty() || !(value.is_map() || value.is_array()))
+            return msgpack_skip(raw, size, current) ? Status::CONTINUE : Status::ERROR;
+
+        MsgPackHeader header;
+        msgpack_read_header(raw, size, current, header);
+        current += header.header_size;
+
+        if (value.is_array())
+        {
+            // No duplicates, elements are visited in place
+            for (uint32_t i = 0; i < header.length; i++)
+            {
+                size_t end = current;
+                bool visited = false;
+                for (const auto &edge : node.edges)
+                {
+                    if (!edge.first.is_index || edge.first.index != (int64_t)i)
+                        continue;
+                    end = current;
+                    Status status = visit(raw, size, end, edge.second, remaining, matches, callback);
+                    if (status != Status::CONTINUE)
+                        return status;
+                    visited = true;
+                }
+                if (visited)
+                    current = end;
+                else if (!msgpack_skip(raw, size, current))
+                    return Status::ERROR;
+            }
+            return Status::CONTINUE;
+        }
+
+        for (const auto &edge : node.edges)
+            matches[edge.second] = Match{0, false};
+
+        for (uint32_t i = 0; i < header.length; i++)
+        {
+            MsgPackRawValue key;
+            if (!msgpack_read_value(raw, size, current, key) || !msgpack_skip(raw, size, current))
+                return Status::ERROR;
+            for (const auto &edge : node.edges)
+            {
+                MsgPackPath::KeyMatch match = MsgPackPath::key_matches(key, edge.first);
+                if (match == MsgPackPath::KeyMatch::STR || (match == MsgPackPath::KeyMatch::INT && !matches[edge.second].is_str))
+                    matches[edge.second] = Match{current, match == MsgPackPath::KeyMatch::STR};
+            }
+            if (!msgpack_skip(raw, size, current))
+                return Status::ERROR;
+        }
+
+        // Visit the children found, nearest first
+        for (;;)
+        {
+            uint32_t next = npos;
+            for (const auto &edge : node.edges)
+            {
+                size_t offset = matches[edge.second].offset;
+                if (offset && (next == npos || offset < matches[next].offset))
+                    next = edge.second;
+            }
+            if (next == npos)
+                break;
+
+            size_t child = matches[next].offset;
+            matches[next].offset = 0;
+            Status status = visit(raw, size, child, next, remaining, matches, callback);
+            if (status != Status::CONTINUE)
+                return status;
+        }
+
+        return Status::CONTINUE;
+    }
+
+    std::vector<Node> m_nodes;
+    std::vector<std::function<void(void *, const MsgPackRawValue &)>> m_setters;
+};
+
+// Typed decoders for extension types, indexed directly by the ext type id
+class MsgPackExtRegistry
+{
+public:
+    template <typename T>
+    using Handler = bool (*)(const MsgPackSlice &payload, T &out);
+
+    template <typename T>
+    void add(int8_t type, Handler<T> handler)
+    {
+        Entry &entry = m_handlers[(uint8_t)type];
+        entry.handler = reinterpret_cast<void (*)()>(handler);
+        entry.tag = tag<T>();
+    }
+
+    void remove(int8_t type)
+    {
+        m_handlers[(uint8_t)type] = Entry();
+    }
+
+    bool contains(int8_t type) const
+    {
+        return m_handlers[(uint8_t)type].handler != nullptr;
+    }
+
+    // Returns false if no handler for T is registered or the handler fails
+    template <typename T>
+    bool decode(int8_t type, const MsgPackSlice &payload, T &out) const
+    {
+        const Entry &entry = m_handlers[(uint8_t)type];
+        if (entry.tag != tag<T>())
+            return false;
+        return reinterpret_cast<Handler<T>>(entry.handler)(payload, out);
+    }
+
+    template <typename T>
+    bool decode(const MsgPackObj &obj, T &out) const
+    {
+        return obj.type == MsgpackType::EXT && decode(obj.m_ext_type, obj.m_ext, out);
+    }
+
+    template <typename T>
+    bool decode(const MsgPackRawValue &value, T &out) const
+    {
+        return value.type == MsgpackType::EXT && decode(value.ext_type, MsgPackSlice(nullptr, value.data, value.size), out);
+    }
+
+private:
+    typedef struct
+    {
+        void (*handler)() = nullptr;
+        const void *tag = nullptr;
+    } Entry;
+
+    template <typename T>
+    static const void *tag()
+    {
+        static const char t = 0;
+        return &t;
+    }
+
+    std::array<Entry, 256> m_handlers;
+};
+
+// Appends MessagePack to a buffer, always choosing the smallest encoding
+class MsgPackEncoder
+{
+public:
+    std::vector<unsigned char> &buffer;
+
+    MsgPackEncoder(std::vector<unsigned char> &buffer) : buffer(buffer) {}
+
+    void pack_nil()
+    {
+        buffer.push_back(0xc0);
+    }
+
+    void pack_bool(bool value)
+    {
+        buffer.push_back(value ? 0xc3 : 0xc2);
+    }
+
+    void pack_int(int64_t value)
+    {
+        if (value >= 0)
+        {
+            pack_uint((uint64_t)value);
+        }
+        else if (value >= -32)
+        {
+            buffer.push_back((unsigned char)(int8_t)value);
+        }
+        else if (value >= INT8_MIN)
+        {
+            buffer.push_back(0xd0);
+            buffer.push_back((unsigned char)(int8_t)value);
+        }
+        else if (value >= INT16_MIN)
+        {
+            put(0xd1, (uint16_t)value);
+        }
+        else if (value >= INT32_MIN)
+        {
+            put(0xd2, (uint32_t)value);
+        }
+        else
+        {
+            put(0xd3, (uint64_t)value);
+        }
+    }
+
+    void pack_uint(uint64_t value)
+    {
+        if (value <= 0x7f)
+        {
+            buffer.push_back((unsigned char)value);
+        }
+        else if (value <= UINT8_MAX)
+        {
+            buffer.push_back(0xcc);
+            buffer.push_back((unsigned char)value);
+        }
+        else if (value <= UINT16_MAX)
+        {
+            put(0xcd, (uint16_t)value);
+        }
+        else if (value <= UINT32_MAX)
+        {
+            put(0xce, (uint32_t)value);
+        }
+        else
+        {
+            put(0xcf, value);
+        }
+    }
+
+    void pack_float(float value)
+    {
+        uint32_t bits;
+        memcpy(&bits, &value, 4);
+        put(0xca, bits);
+    }
+
+    void pack_double(double value)
+    {
+        uint64_t bits;
+        memcpy(&bits, &value, 8);
+        put(0xcb, bits);
+    }
+
+    void pack_str(std::string_view value)
+    {
+        size_t size = value.size();
+        if (size <= 31)
+            buffer.push_back((unsigned char)(0xa0 | size));
+        else if (size <= UINT8_MAX)
+        {
+            buffer.push_back(0xd9);
+            buffer.push_back((unsigned char)size);
+        }
+        else if (size <= UINT16_MAX)
+            put(0xda, (uint16_t)size);
+        else
+            put(0xdb, (uint32_t)size);
+        append((const unsigned char *)value.data(), size);
+    }
+
+    void pack_bin(const unsigned char *data, size_t size)
+    {
+        if (size <= UINT8_MAX)
+        {
+            buffer.push_back(0xc4);
+            buffer.push_back((unsigned char)size);
+        }
+        else if (size <= UINT16_MAX)
+            put(0xc5, (uint16_t)size);
+        else
+            put(0xc6, (uint32_t)size);
+        append(data, size);
+    }
+
+    void pack_array(uint32_t size)
+    {
+        if (size <= 15)
+            buffer.push_back((unsigned char)(0x90 | size));
+        else if (size <= UINT16_MAX)
+            put(0xdc, (uint16_t)size);
+        else
+            put(0xdd, size);
+    }
+
+    void pack_map(uint32_t size)
+    {
+        if (size <= 15)
+            buffer.push_back((unsigned char)(0x80 | size));
+        else if (size <= UINT16_MAX)
+            put(0xde, (uint16_t)size);
+        else
+            put(0xdf, size);
+    }
+
+    void pack_ext(int8_t type, const unsigned char *data, size_t size)
+    {
+        switch (size)
+        {
+        case 1:
+            buffer.push_back(0xd4);
+            break;
+        case 2:
+            buffer.push_back(0xd5);
+            break;
+        case 4:
+            buffer.push_back(0xd6);
+            break;
+        case 8:
+            buffer.push_back(0xd7);
+            break;
+        case 16:
+            buffer.push_back(0xd8);
+            break;
+        default:
+            if (size <= UINT8_MAX)
+            {
+                buffer.push_back(0xc7);
+                buffer.push_back((unsigned char)size);
+            }
+            else if (size <= UINT16_MAX)
+                put(0xc8, (uint16_t)size);
+            else
+                put(0xc9, (uint32_t)size);
+            break;
+        }
+        buffer.push_back((unsigned char)type);
+        append(data, size);
+    }
+
+    // Picks the 32, 64 or 96 bit timestamp form
+    void pack_timestamp(int64_t seconds, uint32_t nanoseconds)
+    {
+        unsigned char payload[12];
+        if ((seconds >> 34) == 0)
+        {
+            uint64_t value = ((uint64_t)nanoseconds << 34) | (uint64_t)seconds;
+            if ((value & 0xffffffff00000000ull) == 0)
+            {
+                store32(payload, (uint32_t)value);
+                pack_ext(-1, payload, 4);
+            }
+            else
+            {
+                store64(payload, value);
+                pack_ext(-1, payload, 8);
+            }
+        }
+        else
+        {
+            store32(payload, nanoseconds);
+            store64(payload + 4, (uint64_t)seconds);
+            pack_ext(-1, payload, 12);
+        }
+    }
+
+    void pack_timestamp(const timespec &value)
+    {
+        pack_timestamp((int64_t)value.tv_sec, (uint32_t)value.tv_nsec);
+    }
+
+    template <typename Duration>
+    void pack_timestamp(std::chrono::time_point<std::chrono::system_clock, Duration> value)
+    {
+        int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(value.time_since_epoch()).count();
+        int64_t seconds = ns / 1000000000;
+        int64_t nanoseconds = ns % 1000000000;
+        if (nanoseconds < 0)
+        {
+            seconds -= 1;
+            nanoseconds += 1000000000;
+        }
+        pack_timestamp(seconds, (uint32_t)nanoseconds);
+    }
+
+    // Encodes a decoded object and everything below it
+    void pack(const MsgPackObj &obj)
+    {
+        switch (obj.type)
+        {
+        case MsgpackType::NIL:
+            pack_nil();
+            break;
+        case MsgpackType::BOOL:
+            pack_bool(obj.m_bool);
+            break;
+        case MsgpackType::FLOAT32:
+            pack_float(obj.m_float32);
+            break;
+        case MsgpackType::FLOAT64:
+            pack_double(obj.m_float64);
+            break;
+        case MsgpackType::UINT64:
+            pack_uint(obj.m_uint64);
+            break;
+        case MsgpackType::STR:
+            pack_str(obj.m_str);
+            break;
+        case MsgpackType::BIN:
+            pack_bin(obj.m_bin.data(), obj.m_bin.size());
+            break;
+        case MsgpackType::EXT:
+            pack_ext(obj.m_ext_type, obj.m_ext.data(), obj.m_ext.size());
+            break;
+        case MsgpackType::ARRAY:
+            pack_array((uint32_t)obj.m_array.size());
+            for (const auto &n : obj.m_array)
+                pack(*n);
+            break;
+        case MsgpackType::MAP:
+            pack_map((uint32_t)obj.m_map.size());
+            for (const auto &n : obj.m_map)
+            {
+                pack(*n.first);
+                pack(*n.second);
+            }
+            break;
+        default:
+            pack_int(obj.as_int64());
+            break;
+        }
+    }
+
+    static void store16(unsigned char *p, uint16_t value)
+    {
+        p[0] = (unsigned char)(value >> 8);
+        p[1] = (unsigned char)value;
+    }
+
+    static void store32(unsigned char *p, uint32_t value)
+    {
+        store16(p, (uint16_t)(value >> 16));
+        store16(p + 2, (uint16_t)value);
+    }
+
+    static void store64(unsigned char *p, uint64_t value)
+    {
+        store32(p, (uint32_t)(value >> 32));
+        store32(p + 4, (uint32_t)value);
+    }
+
+private:
+    void append(const unsigned char *data, size_t size)
+    {
+        buffer.insert(buffer.end(), data, data + size);
+    }
+
+    void put(unsigned char tag, uint16_t value)
+    {
+        unsigned char bytes[3] = {tag};
+        store16(bytes + 1, value);
+        append(bytes, 3);
+    }
+
+    void put(unsigned char tag, uint32_t value)
+    {
+        unsigned char bytes[5] = {tag};
+        store32(bytes + 1, value);
+        append(bytes, 5);
+    }
+
+    void put(unsigned char tag, uint64_t value)
+    {
+        unsigned char bytes[9] = {tag};
+        store64(bytes + 1, value);
+        append(bytes, 9);
+    }
+};
+
+inline void MsgPackObj::to_raw(std::vector<char> &buffer)
+{
+    std::vector<unsigned char> raw;
+    MsgPackEncoder(raw).pack(*this);
+    buffer.insert(buffer.end(), raw.begin(), raw.end());
+}
+
+// Single pass JSON to MessagePack converter, no tree is built. Integers use
+// the smallest encoding that holds them, other numbers become float32 when
+// that is exact and float64 otherwise. Container headers start out as one
+// byte fix headers and are widened when the closing bracket shows more than
+// 15 entries. A parser can be reused, its stack and scratch space keep
+// their capacity.
+class MsgPackJsonParser
+{
+public:
+    // Appends the MessagePack for json to out, returns false if json is not
+    // a single valid JSON value; out is then partial and error_offset()
+    // points at the offending character.
+    bool parse(const char *json, size_t size, std::vector<unsigned char> &out)
+    {
+        MsgPackEncoder encoder(out);
+        m_begin = m_p = json;
+        m_end = json + size;
+        m_stack.clear();
+        m_gaps.clear();
+
+        for (;;)
+        {
+            skip_whitespace();
+            if (m_p == m_end)
+                return false;
+
+            char c = *m_p;
+            if (c == '{' || c == '[')
+            {
+                // Room for the largest header, the unused part is removed
+                // by compact() once the whole value is known
+                m_stack.push_back({out.size(), 0, c == '{', m_gaps.size()});
+                m_gaps.push_back({out.size(), 0});
+                out.insert(out.end(), 5, 0);
+                m_p++;
+                skip_whitespace();
+                if (m_p == m_end)
+                    return false;
+                if (*m_p != (c == '{' ? '}' : ']'))
+                {
+                    if (c == '{' && !key(encoder))
+                        return false;
+                    continue;
+                }
+                m_p++;
+                close(out);
+            }
+            else if (c == '"')
+            {
+                if (!string(encoder))
+                    return false;
+            }
+            else if (c == '-' || (c >= '0' && c <= '9'))
+            {
+                if (!number(encoder))
+                    return false;
+            }
+            else if (literal("true"))
+                encoder.pack_bool(true);
+            else if (literal("false"))
+                encoder.pack_bool(false);
+            else if (literal("null"))
+                encoder.pack_nil();
+            else
+                return false;
+
+            // A value is complete, find what comes after it
+            for (;;)
+            {
+                skip_whitespace();
+                if (m_stack.empty())
+                {
+                    compact(out);
+                    return m_p == m_end;
+                }
+                if (m_p == m_end)
+                    return false;
+
+                Frame &frame = m_stack.back();
+                frame.count++;
+                if (*m_p == ',')
+                {
+                    m_p++;
+                    if (frame.map && !key(encoder))
+                        return false;
+                    break;
+                }
+                if (*m_p != (frame.map ? '}' : ']'))
+                    return false;
+                m_p++;
+                close(out);
+            }
+        }
+    }
+
+    bool parse(const std::string &json, std::vector<unsigned char> &out)
+    {
+        return parse(json.data(), json.size(), out);
+    }
+
+    size_t error_offset() const { return m_p - m_begin; }
+
+private:
+    typedef struct
+    {
+        size_t header; // Offset of the 5 byte placeholder header in out
+        uint32_t count;
+        bool map;
+        size_t gap; // Index in m_gaps
+    } Frame;
+
+    // Unused bytes at the front of a placeholder header, in offset order
+    typedef struct
+    {
+        size_t offset;
+        size_t length;
+    } Gap;
+
+    void skip_whitespace()
+    {
+        while (m_p < m_end && (*m_p == ' ' || *m_p == '\n' || *m_p == '\r' || *m_p == '\t'))
+            m_p++;
+    }
+
+    bool literal(const char *word)
+    {
+        size_t length = strlen(word);
+        if ((size_t)(m_end - m_p) < length || memcmp(m_p, word, length) != 0)
+            return false;
+        m_p += length;
+        return true;
+    }
+
+    // Writes the header at the end of its placeholder, so the gap left is
+    // at the front and nothing after it has to move yet
+    void close(std::vector<unsigned char> &out)
+    {
+        Frame frame = m_stack.back();
+        m_stack.pop_back();
+        uint32_t count = frame.count;
+        unsigned char *slot = out.data() + frame.header;
+
+        if (count <= 15)
+        {
+            slot[4] = (unsigned char)((frame.map ? 0x80 : 0x90) | count);
+            m_gaps[frame.gap].length = 4;
+        }
+        else if (count <= UINT16_MAX)
+        {
+            slot[2] = frame.map ? 0xde : 0xdc;
+            MsgPackEncoder::store16(slot + 3, (uint16_t)count);
+            m_gaps[frame.gap].length = 2;
+        }
+        else
+        {
+            slot[0] = frame.map ? 0xdf : 0xdd;
+            MsgPackEncoder::store32(slot + 1, count);
+        }
+    }
+
+    // Closes the gaps in one pass over the output
+    void compact(std::vector<unsigned char> &out)
+    {
+        if (m_gaps.empty())
+            return;
+
+        size_t write = m_gaps[0].offset;
+        for (size_t g = 0; g < m_gaps.size(); g++)
+        {
+            size_t read = m_gaps[g].offset + m_gaps[g].length;
+            size_t next = g + 1 < m_gaps.size() ? m_gaps[g + 1].offset : out.size();
+            memmove(out.data() + write, out.data() + read, next - read);
+            write += next - read;
+        }
+        out.resize(write);
+    }
+
+    bool key(MsgPackEncoder &encoder)
+    {
+        skip_whitespace();
+        if (m_p == m_end || *m_p != '"' || !string(encoder))
+            return false;
+        skip_whitespace();
+        if (m_p == m_end || *m_p != ':')
+            return false;
+        m_p++;
+        return true;
+    }
+
+    bool hex4(uint32_t &out)
+    {
+        if (m_end - m_p < 4)
+            return false;
+        out = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            char c = *m_p++;
+            out <<= 4;
+            if (c >= '0' && c <= '9')
+                out |= c - '0';
+            else if (c >= 'a' && c <= 'f')
+                out |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F')
+                out |= c - 'A' + 10;
+            else
+                return false;
+        }
+        return true;
+    }
+
+    bool string(MsgPackEncoder &encoder)
+    {
+        const char *start = ++m_p;
+        size_t size = m_end - start;
+        size_t i = msgpack_json_special(start, 0, size);
+        if (i < size && start[i] == '"')
+        {
+            // Nothing to unescape, straight in to the output
+            if (!msgpack_utf8_valid((const unsigned char *)start, i))
+                return false;
+            encoder.pack_str(std::string_view(start, i));
+            m_p = start + i + 1;
+            return true;
+        }
+
+        // Runs between escapes are checked on their own, an escape can't
+        // fall inside a valid sequence
+        m_scratch.clear();
+        size_t copied = 0;
+        for (;;)
+        {
+            if (!msgpack_utf8_valid((const unsigned char *)start + copied, i - copied))
+            {
+                m_p = start + copied;
+                return false;
+            }
+            m_scratch.append(start + copied, i - copied);
+            m_p = start + i;
+            if (i == size || start[i] != '\\')
+                return false; // Unterminated or a raw control character
+            if (++i == size)
+                return false;
+
+            char c = start[i++];
+            switch (c)
+            {
+            case '"':
+            case '\\':
+            case '/':
+                m_scratch.push_back(c);
+                break;
+            case 'b':
+                m_scratch.push_back('\b');
+                break;
+            case 'f':
+                m_scratch.push_back('\f');
+                break;
+            case 'n':
+                m_scratch.push_back('\n');
+                break;
+            case 'r':
+                m_scratch.push_back('\r');
+                break;
+            case 't':
+                m_scratch.push_back('\t');
+                break;
+            case 'u':
+            {
+                m_p = start + i;
+                uint32_t code;
+                if (!hex4(code) || (code >= 0xdc00 && code <= 0xdfff))
+                    return false;
+                if (code >= 0xd800 && code <= 0xdbff)
+                {
+                    uint32_t low;
+                    if (m_end - m_p < 2 || m_p[0] != '\\' || m_p[1] != 'u')
+                        return false;
+                    m_p += 2;
+                    if (!hex4(low) || low < 0xdc00 || low > 0xdfff)
+                        return false;
+                    code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                }
+                i = m_p - start;
+                append_utf8(code);
+                break;
+            }
+            default:
+                m_p = start + i - 1;
+                return false;
+            }
+
+            copied = i;
+            i = msgpack_json_special(start, i, size);
+            if (i < size && start[i] == '"')
+            {
+                if (!msgpack_utf8_valid((const unsigned char *)start + copied, i - copied))
+                {
+                    m_p = start + copied;
+                    return false;
+                }
+                m_scratch.append(start + copied, i - copied);
+                encoder.pack_str(m_scratch);
+                m_p = start + i + 1;
+                return true;
+            }
+        }
+    }
+
+    void append_utf8(uint32_t code)
+    {
+        if (code < 0x80)
+        {
+            m_scratch.push_back((char)code);
+        }
+        else if (code < 0x800)
+        {
+            m_scratch.push_back((char)(0xc0 | code >> 6));
+            m_scratch.push_back((char)(0x80 | (code & 0x3f)));
+        }
+        else if (code < 0x10000)
+        {
+            m_scratch.push_back((char)(0xe0 | code >> 12));
+            m_scratch.push_back((char)(0x80 | ((code >> 6) & 0x3f)));
+            m_scratch.push_back((char)(0x80 | (code & 0x3f)));
+        }
+        else
+        {
+            m_scratch.push_back((char)(0xf0 | code >> 18));
+            m_scratch.push_back((char)(0x80 | ((code >> 12) & 0x3f)));
+            m_scratch.push_back((char)(0x80 | ((code >> 6) & 0x3f)));
+            m_scratch.push_back((char)(0x80 | (code & 0x3f)));
+        }
+    }
+
+    bool number(MsgPackEncoder &encoder)
+    {
+        const char *start = m_p;
+        const char *p = m_p;
+        bool integer = true;
+        auto digits = [&]()
+        {
+            const char *first = p;
+            while (p < m_end && *p >= '0' && *p <= '9')
+                p++;
+            return p > first;
+        };
+
+        if (*p == '-')
+            p++;
+        if (p < m_end && *p == '0')
+            p++;
+        else if (!digits())
+            return false;
+        if (p < m_end && *p == '.')
         {
-        case MsgpackType::POSITIVE_FIXINT:
-            ret << "POSITIVE_FIXINT(" << (uint16_t)m_int8 << ")";
-            break;
-        case MsgpackType::INT8:
-            ret << "INT8(" << (uint16_t)m_int8 << ")";
-            break;
-        case MsgpackType::INT16:
-            ret << "INT16(" << m_int16 << ")";
-            break;
-        case MsgpackType::INT32:
-            ret << "INT32(" << m_int32 << ")";
-            break;
-        case MsgpackType::INT64:
-            ret << "INT64(" << m_int64 << ")";
-            break;
-        case MsgpackType::UINT8:
-            ret << "UINT8(" << (uint16_t)m_uint8 << ")";
-            break;
-        case MsgpackType::UINT16:
-            ret << "UINT16(" << m_uint16 << ")";
-            break;
-        case MsgpackType::UINT32:
-            ret << "UINT32(" << m_uint32 << ")";
-            break;
-        case MsgpackType::UINT64:
-            ret << "UINT64(" << m_uint64 << ")";
-            break;
-        case MsgpackType::FLOAT32:
-            ret << "FLOAT32(" << m_float32 << ")";
-            break;
-        case MsgpackType::FLOAT64:
-            ret << "FLOAT64(" << m_float64 << ")";
+            p++;
+            integer = false;
+            if (!digits())
+                return false;
+        }
+        if (p < m_end && (*p == 'e' || *p == 'E'))
+        {
+            p++;
+            integer = false;
+            if (p < m_end && (*p == '+' || *p == '-'))
+                p++;
+            if (!digits())
+                return false;
+        }
+        m_p = p;
+
+        if (integer)
+        {
+            if (*start == '-')
+            {
+                // -0 is left to the float path, which keeps the sign
+                int64_t value;
+                if (std::from_chars(start, p, value).ec == std::errc() && value != 0)
+                {
+                    encoder.pack_int(value);
+                    return true;
+                }
+            }
+            else
+            {
+                uint64_t value;
+                if (std::from_chars(start, p, value).ec == std::errc())
+                {
+                    encoder.pack_uint(value);
+                    return true;
+                }
+            }
+        }
+
+        double value;
+        if (std::from_chars(start, p, value).ec != std::errc())
+        {
+            m_p = start;
+            return false;
+        }
+        float narrow = (float)value;
+        if ((double)narrow == value)
+            encoder.pack_float(narrow);
+        else
+            encoder.pack_double(value);
+        return true;
+    }
+
+    const char *m_begin = nullptr;
+    const char *m_p = nullptr;
+    const char *m_end = nullptr;
+    std::vector<Frame> m_stack;
+    std::vector<Gap> m_gaps;
+    std::string m_scratch;
+};
+
+inline bool msgpack_from_json(const char *json, size_t size, std::vector<unsigned char> &out)
+{
+    MsgPackJsonParser parser;
+    return parser.parse(json, size, out);
+}
+
+inline bool msgpack_from_json(const std::string &json, std::vector<unsigned char> &out)
+{
+    return msgpack_from_json(json.data(), json.size(), out);
+}
+
+inline MsgPackKey::MsgPackKey(const MsgPackObj &obj)
+{
+    switch (obj.type)
+    {
+    case MsgpackType::NIL:
+        type = MsgpackType::NIL;
+        break;
+    case MsgpackType::BOOL:
+        type = MsgpackType::BOOL;
+        m_bool = obj.m_bool;
+        break;
+    case MsgpackType::UINT64:
+        if (obj.m_uint64 > (uint64_t)INT64_MAX)
+        {
+            type = MsgpackType::UINT64;
+            m_uint64 = obj.m_uint64;
             break;
-        case MsgpackType::BIN:
-            ret << "BIN(";
-            for (const auto &n : *m_bin)
+        }
+        type = MsgpackType::INT64;
+        m_int64 = (int64_t)obj.m_uint64;
+        break;
+    case MsgpackType::FLOAT32:
+        type = MsgpackType::FLOAT64;
+        m_float64 = obj.m_float32;
+        break;
+    case MsgpackType::FLOAT64:
+        type = MsgpackType::FLOAT64;
+        m_float64 = obj.m_float64;
+        break;
+    case MsgpackType::STR:
+        type = MsgpackType::STR;
+        m_str = obj.m_str;
+        break;
+    case MsgpackType::BIN:
+        type = MsgpackType::BIN;
+        m_str.assign(obj.m_bin.begin(), obj.m_bin.end());
+        break;
+    default:
+        if (obj.is_integer())
+        {
+            type = MsgpackType::INT64;
+            m_int64 = obj.as_int64();
+        }
+        else
+        {
+            // Containers and extensions are not valid keys
+            type = MsgpackType::NIL;
+        }
+        break;
+    }
+}
+
+// Byte offsets of the top level records in a buffer of concatenated objects,
+// found by skipping headers only. update() can be called again as the
+// buffer grows, a trailing partial record is picked up by the next call.
+class MsgPackIndex
+{
+public:
+    std::vector<uint64_t> offsets;
+    uint64_t end = 0; // Offset after the last indexed record
+
+    size_t size() const { return offsets.size(); }
+
+    // Indexes complete records after end, returns the number added. A record
+    // cut short is taken to be still being written and is left for the next
+    // call, a malformed one throws.
+    size_t update(const unsigned char *raw, size_t size)
+    {
+        MsgPackDecodeError error;
+        size_t added = update(raw, size, error);
+        if (error)
+            MSGPACK_THROW("malformed record");
+        return added;
+    }
+
+    // As above, but a malformed record stops indexing with error set to its
+    // code and offset. end is left at the malformed record.
+    size_t update(const unsigned char *raw, size_t size, MsgPackDecodeError &error)
+    {
+        size_t added = 0;
+        size_t current = (size_t)end;
+        while (current < size)
+        {
+            size_t next = current;
+            if (!msgpack_skip(raw, size, next))
+            {
+                // Only a record that needs more bytes may still be in progress
+                MsgPackStreamScanner scanner(0);
+                MsgPackScanStatus status = scanner.scan(raw + current, size - current);
+                if (status != MSGPACK_SCAN_NEED_MORE)
+                {
+                    error.code = msgpack_scan_error(status);
+                    error.offset = current;
+                }
+                break;
+            }
+            offsets.push_back(current);
+            current = next;
+            added++;
+        }
+        end = current;
+        return added;
+    }
+
+    // Raw bytes of record n, size must be the size of the indexed buffer
+    MsgPackSlice record(size_t n, const unsigned char *raw, std::shared_ptr<const void> owner = nullptr) const
+    {
+        uint64_t start = offsets[n];
+        uint64_t stop = n + 1 < offsets.size() ? offsets[n + 1] : end;
+        return MsgPackSlice(std::move(owner), raw + start, (size_t)(stop - start));
+    }
+
+    // True if record n lies within a buffer of size bytes
+    bool contains(size_t n, size_t size) const
+    {
+        if (n >= offsets.size() || end > size)
+            return false;
+        uint64_t stop = n + 1 < offsets.size() ? offsets[n + 1] : end;
+        return offsets[n] < stop && stop <= end;
+    }
+
+    // Sidecar file: magic, version, count, end, then LEB128 offset deltas
+    bool save(const std::string &path) const
+    {
+        std::vector<unsigned char> out(s_magic, s_magic + 4);
+        put_varint(out, 1);
+        put_varint(out, offsets.size());
+        put_varint(out, end);
+        uint64_t previous = 0;
+        for (uint64_t offset : offsets)
+        {
+            put_varint(out, offset - previous);
+            previous = offset;
+        }
+
+        FILE *f = fopen(path.c_str(), "wb");
+        if (!f)
+            return false;
+        bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+        return fclose(f) == 0 && ok;
+    }
+
+    // Loads a sidecar written by save(). The offsets must increase and lie
+    // before end, and end must not be past size, the size of the indexed
+    // file now (it may have grown since). Nothing is changed on failure.
+    bool load(const std::string &path, uint64_t size = UINT64_MAX)
+    {
+        FILE *f = fopen(path.c_str(), "rb");
+        if (!f)
+            return false;
+        std::vector<unsigned char> in;
+        unsigned char chunk[65536];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+            in.insert(in.end(), chunk, chunk + n);
+        fclose(f);
+
+        size_t current = 4;
+        uint64_t version, count, stop;
+        if (in.size() < 4 || memcmp(in.data(), s_magic, 4) != 0 ||
+            !get_varint(in, current, version) || version != 1 ||
+            !get_varint(in, current, count) || !get_varint(in, current, stop) ||
+            count > in.size() - current || stop > size)
+            return false;
+
+        std::vector<uint64_t> loaded;
+        loaded.reserve((size_t)count);
+        uint64_t previous = 0;
+        for (uint64_t i = 0; i < count; i++)
+        {
+            uint64_t delta;
+            if (!get_varint(in, current, delta) || (i > 0 && delta == 0) || delta >= stop - previous)
+                return false;
+            previous += delta;
+            loaded.push_back(previous);
+        }
+
+        offsets = std::move(loaded);
+        end = stop;
+        return true;
+    }
+
+private:
+    static constexpr unsigned char s_magic[4] = {'M', 'P', 'I', 'X'};
+
+    static void put_varint(std::vector<unsigned char> &out, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out.push_back((unsigned char)(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back((unsigned char)value);
+    }
+
+    static bool get_varint(const std::vector<unsigned char> &in, size_t &current, uint64_t &value)
+    {
+        value = 0;
+        for (int shift = 0; shift < 64 && current < in.size(); shift += 7)
+        {
+            unsigned char byte = in[current++];
+            value |= (uint64_t)(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+        return false;
+    }
+};
+
+typedef enum e_MsgPackFraming
+{
+    MSGPACK_FRAMING_DELIMITED,       // Concatenated objects, boundaries found by skipping headers
+    MSGPACK_FRAMING_LENGTH_PREFIXED, // Each object preceded by a 4 byte big endian length
+} MsgPackFraming;
+
+// Splits a byte stream into frames. Received bytes go into an internal
+// buffer that is reused between calls, complete frames are passed to the
+// callback as borrowed slices that are only valid during the call. Nothing
+// is decoded, delimited framing only reads headers.
+class MsgPackFramer
+{
+public:
+    MsgPackFramer(MsgPackFraming framing = MSGPACK_FRAMING_DELIMITED, size_t max_frame = 64 * 1024 * 1024)
+        : m_framing(framing), m_max_frame(max_frame)
+    {
+    }
+
+    // Space for at least size more bytes, follow with commit()
+    unsigned char *prepare(size_t size)
+    {
+        if (m_buffer.size() - m_end < size)
+            m_buffer.resize(m_end + size);
+        return m_buffer.data() + m_end;
+    }
+
+    void commit(size_t size) { m_end += size; }
+
+    // Passes every complete frame to callback(const MsgPackSlice &) and
+    // returns how many there were. Throws on malformed or oversized frames.
+    template <typename F>
+    size_t consume(F &&callback)
+    {
+        MsgPackDecodeError error;
+        size_t frames = consume(std::forward<F>(callback), error);
+        if (error)
+            MSGPACK_THROW(error.code == MSGPACK_ERROR_LIMIT ? "frame too large" : "malformed frame");
+        return frames;
+    }
+
+    // As above, but a malformed or oversized frame is reported in error with
+    // its offset in the stream. The stream cannot be resynchronised after
+    // that, the connection should be dropped.
+    template <typename F>
+    size_t consume(F &&callback, MsgPackDecodeError &error)
+    {
+        size_t frames = 0;
+        MsgPackSlice frame;
+        while (next(frame, error))
+        {
+            callback(frame);
+            frames++;
+        }
+
+        // Keep the partial frame, scanner offsets are relative to its start
+        if (m_start > 0)
+        {
+            memmove(m_buffer.data(), m_buffer.data() + m_start, m_end - m_start);
+            m_end -= m_start;
+            m_offset += m_start;
+            m_start = 0;
+        }
+        return frames;
+    }
+
+    // Copies data in and consumes, for bytes that are already in memory
+    template <typename F>
+    size_t feed(const unsigned char *data, size_t size, F &&callback)
+    {
+        memcpy(prepare(size), data, size);
+        commit(size);
+        return consume(std::forward<F>(callback));
+    }
+
+    template <typename F>
+    size_t feed(const unsigned char *data, size_t size, F &&callback, MsgPackDecodeError &error)
+    {
+        memcpy(prepare(size), data, size);
+        commit(size);
+        return consume(std::forward<F>(callback), error);
+    }
+
+#if defined(__unix__) || defined(__APPLE__)
+    // Reads once from fd straight into the buffer and consumes, returns the
+    // read() result so 0 and -1 can be handled by the caller
+    template <typename F>
+    ssize_t read(int fd, F &&callback, size_t chunk = 65536)
+    {
+        ssize_t n = ::read(fd, prepare(chunk), chunk);
+        if (n > 0)
+        {
+            commit((size_t)n);
+            consume(std::forward<F>(callback));
+        }
+        return n;
+    }
+
+    template <typename F>
+    ssize_t read(int fd, F &&callback, MsgPackDecodeError &error, size_t chunk = 65536)
+    {
+        ssize_t n = ::read(fd, prepare(chunk), chunk);
+        if (n > 0)
+        {
+            commit((size_t)n);
+            consume(std::forward<F>(callback), error);
+        }
+        return n;
+    }
+#endif
+
+    // Bytes of an incomplete frame waiting for more data
+    size_t buffered() const { return m_end - m_start; }
+
+    // Appends a length prefixed frame
+    static void append_prefixed(std::vector<unsigned char> &out, const unsigned char *data, size_t size)
+    {
+        size_t start = out.size();
+        out.resize(start + 4 + size);
+        MsgPackEncoder::store32(out.data() + start, (uint32_t)size);
+        memcpy(out.data() + start + 4, data, size);
+    }
+
+private:
+    bool next(MsgPackSlice &frame, MsgPackDecodeError &error)
+    {
+        const unsigned char *data = m_buffer.data() + m_start;
+        size_t size = m_end - m_start;
+        size_t header = 0;
+        size_t length = 0;
+
+        if (m_framing == MSGPACK_FRAMING_LENGTH_PREFIXED)
+        {
+            if (size < 4)
+                return false;
+            header = 4;
+            length = msgpack_load32(data);
+            if (length > m_max_frame)
+                return fail(error, MSGPACK_ERROR_LIMIT);
+            if (length > size - 4)
+                return false;
+        }
+        else
+        {
+            MsgPackScanStatus status = m_scanner.scan(data, size);
+            if (status == MSGPACK_SCAN_MALFORMED || status == MSGPACK_SCAN_TOO_DEEP)
+                return fail(error, msgpack_scan_error(status));
+            if (status == MSGPACK_SCAN_NEED_MORE)
+            {
+                if (size > m_max_frame)
+                    return fail(error, MSGPACK_ERROR_LIMIT);
+                return false;
+            }
+            length = m_scanner.size();
+            m_scanner.reset();
+        }
+
+        frame = MsgPackSlice(nullptr, data + header, length);
+        m_start += header + length;
+        return true;
+    }
+
+    bool fail(MsgPackDecodeError &error, MsgPackError code)
+    {
+        error.code = code;
+        error.offset = m_offset + m_start;
+        return false;
+    }
+
+    MsgPackFraming m_framing;
+    size_t m_max_frame;
+    std::vector<unsigned char> m_buffer;
+    size_t m_start = 0;
+    size_t m_end = 0;
+    size_t m_offset = 0; // Stream offset of the start of the buffer
+    MsgPackStreamScanner m_scanner;
+};
+
+// Options for decoding on several threads, 0 threads uses every core
+typedef struct MsgPackParallel
+{
+    unsigned threads = 0;
+    size_t min_chunk = 64;    // Fewest objects handed to a worker at once
+    size_t min_array = 4096;  // Smallest array whose elements are split across workers
+} MsgPackParallel;
+
+// Options for MsgPack
+typedef struct MsgPackOptions
+{
+    int limit = -1;       // Top level objects to decode, -1 for all of them
+    bool strict = false;  // Throw on STR payloads that are not valid UTF-8
+    MsgPackLimits limits; // Bounds for untrusted input
+} MsgPackOptions;
+
+// True on a worker thread of msgpack_parallel_for, nested calls run serially
+inline bool &msgpack_in_parallel()
+{
+    static thread_local bool in_parallel = false;
+    return in_parallel;
+}
+
+// Calls f(begin, end) over [0, count) in chunks pulled by worker threads.
+// The calling thread works too. The first exception thrown is rethrown.
+template <typename F>
+void msgpack_parallel_for(size_t count, const MsgPackParallel &parallel, F &&f)
+{
+    unsigned threads = parallel.threads ? parallel.threads : std::max(1u, std::thread::hardware_concurrency());
+    size_t chunk = std::max<size_t>(parallel.min_chunk, count / ((size_t)threads * 8) + 1);
+    threads = (unsigned)std::min<size_t>(threads, (count + chunk - 1) / chunk);
+
+    if (threads <= 1 || msgpack_in_parallel())
+    {
+        if (count > 0)
+            f((size_t)0, count);
+        return;
+    }
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    auto worker = [&]()
+    {
+        bool was_parallel = msgpack_in_parallel();
+        msgpack_in_parallel() = true;
+        while (!failed.load(std::memory_order_relaxed))
+        {
+            size_t begin = next.fetch_add(chunk, std::memory_order_relaxed);
+            if (begin >= count)
+                break;
+#ifdef MSGPACK_NO_EXCEPTIONS
+            f(begin, std::min(begin + chunk, count));
+#else
+            try
+            {
+                f(begin, std::min(begin + chunk, count));
+            }
+            catch (...)
             {
-                ret << "0x" << std::hex << (int)n << std::dec << ",";
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error)
+                    error = std::current_exception();
+                failed = true;
             }
+#endif
+        }
+        msgpack_in_parallel() = was_parallel;
+    };
+
+    std::vector<std::thread> pool;
+    pool.reserve(threads - 1);
+    for (unsigned i = 0; i + 1 < threads; i++)
+        pool.emplace_back(worker);
+    worker();
+    for (auto &t : pool)
+        t.join();
+
+    if (error)
+        std::rethrow_exception(error);
+}
+
+class MsgPack
+{
+private:
+    bool m_little_endian;
+    std::shared_ptr<const void> m_owner; // Keeps the source alive for slices
+    MsgPackParallel m_parallel;
+    bool m_use_parallel = false;
+    bool m_strict = false;
+
+    // Objects and payload bytes decoded so far. Atomic as the workers of a
+    // parallel decode share one budget, copied only once decoding is over.
+    struct Budget
+    {
+        std::atomic<size_t> nodes{0};
+        std::atomic<uint64_t> bytes{0};
+
+        Budget() {}
+        Budget(const Budget &other) : nodes(other.nodes.load()), bytes(other.bytes.load()) {}
+        Budget &operator=(const Budget &other)
+        {
+            nodes = other.nodes.load();
+            bytes = other.bytes.load();
+            return *this;
+        }
+    };
+
+    // The depth is always checked, the other limits only when m_limited
+    // says one of them is set
+    MsgPackLimits m_limits;
+    bool m_limited = false;
+    Budget m_budget;
+
+public:
+    std::vector<std::shared_ptr<MsgPackObj>> objects;
+    size_t consumed = 0;
+    MsgPackDecodeError error;
+
+    // The constructors throw error.message() for malformed input, use
+    // try_decode() to get the error back instead
+
+    MsgPack(std::vector<unsigned char> raw, int limit = -1)
+        : MsgPack(std::move(raw), limit_options(limit))
+    {
+    }
+
+    // Decodes concatenated top level objects on several threads. Record
+    // boundaries are found with a header only scan first, the result is the
+    // same as the single threaded decode. Every option applies, the workers
+    // share one node and byte budget.
+    MsgPack(std::vector<unsigned char> raw, const MsgPackParallel &parallel, const MsgPackOptions &options = MsgPackOptions())
+    {
+        auto buffer = std::make_shared<const std::vector<unsigned char>>(std::move(raw));
+        start_parallel(buffer, buffer->data(), buffer->size(), parallel, options);
+        throw_if_failed();
+    }
+
+    // Parallel decode of memory the caller keeps alive, nothing is copied
+    MsgPack(const unsigned char *raw, size_t size, const MsgPackParallel &parallel, const MsgPackOptions &options = MsgPackOptions())
+    {
+        start_parallel(nullptr, raw, size, parallel, options);
+        throw_if_failed();
+    }
+
+    // Shares an existing buffer, BIN/EXT slices keep it alive
+    MsgPack(std::shared_ptr<const std::vector<unsigned char>> raw, int limit = -1)
+    {
+        start(raw, raw->data(), raw->size(), limit_options(limit));
+        throw_if_failed();
+    }
+
+    // Borrows memory the caller keeps alive for as long as any BIN/EXT
+    // slice from the result is in use, nothing is copied
+    MsgPack(const unsigned char *raw, size_t size, int limit = -1)
+        : MsgPack(nullptr, raw, size, limit)
+    {
+    }
+
+    // Decodes memory kept alive by owner, slices share the owner
+    MsgPack(std::shared_ptr<const void> owner, const unsigned char *raw, size_t size, int limit = -1)
+    {
+        start(std::move(owner), raw, size, limit_options(limit));
+        throw_if_failed();
+    }
+
+    // Decodes with options, see MsgPackOptions
+    MsgPack(std::vector<unsigned char> raw, const MsgPackOptions &options)
+    {
+        auto buffer = std::make_shared<const std::vector<unsigned char>>(std::move(raw));
+        start(buffer, buffer->data(), buffer->size(), options);
+        throw_if_failed();
+    }
+
+    MsgPack(const unsigned char *raw, size_t size, const MsgPackOptions &options)
+    {
+        start(nullptr, raw, size, options);
+        throw_if_failed();
+    }
+
+    // Non-throwing decode, the error has the code, offset and path of the
+    // first problem. raw is borrowed as with the constructor.
+    static MsgPackExpected<MsgPack> try_decode(const unsigned char *raw, size_t size, const MsgPackOptions &options = MsgPackOptions())
+    {
+        MsgPack result;
+        result.start(nullptr, raw, size, options);
+        if (result.error)
+            return MsgPackExpected<MsgPack>(std::move(result.error));
+        return MsgPackExpected<MsgPack>(std::move(result));
+    }
+
+    // Decodes memory kept alive by owner, slices share the owner
+    static MsgPackExpected<MsgPack> try_decode(std::shared_ptr<const void> owner, const unsigned char *raw, size_t size, const MsgPackOptions &options = MsgPackOptions())
+    {
+        MsgPack result;
+        result.start(std::move(owner), raw, size, options);
+        if (result.error)
+            return MsgPackExpected<MsgPack>(std::move(result.error));
+        return MsgPackExpected<MsgPack>(std::move(result));
+    }
+
+    static MsgPackExpected<MsgPack> try_decode(std::vector<unsigned char> raw, const MsgPackOptions &options = MsgPackOptions())
+    {
+        auto buffer = std::make_shared<const std::vector<unsigned char>>(std::move(raw));
+        MsgPack result;
+        result.start(buffer, buffer->data(), buffer->size(), options);
+        if (result.error)
+            return MsgPackExpected<MsgPack>(std::move(result.error));
+        return MsgPackExpected<MsgPack>(std::move(result));
+    }
 
-            ret << ")";
-            break;
-        case MsgpackType::STR:
-            ret << "STR(" << m_str << ")";
-            break;
-        case MsgpackType::MAP:
-            ret << "MAP(";
-            for (const auto &n : m_map_string)
-            {
-                ret << n.first << " : ";
-                n.second->to_string(false);
-                ret << ", ";
-            }
-            ret << ")";
-            break;
-        default:
-            ret << "??" << type;
-            break;
+    // Value at path in the first top level object that contains it, or T()
+    template <typename T>
+    T get(const MsgPackPath &path)
+    {
+        T value;
+        for (const auto &n : objects)
+        {
+            if (path.get(n, value))
+                return value;
         }
+        return T();
+    }
 
-        if (new_line)
+    std::unordered_map<std::string, std::shared_ptr<MsgPackObj>> as_str_map()
+    {
+
+        if (objects.size() == 0)
+        {
+            // Exception
+        }
+
+        if (!objects[0]->is_str_map())
         {
-            ret << std::endl;
+            // Exception
         }
 
-        return ret;
+        return objects[0]->as_str_map();
     }
 
-    void print(bool new_line = true)
+private:
+    static bool is_little_endian()
     {
-        std::cout << to_string(new_line).str();
+        char num = 1;
+        return *(char *)&num == 1;
     }
-};
 
-class MsgPack
-{
-private:
-    bool m_little_endian;
+    MsgPack() {}
 
-public:
-    std::vector<std::shared_ptr<MsgPackObj>> objects;
-    size_t consumed = 0;
+    static MsgPackOptions limit_options(int limit)
+    {
+        MsgPackOptions options;
+        options.limit = limit;
+        return options;
+    }
 
-    MsgPack(std::vector<unsigned char> raw, int limit = -1)
+    void apply(const MsgPackOptions &options)
     {
+        m_little_endian = is_little_endian();
+        m_strict = options.strict;
+        m_limits = options.limits;
+        m_limited = m_limits.max_container || m_limits.max_nodes || m_limits.max_bytes;
+    }
 
-        if (limit > 0)
+    void start(std::shared_ptr<const void> owner, const unsigned char *raw, size_t size, const MsgPackOptions &options)
+    {
+        apply(options);
+        m_owner = std::move(owner);
+        if (options.limit > 0)
         {
-            objects.reserve(limit);
+            objects.reserve(std::min<size_t>(options.limit, size));
         }
 
-        char num = 1;
-        if (*(char *)&num == 1)
+        consumed = decode(raw, size, 0, options.limit > 0 ? options.limit : 0, 0, objects, error);
+    }
+
+    void start_parallel(std::shared_ptr<const void> owner, const unsigned char *raw, size_t size, const MsgPackParallel &parallel, const MsgPackOptions &options)
+    {
+        apply(options);
+        m_owner = std::move(owner);
+        m_parallel = parallel;
+        m_use_parallel = true;
+
+        // A malformed record ends the index, the serial decoder reports it
+        MsgPackIndex index;
+        MsgPackDecodeError malformed;
+        index.update(raw, size, malformed);
+        size_t limit = options.limit > 0 ? (size_t)options.limit : 0;
+        if (limit && index.offsets.size() > limit)
         {
-            m_little_endian = true;
+            index.end = index.offsets[limit];
+            index.offsets.resize(limit);
         }
-        else
+        decode_each(raw, size, index.offsets, objects, false, 0, error);
+
+        // Anything the scan could not delimit is left to the serial decoder
+        if (!error && limit && objects.size() == limit)
+            consumed = (size_t)index.end;
+        else if (!error)
+            consumed = decode(raw, size, (size_t)index.end, limit ? limit - objects.size() : 0, 0, objects, error);
+        m_use_parallel = false;
+    }
+
+    void throw_if_failed() const
+    {
+        if (error)
         {
-            m_little_endian = false;
+            MSGPACK_THROW(error.message());
         }
+    }
 
-        size_t current = 0;
-        while (current < raw.size())
+    // True if the required bytes after the type byte at current are there
+    static bool check_size(size_t current, size_t required, size_t size)
+    {
+        return required < size - current;
+    }
+
+    static size_t fail(MsgPackDecodeError &error, MsgPackError code, size_t offset)
+    {
+        error.code = code;
+        error.offset = offset;
+        return offset;
+    }
+
+    // Counts STR/BIN/EXT payload bytes against the limits
+    bool add_payload(size_t length)
+    {
+        uint64_t bytes = m_budget.bytes.fetch_add(length, std::memory_order_relaxed) + length;
+        return !m_limits.max_bytes || bytes <= m_limits.max_bytes;
+    }
+
+    // Checks a container at the given nesting depth against the limits
+    bool check_container(uint32_t elements, size_t depth, size_t current, MsgPackDecodeError &error)
+    {
+        if (m_limited && m_limits.max_container && elements > m_limits.max_container)
         {
+            fail(error, MSGPACK_ERROR_LIMIT, current);
+            return false;
+        }
+        if (m_limits.max_depth && depth >= m_limits.max_depth)
+        {
+            fail(error, MSGPACK_ERROR_DEPTH, current);
+            return false;
+        }
+        return true;
+    }
+
+    // Decodes one object at each offset in to the matching slot of out,
+    // spread across worker threads. The error reported is the one at the
+    // lowest offset, as the serial decoder would find it.
+    void decode_each(const unsigned char *raw, size_t size, const std::vector<uint64_t> &offsets, std::vector<std::shared_ptr<MsgPackObj>> &out, bool index_path, size_t depth, MsgPackDecodeError &error)
+    {
+        std::mutex error_mutex;
+        size_t error_index = offsets.size();
+
+        out.resize(offsets.size());
+        msgpack_parallel_for(offsets.size(), m_parallel, [&](size_t begin, size_t end)
+                             {
+                                 std::vector<std::shared_ptr<MsgPackObj>> one;
+                                 one.reserve(1);
+                                 MsgPackDecodeError local;
+                                 for (size_t i = begin; i < end; i++)
+                                 {
+                                     decode(raw, size, (size_t)offsets[i], 1, depth, one, local);
+                                     if (local)
+                                     {
+                                         std::lock_guard<std::mutex> lock(error_mutex);
+                                         if (i < error_index)
+                                         {
+                                             error_index = i;
+                                             error = std::move(local);
+                                         }
+                                         return;
+                                     }
+                                     out[i] = std::move(one[0]);
+                                     one.clear();
+                                 }
+                             });
+
+        if (error && index_path)
+            error.prepend(error_index);
+    }
+
+    // Finds the element boundaries of an array with a skip pass then decodes
+    // the elements in parallel, returns the offset after the last element
+    size_t decode_array_parallel(const unsigned char *raw, size_t size, size_t current, uint32_t elements, size_t depth, std::vector<std::shared_ptr<MsgPackObj>> &out, MsgPackDecodeError &error)
+    {
+        std::vector<uint64_t> offsets;
+        offsets.reserve(std::min<size_t>(elements, size - current));
+        size_t end = current;
+        for (uint32_t i = 0; i < elements; i++)
+        {
+            offsets.push_back(end);
+            if (!msgpack_skip(raw, size, end))
+            {
+                // Let the serial decoder report the problem
+                out.reserve(offsets.size());
+                return decode(raw, size, current, elements, depth, out, error);
+            }
+        }
+
+        decode_each(raw, size, offsets, out, true, depth, error);
+        return end;
+    }
+
+    // Decodes objects from raw[current] until size or limit objects (0 for
+    // no limit) have been read, returns the offset after the last object.
+    // depth is the number of containers the objects are nested in. Stops at
+    // the first problem and describes it in error.
+    size_t decode(const unsigned char *raw, size_t size, size_t current, size_t limit, size_t depth, std::vector<std::shared_ptr<MsgPackObj>> &out, MsgPackDecodeError &error)
+    {
+        while (current < size)
+        {
+            if (m_limited && m_limits.max_nodes && m_budget.nodes.fetch_add(1, std::memory_order_relaxed) >= m_limits.max_nodes)
+            {
+                return fail(error, MSGPACK_ERROR_LIMIT, current);
+            }
+
             if ((uint8_t)raw[current] <= 0x7f)
             {
-                objects.push_back(std::make_shared<MsgPackObj>((uint8_t)raw[current], true, false));
+                out.push_back(std::make_shared<MsgPackObj>((uint8_t)raw[current], true, false));
                 current += 1;
             }
 
             else if (raw[current] == 0xc0) // NIL
             {
-                objects.push_back(std::make_shared<MsgPackObj>());
+                out.push_back(std::make_shared<MsgPackObj>());
                 current += 1;
             }
             else if (raw[current] == 0xc2) // FALSE
             {
-                objects.push_back(std::make_shared<MsgPackObj>(false));
+                out.push_back(std::make_shared<MsgPackObj>(false));
                 current += 1;
             }
             else if (raw[current] == 0xc3) // TRUE
             {
-                objects.push_back(std::make_shared<MsgPackObj>(true));
+                out.push_back(std::make_shared<MsgPackObj>(true));
                 current += 1;
             }
-            else if (raw[current] == 0xc4) // BIN8
+            else if (raw[current] >= 0xc4 && raw[current] <= 0xc6) // BIN8, BIN16, BIN32
             {
-                if (current + 1 >= raw.size())
+                MsgPackHeader header;
+                if (!msgpack_read_header(raw, size, current, header) || header.length > size - current - header.header_size)
                 {
-                    // Exception
+                    return fail(error, MSGPACK_ERROR_TRUNCATED, current);
                 }
-                uint8_t size = (uint8_t)raw[current + 1];
 
-                if (current + 1 + size >= raw.size())
+                if (m_limited && !add_payload(header.length))
                 {
-                    // Exception
+                    return fail(error, MSGPACK_ERROR_LIMIT, current);
                 }
-                std::shared_ptr<std::vector<unsigned char>> value = std::make_shared<std::vector<unsigned char>>();
-                value->reserve(size);
-                for (int ind = 0; ind < size; ind++)
-                {
-                    value->push_back((unsigned char)raw[current + 2 + ind]);
-                }
-                objects.push_back(std::make_shared<MsgPackObj>(value));
-                current += 2 + size;
+
+                MsgPackSlice value(m_owner, raw + current + header.header_size, header.length);
+                out.push_back(std::make_shared<MsgPackObj>(value));
+                current += header.header_size + header.length;
             }
             else if (raw[current] == 0xca) // FLOAT
             {
-                check_size(current, 4, raw.size());
+                if (!check_size(current, 4, size))
+                {
+                    return fail(error, MSGPACK_ERROR_TRUNCATED, current);
+                }
 
                 float value;
                 uint8_t *v_ptr = (uint8_t *)&value;
@@ -483,12 +5384,15 @@ public:
                     *(v_ptr + 2) = raw[current + 3];
                     *(v_ptr + 3) = raw[current + 4];
                 }
-                objects.push_back(std::make_shared<MsgPackObj>(value));
+                out.push_back(std::make_shared<MsgPackObj>(value));
                 current += 5;
             }
             else if (raw[current] == 0xcb) // DOUBLE
             {
-                check_size(current, 8, raw.size());
+                if (!check_size(current, 8, size))
+                {
+                    return fail(error, MSGPACK_ERROR_TRUNCATED, current);
+                }
 
                 double value;
                 uint8_t *v_ptr = (uint8_t *)&value;
@@ -514,24 +5418,24 @@ public:
                     *(v_ptr + 6) = raw[current + 7];
                     *(v_ptr + 7) = raw[current + 8];
                 }
-                objects.push_back(std::make_shared<MsgPackObj>(value));
+                out.push_back(std::make_shared<MsgPackObj>(value));
                 current += 9;
             }
             else if (raw[current] == 0xcc) // UINT8
             {
-                if (current + 1 >= raw.size())
+                if (!check_size(current, 1, size))
                 {
-                    // Exception
+                    return fail(error, MSGPACK_ERROR_TRUNCATED, current);
                 }
-                objects.push_back(std::make_shared<MsgPackObj>((uint8_t)raw[current + 1]));
+                out.push_back(std::make_shared<MsgPackObj>((uint8_t)raw[current + 1]));
                 current += 2;
             }
             else if (raw[current] == 0xcd) // UINT16
             {
 
-                if (current + 2 >= raw.size())
+                if (!check_size(current, 2, size))
                 {
-                    // Exception
+                    return fail(error, MSGPACK_ERROR_TRUNCATED, current);
                 }
 
                 uint16_t value;
@@ -546,15 +5450,15 @@ public:
                     *(v_ptr) = raw[current + 1];
                     *(v_ptr + 1) = raw[current + 2];
                 }
-                objects.push_back(std::make_shared<MsgPackObj>(value));
+                out.push_back(std::make_shared<MsgPackObj>(value));
                 current += 3;
             }
             else if (raw[current] == 0xce) // UINT32
             {
 
-                if (current + 4 >= raw.size())
+                if (!check_size(current, 4, size))
                 {
-                    // Exception
+                    return fail(error, MSGPACK_ERROR_TRUNCATED, current);
                 }
 
                 uint32_t value;
@@ -573,12 +5477,15 @@ public:
                     *(v_ptr + 2) = raw[current + 3];
                     *(v_ptr + 3) = raw[current + 4];
                 }
-                objects.push_back(std::make_shared<MsgPackObj>(value));
+                out.push_back(std::make_shared<MsgPackObj>(value));
                 current += 5;
             }
             else if (raw[current] == 0xcf) // UINT64
             {
-                check_size(current, 8, raw.size());
+                if (!check_size(current, 8, size))
+                {
+                    return fail(error, MSGPACK_ERROR_TRUNCATED, current);
+                }
 
                 uint64_t value;
                 uint8_t *v_ptr = (uint8_t *)&value;
@@ -604,20 +5511,26 @@ public:
                     *(v_ptr + 6) = raw[current + 7];
                     *(v_ptr + 7) = raw[current + 8];
                 }
-                objects.push_back(std::make_shared<MsgPackObj>(value));
+                out.push_back(std::make_shared<MsgPackObj>(value));
                 current += 9;
             }
 
             else if (raw[current] == 0xd0) // INT8
             {
-                check_size(current, 1, raw.size());
-                objects.push_back(std::make_shared<MsgPackObj>((int8_t)raw[current + 1], false, false));
+                if (!check_size(current, 1, size))
+                {
+                    return fail(error, MSGPACK_ERROR_TRUNCATED, current);
+                }
+                out.push_back(std::make_shared<MsgPackObj>((int8_t)raw[current + 1], false, false));
                 current += 2;
             }
             else if (raw[current] == 0xd1) // INT16
             {
 
-                check_size(current, 2, raw.size());
+                if (!check_size(current, 2, size))
+                {
+                    return fail(error, MSGPACK_ERROR_TRUNCATED, current);
+                }
 
                 int16_t value;
                 uint8_t *v_ptr = (uint8_t *)&value;
@@ -631,12 +5544,15 @@ public:
                     *(v_ptr) = raw[current + 1];
                     *(v_ptr + 1) = raw[current + 2];
                 }
-                objects.push_back(std::make_shared<MsgPackObj>(value));
+                out.push_back(std::make_shared<MsgPackObj>(value));
                 current += 3;
             }
             else if (raw[current] == 0xd2) // INT32
             {
-                check_size(current, 4, raw.size());
+                if (!check_size(current, 4, size))
+                {
+                    return fail(error, MSGPACK_ERROR_TRUNCATED, current);
+                }
 
                 int32_t value;
                 uint8_t *v_ptr = (uint8_t *)&value;
@@ -654,12 +5570,15 @@ public:
                     *(v_ptr + 2) = raw[current + 3];
                     *(v_ptr + 3) = raw[current + 4];
                 }
-                objects.push_back(std::make_shared<MsgPackObj>(value));
+                out.push_back(std::make_shared<MsgPackObj>(value));
                 current += 5;
             }
             else if (raw[current] == 0xd3) // INT64
             {
-                check_size(current, 8, raw.size());
+                if (!check_size(current, 8, size))
+                {
+                    return fail(error, MSGPACK_ERROR_TRUNCATED, current);
+                }
 
                 int64_t value;
                 uint8_t *v_ptr = (uint8_t *)&value;
@@ -685,254 +5604,1005 @@ public:
                     *(v_ptr + 6) = raw[current + 7];
                     *(v_ptr + 7) = raw[current + 8];
                 }
-                objects.push_back(std::make_shared<MsgPackObj>(value));
+                out.push_back(std::make_shared<MsgPackObj>(value));
                 current += 9;
             }
 
-            else if ((raw[current] & 0xE0) == 0xA0) // Fixed string
-            {
+            else if ((raw[current] & 0xE0) == 0xA0 || (raw[current] >= 0xd9 && raw[current] <= 0xdb)) // Fixed string, STR8, STR16, STR32
+            {
+                MsgPackHeader header;
+                if (!msgpack_read_header(raw, size, current, header) || header.length > size - current - header.header_size)
+                {
+                    return fail(error, MSGPACK_ERROR_TRUNCATED, current);
+                }
+
+                if (m_limited && !add_payload(header.length))
+                {
+                    return fail(error, MSGPACK_ERROR_LIMIT, current);
+                }
+
+                const unsigned char *text = raw + current + header.header_size;
+                if (m_strict)
+                {
+                    // Checked while it is copied, the payload is read once
+                    std::string str(header.length, '\0');
+                    if (!msgpack_utf8_copy(text, header.length, (unsigned char *)str.data()))
+                    {
+                        return fail(error, MSGPACK_ERROR_INVALID_UTF8, current);
+                    }
+                    out.push_back(std::make_shared<MsgPackObj>(std::move(str)));
+                }
+                else
+                {
+                    out.push_back(std::make_shared<MsgPackObj>(std::string((const char *)text, header.length)));
+                }
+                current += header.header_size + header.length;
+            }
+            else if ((raw[current] >= 0xc7 && raw[current] <= 0xc9) || (raw[current] >= 0xd4 && raw[current] <= 0xd8)) // EXT8, EXT16, EXT32, FIXEXT1-16
+            {
+                MsgPackHeader header;
+                if (!msgpack_read_header(raw, size, current, header) || header.length > size - current - header.header_size)
+                {
+                    return fail(error, MSGPACK_ERROR_TRUNCATED, current);
+                }
+
+                if (m_limited && !add_payload(header.length))
+                {
+                    return fail(error, MSGPACK_ERROR_LIMIT, current);
+                }
+
+                // Checked here so a bad timestamp is reported rather than
+                // thrown by the MsgPackObj constructor
+                int64_t seconds;
+                uint32_t nanoseconds;
+                if (header.ext_type == -1 && !msgpack_read_timestamp(raw + current + header.header_size, header.length, seconds, nanoseconds))
+                {
+                    return fail(error, MSGPACK_ERROR_TIMESTAMP, current);
+                }
+
+                MsgPackSlice payload(m_owner, raw + current + header.header_size, header.length);
+                out.push_back(std::make_shared<MsgPackObj>(header.ext_type, payload));
+                current += header.header_size + header.length;
+            }
+            else if ((raw[current] & 0xF0) == 0x80 || raw[current] == 0xde || raw[current] == 0xdf) // FIXMAP, MAP16, MAP32
+            {
+
+                size_t used = 0;
+                uint32_t elements;
+                if (raw[current] == 0xde)
+                {
+                    if (!check_size(current, 2, size))
+                    {
+                        return fail(error, MSGPACK_ERROR_TRUNCATED, current);
+                    }
+                    elements = raw[current + 1] << 8 | raw[current + 2];
+                    used = 2;
+                }
+                else if (raw[current] == 0xdf)
+                {
+                    if (!check_size(current, 4, size))
+                    {
+                        return fail(error, MSGPACK_ERROR_TRUNCATED, current);
+                    }
+                    elements = raw[current + 1] << 24 | raw[current + 2] << 16 | raw[current + 3] << 8 | raw[current + 4];
+                    used = 4;
+                }
+                else
+                {
+                    elements = raw[current] & 0x0F;
+                    used = 0;
+                }
+
+                if (!check_container(elements, depth, current, error))
+                {
+                    return current;
+                }
+
+                // Every child takes at least one byte, reserve no more than
+                // the input could hold whatever the header claims. Nested
+                // containers all hold their reserve at once, so cap it too.
+                std::vector<std::shared_ptr<MsgPackObj>> children;
+                size_t next = current + 1 + used;
+                if (elements > 0)
+                {
+                    children.reserve(std::min<size_t>({(size_t)elements * 2, size - next, MSGPACK_MAX_RESERVE}));
+                    next = decode(raw, size, next, (size_t)elements * 2, depth + 1, children, error);
+                }
+
+                if (error)
+                {
+                    // Values are named by their key, keys by their pair index
+                    size_t failed = children.size();
+                    const MsgPackObj *key = failed % 2 ? children[failed - 1].get() : nullptr;
+                    if (key && key->is_str())
+                        error.prepend(key->m_str);
+                    else if (key && key->is_integer())
+                        error.prepend(std::to_string(key->as_int64()));
+                    else
+                        error.prepend(failed / 2);
+                    return current;
+                }
+                if (children.size() != (size_t)elements * 2)
+                {
+                    return fail(error, MSGPACK_ERROR_TRUNCATED, next);
+                }
+
+                std::vector<std::pair<std::shared_ptr<MsgPackObj>, std::shared_ptr<MsgPackObj>>> pairs;
+                pairs.reserve(elements);
+                for (uint32_t i = 0; i < elements * 2; i += 2)
+                {
+                    pairs.emplace_back(std::move(children[i]), std::move(children[i + 1]));
+                }
+
+                out.push_back(std::make_shared<MsgPackObj>(std::move(pairs)));
+                current = next;
+            }
+
+            else if ((raw[current] & 0xF0) == 0x90 || raw[current] == 0xdc || raw[current] == 0xdd) // FIXARR, ARR16, ARR32
+            {
+
+                size_t used = 0;
+                uint32_t elements;
+                if (raw[current] == 0xdc)
+                {
+                    if (!check_size(current, 2, size))
+                    {
+                        return fail(error, MSGPACK_ERROR_TRUNCATED, current);
+                    }
+                    elements = raw[current + 1] << 8 | raw[current + 2];
+                    used = 2;
+                }
+                else if (raw[current] == 0xdd)
+                {
+                    if (!check_size(current, 4, size))
+                    {
+                        return fail(error, MSGPACK_ERROR_TRUNCATED, current);
+                    }
+                    elements = raw[current + 1] << 24 | raw[current + 2] << 16 | raw[current + 3] << 8 | raw[current + 4];
+                    used = 4;
+                }
+                else
+                {
+                    elements = raw[current] & 0x0F;
+                    used = 0;
+                }
+                if (!check_container(elements, depth, current, error))
+                {
+                    return current;
+                }
+
+                std::vector<std::shared_ptr<MsgPackObj>> array;
+                size_t next = current + 1 + used;
+                if (m_use_parallel && elements >= m_parallel.min_array && !msgpack_in_parallel())
+                {
+                    next = decode_array_parallel(raw, size, next, elements, depth + 1, array, error);
+                    if (error)
+                        return current;
+                }
+                else if (elements > 0)
+                {
+                    array.reserve(std::min<size_t>({(size_t)elements, size - next, MSGPACK_MAX_RESERVE}));
+                    next = decode(raw, size, next, elements, depth + 1, array, error);
+                    if (error)
+                    {
+                        error.prepend(array.size());
+                        return current;
+                    }
+                }
+
+                if (array.size() != elements)
+                {
+                    return fail(error, MSGPACK_ERROR_TRUNCATED, next);
+                }
+
+                out.push_back(std::make_shared<MsgPackObj>(std::move(array)));
+                current = next;
+            }
+            else if (raw[current] >= 0xe0) // NEGATIVE FIXINT
+            {
+                out.push_back(std::make_shared<MsgPackObj>((int8_t)raw[current], false, true));
+                current += 1;
+            }
+            else // 0xc1, never used
+            {
+                return fail(error, MSGPACK_ERROR_RESERVED, current);
+            }
+
+            if (limit > 0 && limit == out.size())
+                break;
+        }
+
+
+        return current;
+    }
+};
+
+typedef enum e_MsgPackRpcType
+{
+    MSGPACK_RPC_REQUEST = 0,      // [0, msgid, method, params]
+    MSGPACK_RPC_RESPONSE = 1,     // [1, msgid, error, result]
+    MSGPACK_RPC_NOTIFICATION = 2, // [2, method, params]
+} MsgPackRpcType;
+
+// Envelope of a msgpack-rpc message. Only the envelope is read, params,
+// error and result stay as raw bytes in the frame until they are asked for.
+class MsgPackRpcMessage
+{
+public:
+    MsgPackRpcType type = MSGPACK_RPC_REQUEST;
+    uint32_t msgid = 0;
+    std::string_view method;
+    MsgPackSlice params;
+    MsgPackSlice error;
+    MsgPackSlice result;
+
+    // Returns false if raw is not a well formed message. Slices and method
+    // point in to raw, owner (if any) keeps it alive.
+    bool parse(const unsigned char *raw, size_t size, std::shared_ptr<const void> owner = nullptr)
+    {
+        size_t current = 0;
+        MsgPackHeader header;
+        MsgPackRawValue value;
+        if (!msgpack_read_header(raw, size, current, header) || header.type != MsgpackType::ARRAY)
+            return false;
+        current += header.header_size;
+
+        if (header.length < 3 || !msgpack_read_value(raw, size, current, value) || !value.is_integer() || value.m_uint64 > MSGPACK_RPC_NOTIFICATION)
+            return false;
+        type = (MsgPackRpcType)value.m_uint64;
+        if (header.length != (type == MSGPACK_RPC_NOTIFICATION ? 3u : 4u))
+            return false;
+        msgpack_skip(raw, size, current);
+
+        auto field = [&](MsgPackSlice &out)
+        {
+            size_t start = current;
+            if (!msgpack_skip(raw, size, current))
+                return false;
+            out = MsgPackSlice(owner, raw + start, current - start);
+            return true;
+        };
+
+        if (type != MSGPACK_RPC_NOTIFICATION)
+        {
+            if (!msgpack_read_value(raw, size, current, value) || !value.get(msgid) || value.m_uint64 > UINT32_MAX)
+                return false;
+            msgpack_skip(raw, size, current);
+        }
+
+        if (type == MSGPACK_RPC_RESPONSE)
+            return field(error) && field(result);
+
+        if (!msgpack_read_value(raw, size, current, value) || !value.is_str())
+            return false;
+        method = value.as_string_view();
+        msgpack_skip(raw, size, current);
+
+        // Parameters are always an array, param() indexes in to it
+        if (!msgpack_read_header(raw, size, current, header) || header.type != MsgpackType::ARRAY)
+            return false;
+        return field(params);
+    }
+
+    bool is_error() const { return !error.empty() && error[0] != 0xc0; }
+
+    size_t param_count() const
+    {
+        MsgPackRawValue value;
+        if (!msgpack_read_value(params.data(), params.size(), 0, value) || !value.is_array())
+            return 0;
+        return value.size;
+    }
+
+    // Reads one parameter without touching the others
+    template <typename T>
+    bool param(size_t index, T &out) const
+    {
+        size_t current = 0;
+        MsgPackHeader header;
+        if (!msgpack_read_header(params.data(), params.size(), current, header) || header.type != MsgpackType::ARRAY || index >= header.length)
+            return false;
+        current += header.header_size;
+        for (size_t i = 0; i < index; i++)
+        {
+            if (!msgpack_skip(params.data(), params.size(), current))
+                return false;
+        }
+        MsgPackRawValue value;
+        return msgpack_read_value(params.data(), params.size(), current, value) && value.get(out);
+    }
+
+    template <typename T>
+    bool get_result(T &out) const { return get(result, out); }
 
-                uint8_t size = raw[current] & 0x1F;
-                check_size(current, size, raw.size());
+    template <typename T>
+    bool get_error(T &out) const { return get(error, out); }
 
-                std::string value;
-                value.reserve(size);
+    // Decoded trees of the fields, nullptr if the field is missing or
+    // malformed. Nothing is thrown, the bytes come from the peer.
+    std::shared_ptr<MsgPackObj> decode_params() const { return decode(params); }
+    std::shared_ptr<MsgPackObj> decode_result() const { return decode(result); }
+    std::shared_ptr<MsgPackObj> decode_error() const { return decode(error); }
 
-                for (size_t index = current + 1; index <= current + size; index++)
-                    value += (char)raw[index];
-                objects.push_back(std::make_shared<MsgPackObj>(value));
-                current += 1 + size;
-            }
-            else if (raw[current] == 0xd9) // STR8
-            {
+private:
+    template <typename T>
+    static bool get(const MsgPackSlice &slice, T &out)
+    {
+        MsgPackRawValue value;
+        return msgpack_read_value(slice.data(), slice.size(), 0, value) && value.get(out);
+    }
 
-                check_size(current, 1, raw.size());
-                uint8_t size = (uint8_t)raw[current + 1];
+    static std::shared_ptr<MsgPackObj> decode(const MsgPackSlice &slice)
+    {
+        if (slice.empty())
+            return nullptr;
+        MsgPackOptions options;
+        options.limit = 1;
+        auto decoded = MsgPack::try_decode(slice.owner, slice.data(), slice.size(), options);
+        return decoded ? decoded->objects[0] : nullptr;
+    }
+};
 
-                check_size(current, 1 + size, raw.size());
+// Server side of msgpack-rpc. Methods are kept in a table sorted by name
+// hash, so dispatching a request neither allocates nor compares more than
+// the matching names. Handlers write exactly one result value, anything
+// they throw is sent back as the error. Register every method before
+// dispatching, after that dispatch() may be called from several threads.
+class MsgPackRpcServer
+{
+public:
+    typedef std::function<void(const MsgPackRpcMessage &request, MsgPackEncoder &result)> Handler;
+    typedef MsgPackBufferPool::Handle Buffer;
 
-                std::string value;
-                value.reserve(size);
+    void add(const std::string &method, Handler handler)
+    {
+        Method entry = {hash(method), method, std::move(handler)};
+        auto it = std::lower_bound(m_methods.begin(), m_methods.end(), entry, [](const Method &a, const Method &b)
+                                   { return a.hash < b.hash; });
+        m_methods.insert(it, std::move(entry));
+    }
 
-                for (size_t index = current + 2; index <= current + 1 + size; index++)
-                    value += (char)raw[index];
-                objects.push_back(std::make_shared<MsgPackObj>(value));
-                current += 2 + size;
-            }
-            else if (raw[current] == 0xda) // STR16
-            {
+    // Handles one frame and returns the encoded response, an empty buffer
+    // for notifications and stray responses. Throws if raw is not a message.
+    Buffer dispatch(const unsigned char *raw, size_t size, std::shared_ptr<const void> owner = nullptr)
+    {
+        Buffer response;
+        if (!try_dispatch(raw, size, response, std::move(owner)))
+            MSGPACK_THROW("malformed rpc message");
+        return response;
+    }
 
-                check_size(current, 2, raw.size());
-                uint16_t size = (((uint16_t)raw[current + 1]) << 8) | (uint16_t)raw[current + 2];
+    // As dispatch() but returns false instead of throwing if raw is not a
+    // message, for frames straight off the wire
+    bool try_dispatch(const unsigned char *raw, size_t size, Buffer &response, std::shared_ptr<const void> owner = nullptr)
+    {
+        response.reset();
+        MsgPackRpcMessage message;
+        if (!message.parse(raw, size, std::move(owner)))
+            return false;
+        if (message.type == MSGPACK_RPC_RESPONSE)
+            return true;
 
-                check_size(current, 2 + size, raw.size());
+        const Handler *handler = find(message.method);
+        if (message.type == MSGPACK_RPC_NOTIFICATION)
+        {
+            if (handler)
+            {
+                std::vector<unsigned char> discard;
+                MsgPackEncoder encoder(discard);
+                (*handler)(message, encoder);
+            }
+            return true;
+        }
 
-                std::string value;
-                value.reserve(size);
+        response = m_buffers.acquire();
+        response->clear();
+        MsgPackEncoder encoder(*response);
+        encoder.pack_array(4);
+        encoder.pack_uint(MSGPACK_RPC_RESPONSE);
+        encoder.pack_uint(message.msgid);
+        size_t error = response->size();
+        encoder.pack_nil();
 
-                for (size_t index = current + 3; index <= current + 2 + size; index++)
-                    value += (char)raw[index];
-                objects.push_back(std::make_shared<MsgPackObj>(value));
-                current += 3 + size;
+        const char *failure = nullptr;
+        std::string what;
+        if (!handler)
+        {
+            failure = "method not found";
+        }
+        else
+        {
+#ifdef MSGPACK_NO_EXCEPTIONS
+            (*handler)(message, encoder);
+#else
+            try
+            {
+                (*handler)(message, encoder);
+            }
+            catch (const char *e)
+            {
+                failure = e;
             }
-            else if (raw[current] == 0xdb) // STR32
+            catch (const std::exception &e)
             {
+                what = e.what();
+                failure = what.c_str();
+            }
+#endif
+        }
 
-                check_size(current, 4, raw.size());
-                uint32_t size = (((uint32_t)raw[current + 1]) << 24) | (((uint32_t)raw[current + 2]) << 16) | (((uint32_t)raw[current + 3]) << 8) | (uint32_t)raw[current + 4];
+        if (failure)
+        {
+            response->resize(error);
+            encoder.pack_str(failure);
+            encoder.pack_nil();
+        }
+        else if (response->size() == error + 1)
+        {
+            encoder.pack_nil();
+        }
+        return true;
+    }
 
-                check_size(current, 4 + size, raw.size());
-                
-                std::string value;
-                value.reserve(size);
+    MsgPackBufferPool &buffers() { return m_buffers; }
 
-                for (size_t index = current + 5; index <= current + 4 + size; index++)
-                    value += (char)raw[index];
-                objects.push_back(std::make_shared<MsgPackObj>(value));
-                current += 5 + size;
-            }
-            else if ((raw[current] & 0xF0) == 0x80 || raw[current] == 0xde || raw[current] == 0xdf) // FIXMAP, MAP16, MAP32
-            {
+private:
+    typedef struct
+    {
+        uint64_t hash;
+        std::string name;
+        Handler handler;
+    } Method;
 
-                size_t used = 0;
-                uint32_t elements;
-                if (raw[current] == 0xde)
-                {
-                    // Check that first byte of the rest of the message is good
-                    check_size(current, 2+1, raw.size());
-                    elements = raw[current + 1] << 8 | raw[current + 2];
-                    used = 2;
-                }
-                else if (raw[current] == 0xdf)
-                {
-                    // Check that first byte of the rest of the message is good
-                    check_size(current, 4+1, raw.size());
-                    elements = raw[current + 1] << 24 | raw[current + 2] << 16 | raw[current + 3] << 8 | raw[current + 4];
-                    used = 4;
-                }
-                else
-                {
-                    // Check that first byte of the rest of the message is good
-                    check_size(current, 0+1, raw.size()); 
-                    elements = raw[current] & 0x0F;
-                    used = 0;
-                }
+    static uint64_t hash(std::string_view name)
+    {
+        uint64_t h = 14695981039346656037ull;
+        for (char c : name)
+            h = (h ^ (unsigned char)c) * 1099511628211ull;
+        return h;
+    }
 
-                std::unordered_map<std::string, std::shared_ptr<MsgPackObj>> pairs;
-                size_t consumed = 0;
+    const Handler *find(std::string_view name) const
+    {
+        uint64_t h = hash(name);
+        auto it = std::lower_bound(m_methods.begin(), m_methods.end(), h, [](const Method &a, uint64_t b)
+                                   { return a.hash < b; });
+        for (; it != m_methods.end() && it->hash == h; ++it)
+        {
+            if (it->name == name)
+                return &it->handler;
+        }
+        return nullptr;
+    }
 
-                MsgPack *o = new MsgPack(std::vector<unsigned char>(raw.begin() + current + used + 1 + consumed, raw.end()), elements * 2);
+    std::vector<Method> m_methods;
+    MsgPackBufferPool m_buffers;
+};
 
-                if (o->objects.size() % 2 > 0)
-                {
-                    throw "expected an even number of objects";
-                }
+// Client side of msgpack-rpc. Any number of requests can be in flight,
+// responses are matched to their callback by msgid in whatever order they
+// arrive. Not thread safe.
+class MsgPackRpcClient
+{
+public:
+    typedef std::function<void(const MsgPackRpcMessage &response)> Callback;
 
-                for (uint32_t i = 0; i < elements * 2; i += 2)
-                {
-                    pairs[o->objects[i]->as_string()] = o->objects[i + 1];
-                }
+    // Appends a request to out, write_params(MsgPackEncoder &) must write
+    // the params array. Returns the msgid.
+    template <typename F>
+    uint32_t call(std::vector<unsigned char> &out, std::string_view method, F &&write_params, Callback callback)
+    {
+        uint32_t msgid = m_next_msgid++;
+        MsgPackEncoder encoder(out);
+        encoder.pack_array(4);
+        encoder.pack_uint(MSGPACK_RPC_REQUEST);
+        encoder.pack_uint(msgid);
+        encoder.pack_str(method);
+        write_params(encoder);
+        m_pending.emplace(msgid, std::move(callback));
+        return msgid;
+    }
 
-                objects.push_back(std::make_shared<MsgPackObj>(pairs));
-                current += 1 + o->consumed + used;
+    template <typename F>
+    void notify(std::vector<unsigned char> &out, std::string_view method, F &&write_params)
+    {
+        MsgPackEncoder encoder(out);
+        encoder.pack_array(3);
+        encoder.pack_uint(MSGPACK_RPC_NOTIFICATION);
+        encoder.pack_str(method);
+        write_params(encoder);
+    }
 
-                delete o;
-            }
+    // Runs the callback of the request raw answers, false if raw is not a
+    // response to a pending request
+    bool complete(const unsigned char *raw, size_t size, std::shared_ptr<const void> owner = nullptr)
+    {
+        MsgPackRpcMessage message;
+        if (!message.parse(raw, size, std::move(owner)) || message.type != MSGPACK_RPC_RESPONSE)
+            return false;
+        auto it = m_pending.find(message.msgid);
+        if (it == m_pending.end())
+            return false;
+        Callback callback = std::move(it->second);
+        m_pending.erase(it);
+        callback(message);
+        return true;
+    }
 
-            else if ((raw[current] & 0xF0) == 0x90 || raw[current] == 0xdc || raw[current] == 0xdd) // FIXARR, ARR16, ARR32
-            {
+    size_t pending() const { return m_pending.size(); }
 
-                // TODO, when reading out sizes we need to check the raw array is long enough
-                size_t used = 0;
-                uint32_t elements;
-                if (raw[current] == 0xdc)
-                {
-                    // Check that first byte of the rest of the message is good
-                    check_size(current, 2+1, raw.size());
-                    elements = raw[current + 1] << 8 | raw[current + 2];
-                    used = 2;
-                }
-                else if (raw[current] == 0xdd)
-                {
-                    // Check that first byte of the rest of the message is good
-                    check_size(current, 4+1, raw.size());
-                    elements = raw[current + 1] << 24 | raw[current + 2] << 16 | raw[current + 3] << 8 | raw[current + 4];
-                    used = 4;
-                }
-                else
-                {
-                    // Check that first byte of the rest of the message is good
-                    check_size(current, 0+1, raw.size());
-                    elements = raw[current] & 0x0F;
-                    used = 0;
-                }
-                std::vector<std::shared_ptr<MsgPackObj>> array;
+private:
+    uint32_t m_next_msgid = 0;
+    std::unordered_map<uint32_t, Callback> m_pending;
+};
 
-                MsgPack *array_elements = new MsgPack(std::vector<unsigned char>(raw.begin() + current + used + 1 + consumed, raw.end()), elements);
+#if defined(__unix__) || defined(__APPLE__)
 
-                objects.push_back(std::make_shared<MsgPackObj>(array_elements->objects));
-                current += 1 + array_elements->consumed + used;
-            }
-            else if (raw[current] >= 0xe0 || raw[current] <= 0xff) // NEGATIVE FIXINT
-            {
-                objects.push_back(std::make_shared<MsgPackObj>((int8_t)raw[current], false, true));
-                current += 1;
-            }
-            else
+// Read only mapping of a file of concatenated top level objects. Decoded
+// BIN/EXT slices point in to the mapping and keep it alive, so only pages
+// that are actually touched count towards RSS.
+class MsgPackFile
+{
+public:
+    // populate pre-faults the whole file, only worth it if it will all be read
+    MsgPackFile(const std::string &path, bool populate = false)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            MSGPACK_THROW("could not open file");
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            ::close(fd);
+            MSGPACK_THROW("could not stat file");
+        }
+
+        auto mapping = std::make_shared<Mapping>();
+        mapping->size = (size_t)st.st_size;
+        if (mapping->size > 0)
+        {
+            int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+            if (populate)
+                flags |= MAP_POPULATE;
+#else
+            (void)populate;
+#endif
+            void *addr = mmap(nullptr, mapping->size, PROT_READ, flags, fd, 0);
+            if (addr == MAP_FAILED)
             {
-                std::cout << "Unknown: " << std::hex << (int)raw[current] << std::endl;
-                current += 1;
+                ::close(fd);
+                MSGPACK_THROW("could not map file");
             }
+            mapping->addr = addr;
+            madvise(addr, mapping->size, MADV_SEQUENTIAL);
+        }
+        ::close(fd);
 
-            if (limit > 0 && (size_t)limit == objects.size())
-                break;
+        m_mapping = mapping;
+    }
+
+    const unsigned char *data() const { return (const unsigned char *)m_mapping->addr; }
+    size_t size() const { return m_mapping->size; }
+    std::shared_ptr<const void> owner() const { return m_mapping; }
+
+    // Offset of the next record returned by next()
+    size_t offset() const { return m_offset; }
+    void seek(size_t offset) { m_offset = offset; }
+    bool at_end() const { return m_offset >= size(); }
+
+    // Raw bytes of the next record, false at the end of the file
+    bool next(MsgPackSlice &record)
+    {
+        MsgPackDecodeError error;
+        if (next(record, error))
+            return true;
+        if (error)
+            MSGPACK_THROW("malformed record");
+        return false;
+    }
+
+    // As above, but a malformed record returns false with error set
+    bool next(MsgPackSlice &record, MsgPackDecodeError &error)
+    {
+        if (at_end())
+            return false;
+
+        size_t end = m_offset;
+        if (!msgpack_skip(data(), size(), end))
+        {
+            error.code = end < size() && data()[end] == 0xc1 ? MSGPACK_ERROR_RESERVED : MSGPACK_ERROR_TRUNCATED;
+            error.offset = m_offset;
+            return false;
         }
 
-        consumed = current;
+        record = MsgPackSlice(m_mapping, data() + m_offset, end - m_offset);
+        m_offset = end;
+        return true;
+    }
+
+    // Decodes the next record, nullptr at the end of the file
+    std::shared_ptr<MsgPackObj> next()
+    {
+        MsgPackSlice record;
+        if (!next(record))
+            return nullptr;
 
+        MsgPack reader(record.owner, record.data(), record.size(), 1);
+        return reader.objects[0];
     }
 
-    ~MsgPack()
+    // Decodes record n of the file using an index built over it, throws if
+    // the index does not place the record inside the file
+    std::shared_ptr<MsgPackObj> record(const MsgPackIndex &index, size_t n) const
     {
+        if (!index.contains(n, size()))
+        {
+            MSGPACK_THROW("record out of range");
+        }
+        MsgPackSlice raw = index.record(n, data(), m_mapping);
+        MsgPack reader(raw.owner, raw.data(), raw.size(), 1);
+        return reader.objects[0];
     }
 
-    template <typename T>
-    T get(std::string path);
+    // Drops already consumed pages from the page cache mapping of this process
+    void release_consumed()
+    {
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t length = m_offset / page * page;
+        if (length > 0)
+            madvise(m_mapping->addr, length, MADV_DONTNEED);
+    }
 
-    std::unordered_map<std::string, std::shared_ptr<MsgPackObj>> as_str_map()
+private:
+    typedef struct Mapping
     {
+        void *addr = nullptr;
+        size_t size = 0;
 
-        if (objects.size() == 0)
+        ~Mapping()
         {
-            // Exception
+            if (addr)
+                munmap(addr, size);
         }
+    } Mapping;
 
-        if (!objects[0]->is_str_map())
+    std::shared_ptr<Mapping> m_mapping;
+    size_t m_offset = 0;
+};
+
+#endif
+
+#if defined(__cpp_impl_coroutine) && __cplusplus >= 202002L
+
+// Lazily started coroutine returning T. Awaiting it runs it and resumes the
+// awaiting coroutine when it finishes, top level tasks are run with start().
+template <typename T>
+class MsgPackTask
+{
+public:
+    class promise_type;
+    typedef std::coroutine_handle<promise_type> handle_type;
+
+    class PromiseBase
+    {
+    public:
+        std::coroutine_handle<> continuation;
+        std::exception_ptr error;
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        struct FinalAwaiter
         {
-            // Exception
+            bool await_ready() noexcept { return false; }
+
+            template <typename P>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) noexcept
+            {
+                auto continuation = handle.promise().continuation;
+                return continuation ? continuation : std::noop_coroutine();
+            }
+
+            void await_resume() noexcept {}
+        };
+
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+
+    class ValuePromise : public PromiseBase
+    {
+    public:
+        std::optional<T> value;
+        void return_value(T v) { value = std::move(v); }
+        T result() { return std::move(*value); }
+    };
+
+    class VoidPromise : public PromiseBase
+    {
+    public:
+        void return_void() {}
+        void result() {}
+    };
+
+    class promise_type : public std::conditional<std::is_void<T>::value, VoidPromise, ValuePromise>::type
+    {
+    public:
+        MsgPackTask get_return_object() { return MsgPackTask(handle_type::from_promise(*this)); }
+    };
+
+    MsgPackTask(MsgPackTask &&other) noexcept : m_handle(other.m_handle) { other.m_handle = nullptr; }
+
+    MsgPackTask &operator=(MsgPackTask &&other) noexcept
+    {
+        if (this != &other)
+        {
+            if (m_handle)
+                m_handle.destroy();
+            m_handle = other.m_handle;
+            other.m_handle = nullptr;
         }
+        return *this;
+    }
 
-        return objects[0]->as_str_map();
+    ~MsgPackTask()
+    {
+        if (m_handle)
+            m_handle.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        m_handle.promise().continuation = awaiting;
+        return m_handle;
+    }
+
+    T await_resume() { return result(); }
+
+    // Runs a top level task until its first suspension
+    void start() { m_handle.resume(); }
+    bool done() const { return m_handle.done(); }
+
+    // Result of a finished task, rethrows anything it threw
+    T result()
+    {
+        if (m_handle.promise().error)
+            std::rethrow_exception(m_handle.promise().error);
+        return m_handle.promise().result();
     }
 
 private:
-    bool check_size(size_t current, size_t required, size_t size)
+    explicit MsgPackTask(handle_type handle) : m_handle(handle) {}
+
+    handle_type m_handle;
+};
+
+#if defined(__unix__) || defined(__APPLE__)
+
+// Minimal poll() based event loop, resumes coroutines waiting for their
+// file descriptor to become readable
+class MsgPackReactor
+{
+public:
+    struct ReadableAwaiter
     {
+        MsgPackReactor &reactor;
+        int fd;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) { reactor.m_waiting.push_back({fd, handle}); }
+        void await_resume() const noexcept {}
+    };
+
+    ReadableAwaiter readable(int fd) { return ReadableAwaiter{*this, fd}; }
+
+    size_t waiting() const { return m_waiting.size(); }
+
+    // Waits up to timeout_ms (-1 forever) and resumes everything that is
+    // ready, returns false if nothing is waiting
+    bool run_once(int timeout_ms = -1)
+    {
+        if (m_waiting.empty())
+            return false;
+
+        m_pollfds.clear();
+        for (const auto &w : m_waiting)
+            m_pollfds.push_back({w.fd, POLLIN, 0});
+
+        if (poll(m_pollfds.data(), m_pollfds.size(), timeout_ms) <= 0)
+            return true;
+
+        // Take the ready ones out before resuming, they may wait again
+        m_ready.clear();
+        size_t kept = 0;
+        for (size_t i = 0; i < m_waiting.size(); i++)
+        {
+            if (m_pollfds[i].revents)
+                m_ready.push_back(m_waiting[i].handle);
+            else
+                m_waiting[kept++] = m_waiting[i];
+        }
+        m_waiting.resize(kept);
+
+        for (auto handle : m_ready)
+            handle.resume();
         return true;
     }
+
+    void run()
+    {
+        while (run_once())
+        {
+        }
+    }
+
+private:
+    typedef struct
+    {
+        int fd;
+        std::coroutine_handle<> handle;
+    } Waiting;
+
+    std::vector<Waiting> m_waiting;
+    std::vector<pollfd> m_pollfds;
+    std::vector<std::coroutine_handle<>> m_ready;
 };
 
-template <>
-std::string MsgPack::get<std::string>(std::string path)
+// Byte source over a non-blocking file descriptor (pipe, socket...)
+class MsgPackFdSource
 {
-    for (const auto &n : objects)
+public:
+    MsgPackFdSource(int fd, MsgPackReactor &reactor) : m_fd(fd), m_reactor(reactor) {}
+
+    // Bytes read, 0 at end of stream. Suspends while nothing is available.
+    MsgPackTask<size_t> read(unsigned char *buffer, size_t size)
     {
-        if (n->is_str_map())
+        for (;;)
         {
-            for (const auto &m : n->as_str_map())
-            {
-                if (m.first == path)
-                {
-                    if (m.second->is_str())
-                        return m.second->as_string();
-                    else
-                    {
-                        // Exception...
-                        return "";
-                    }
-                }
-            }
+            ssize_t n = ::read(m_fd, buffer, size);
+            if (n >= 0)
+                co_return (size_t)n;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                MSGPACK_THROW("read failed");
+            co_await m_reactor.readable(m_fd);
         }
     }
 
-    return "";
-}
+private:
+    int m_fd;
+    MsgPackReactor &m_reactor;
+};
+
+#endif
 
-template <>
-uint32_t MsgPack::get<uint32_t>(std::string path)
+// Reads whole objects from an asynchronous byte source. Source needs a
+// read(unsigned char *, size_t) member whose result can be co_awaited for
+// the number of bytes read, 0 meaning end of stream. Boundaries are found
+// with MsgPackStreamScanner so nothing is decoded until an object is whole
+// and partial objects resume scanning where they stopped.
+template <typename Source>
+class MsgPackAsyncReader
 {
+public:
+    // Objects larger than max_frame are refused, as with MsgPackFramer, so a
+    // peer cannot make a connection buffer without bound
+    MsgPackAsyncReader(Source &source, size_t read_size = 65536, size_t max_frame = 64 * 1024 * 1024)
+        : m_source(source), m_read_size(read_size), m_max_frame(max_frame)
+    {
+    }
+
+    // Raw bytes of the next object, false at a clean end of stream. Throws
+    // on malformed, oversized or truncated objects.
+    MsgPackTask<bool> next_frame(std::vector<unsigned char> &frame)
+    {
+        MsgPackDecodeError error;
+        bool found = co_await next_frame(frame, error);
+        if (error.code == MSGPACK_ERROR_TRUNCATED)
+            MSGPACK_THROW("truncated object");
+        if (error.code == MSGPACK_ERROR_LIMIT)
+            MSGPACK_THROW("frame too large");
+        if (error)
+            MSGPACK_THROW("malformed object");
+        co_return found;
+    }
 
-    for (const auto &n : objects)
+    // As above, but bad input returns false with error set and the offset
+    // of the object in the stream
+    MsgPackTask<bool> next_frame(std::vector<unsigned char> &frame, MsgPackDecodeError &error)
     {
-        if (n->is_str_map())
+        for (;;)
         {
-            for (const auto &m : n->as_str_map())
+            MsgPackScanStatus status = m_scanner.scan(m_buffer.data() + m_start, m_end - m_start);
+            if (status == MSGPACK_SCAN_COMPLETE)
+            {
+                frame.assign(m_buffer.data() + m_start, m_buffer.data() + m_start + m_scanner.size());
+                m_start += m_scanner.size();
+                m_scanner.reset();
+                co_return true;
+            }
+            if (status != MSGPACK_SCAN_NEED_MORE || m_end - m_start > m_max_frame)
+            {
+                error.code = status == MSGPACK_SCAN_NEED_MORE ? MSGPACK_ERROR_LIMIT : msgpack_scan_error(status);
+                error.offset = m_offset + m_start;
+                co_return false;
+            }
+
+            // Scanner offsets are relative to the frame start, so compacting is safe
+            if (m_start > 0)
+            {
+                memmove(m_buffer.data(), m_buffer.data() + m_start, m_end - m_start);
+                m_end -= m_start;
+                m_offset += m_start;
+                m_start = 0;
+            }
+            if (m_buffer.size() - m_end < m_read_size)
+                m_buffer.resize(m_end + m_read_size);
+
+            size_t n = co_await m_source.read(m_buffer.data() + m_end, m_buffer.size() - m_end);
+            if (n == 0)
             {
-                if (m.first == path)
+                if (m_end > m_start)
                 {
-                    if (m.second->is_int32())
-                        return m.second->as_int32();
-                    else
-                    {
-                        // Exception...
-                        return 0;
-                    }
+                    error.code = MSGPACK_ERROR_TRUNCATED;
+                    error.offset = m_offset + m_start;
                 }
+                co_return false;
             }
+            m_end += n;
+        }
+    }
+
+    // Next decoded object, nullptr at a clean end of stream
+    MsgPackTask<std::shared_ptr<MsgPackObj>> next_object()
+    {
+        std::vector<unsigned char> frame;
+        if (!co_await next_frame(frame))
+            co_return nullptr;
+        MsgPack reader(std::move(frame), 1);
+        co_return reader.objects[0];
+    }
+
+    // As above, but bad input returns nullptr with error set
+    MsgPackTask<std::shared_ptr<MsgPackObj>> next_object(MsgPackDecodeError &error)
+    {
+        std::vector<unsigned char> frame;
+        size_t offset = m_offset + m_start;
+        if (!co_await next_frame(frame, error))
+            co_return nullptr;
+        MsgPackOptions options;
+        options.limit = 1;
+        auto result = MsgPack::try_decode(std::move(frame), options);
+        if (!result)
+        {
+            error = result.error();
+            error.offset += offset;
+            co_return nullptr;
         }
+        co_return result->objects[0];
     }
 
-    return 0;
+private:
+    Source &m_source;
+    size_t m_read_size;
+    size_t m_max_frame;
+    std::vector<unsigned char> m_buffer;
+    size_t m_start = 0;
+    size_t m_end = 0;
+    size_t m_offset = 0; // Stream offset of the start of the buffer
+    MsgPackStreamScanner m_scanner;
+};
+
+template <typename Source>
+MsgPackTask<std::shared_ptr<MsgPackObj>> async_next_object(MsgPackAsyncReader<Source> &reader)
+{
+    return reader.next_object();
 }
 
+#endif
+
 #endif
\ No newline at end of file
@@ -0,0 +1,66 @@
+#ifndef _ALLOC_COUNT_HPP_
+#define _ALLOC_COUNT_HPP_
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// Counts heap allocations so the tests and the benchmark can check
+// allocation free paths. Replaces the global operator new and delete, so
+// include it from one translation unit per program.
+static std::atomic<size_t> allocations(0);
+
+void *operator new(size_t size)
+{
+    allocations++;
+    void *p = malloc(size ? size : 1);
+    if (!p)
+    {
+#if defined(__cpp_exceptions)
+        throw std::bad_alloc();
+#else
+        abort();
+#endif
+    }
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    allocations++;
+    return malloc(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    return operator new(size, std::nothrow);
+}
+
+// The deletes stay out of line, inlined in to a caller GCC would take the
+// free() for a mismatch with the operator new it can see
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p, size_t) noexcept
+{
+    free(p);
+}
+
+#endif
@@ -2,7 +2,10 @@
 #include <sstream>
 #include <vector>
 
+#include <sys/socket.h>
+
 #include "../msgpack.hpp"
+#include "alloc_count.hpp"
 #include "flatjson/flatjson.hpp"
 
 #define CATCH_CONFIG_MAIN
@@ -170,6 +173,1941 @@ TEST_CASE("Arrays")
 
 }
 
+TEST_CASE("Non-string Map Keys")
+{
+    /*
+    {
+        1: "a",
+        2: "b",      (as UINT8)
+        -1: "neg",
+        "s": 3,
+        true: 4
+    }
+    */
+    std::vector<uint8_t> msg = {
+        0x85,
+        0x01, 0xa1, 0x61,
+        0xcc, 0x02, 0xa1, 0x62,
+        0xff, 0xa3, 0x6e, 0x65, 0x67,
+        0xa1, 0x73, 0x03,
+        0xc3, 0x04,
+    };
+    auto *reader = new MsgPack(msg);
+
+    REQUIRE(reader->objects[0]->type == MsgpackType::MAP);
+    REQUIRE(reader->objects[0]->m_map.size() == 5);
+    REQUIRE(reader->objects[0]->find(1)->as_string() == "a");
+    REQUIRE(reader->objects[0]->find(2)->as_string() == "b");
+    REQUIRE(reader->objects[0]->find(-1)->as_string() == "neg");
+    REQUIRE(reader->objects[0]->find("s")->as_int32() == 3);
+    REQUIRE(reader->objects[0]->find(true)->as_int32() == 4);
+    REQUIRE(reader->objects[0]->find(3) == nullptr);
+    REQUIRE(reader->objects[0]->find("a") == nullptr);
+
+    auto map = reader->objects[0]->as_map();
+    REQUIRE(map.size() == 5);
+    REQUIRE(map[MsgPackKey(2)]->as_string() == "b");
+    REQUIRE(map[MsgPackKey("s")]->as_int32() == 3);
+
+    // Only the string key is visible through the string map
+    REQUIRE(reader->objects[0]->as_str_map().size() == 1);
+
+    delete reader;
+
+    // Sparse keys fall back to open addressing
+    std::vector<uint8_t> sparse = {
+        0x83,
+        0xcd, 0x03, 0xe8, 0x01,
+        0xcd, 0x13, 0x88, 0x02,
+        0xd2, 0x80, 0x00, 0x00, 0x00, 0x03,
+    };
+    reader = new MsgPack(sparse);
+    REQUIRE(!reader->objects[0]->m_map_int.is_dense());
+    REQUIRE(reader->objects[0]->find(1000)->as_int32() == 1);
+    REQUIRE(reader->objects[0]->find(5000)->as_int32() == 2);
+    REQUIRE(reader->objects[0]->find(INT32_MIN)->as_int32() == 3);
+    REQUIRE(reader->objects[0]->find(1001) == nullptr);
+
+    delete reader;
+}
+
+TEST_CASE("Paths")
+{
+    /*
+    {
+        "hello": "world",
+        "arr": [0, 1, 2, 3, 4, 5],
+        "records": [
+            { "name": "Bob", "location": "home" },
+            { "name": "Fred", "location": "work" }
+        ]
+    }
+    */
+    std::vector<uint8_t> msg = {
+        0x83, 0xa5, 0x68, 0x65, 0x6c, 0x6c, 0x6f, 0xa5, 0x77, 0x6f, 0x72, 0x6c, 0x64, 0xa3, 0x61, 0x72, 0x72, 0x96, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0xa7, 0x72, 0x65, 0x63, 0x6f, 0x72, 0x64, 0x73, 0x92, 0x82, 0xa4, 0x6e, 0x61, 0x6d, 0x65, 0xa3, 0x42, 0x6f, 0x62, 0xa8, 0x6c, 0x6f, 0x63, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0xa4, 0x68, 0x6f, 0x6d, 0x65, 0x82, 0xa4, 0x6e, 0x61, 0x6d, 0x65, 0xa4, 0x46, 0x72, 0x65, 0x64, 0xa8, 0x6c, 0x6f, 0x63, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0xa4, 0x77, 0x6f, 0x72, 0x6b};
+
+    auto *reader = new MsgPack(msg);
+
+    MsgPackPath name("/records/1/name");
+    MsgPackPath location("$.records[0].location");
+    MsgPackPath element("$.arr[4]");
+    MsgPackPath missing("/records/2/name");
+
+    std::string value;
+    REQUIRE(name.get(reader->objects[0], value));
+    REQUIRE(value == "Fred");
+    REQUIRE(location.get(reader->objects[0], value));
+    REQUIRE(value == "home");
+    REQUIRE(!missing.get(reader->objects[0], value));
+
+    int32_t number = 0;
+    REQUIRE(element.get(reader->objects[0], number));
+    REQUIRE(number == 4);
+    REQUIRE(!name.get(reader->objects[0], number));
+
+    // Same queries without building a tree
+    std::string_view view;
+    REQUIRE(name.get(msg, view));
+    REQUIRE(view == "Fred");
+    REQUIRE(location.get(msg, value));
+    REQUIRE(value == "home");
+    REQUIRE(element.get(msg, number));
+    REQUIRE(number == 4);
+    REQUIRE(!missing.get(msg, value));
+
+    size_t offset = 0;
+    REQUIRE(MsgPackPath("/records").find(msg.data(), msg.size(), offset));
+    REQUIRE(msg[offset] == 0x92);
+
+    // Duplicate keys: every evaluator takes the last one, and a string key
+    // before an integer key. {"a": 1, "1": 2, "a": {"b": 3, "b": 4}, 1: 5}
+    std::vector<uint8_t> dup = {0x84, 0xa1, 'a', 0x01, 0xa1, '1', 0x02, 0xa1, 'a', 0x82, 0xa1, 'b', 0x03, 0xa1, 'b', 0x04, 0x01, 0x05};
+    MsgPack dup_tree(dup);
+    MsgPackDocument dup_document(dup);
+    for (const char *path : {"/a/b", "$.a.b", "/1", "$[1]"})
+    {
+        int64_t from_tree = 0, from_document = 0, from_raw = 0;
+        REQUIRE(MsgPackPath(path).get(dup_tree.objects[0], from_tree));
+        REQUIRE(MsgPackPath(path).get(dup_document.root(), from_document));
+        REQUIRE(MsgPackPath(path).get(dup, from_raw));
+        REQUIRE(from_tree == from_document);
+        REQUIRE(from_tree == from_raw);
+    }
+    int64_t last = 0;
+    REQUIRE(MsgPackPath("/a/b").get(dup, last));
+    REQUIRE(last == 4);
+    REQUIRE(MsgPackPath("/1").get(dup, last));
+    REQUIRE(last == 2);
+    REQUIRE(MsgPackPath("$[1]").get(dup, last));
+    REQUIRE(last == 5);
+
+    REQUIRE(reader->get<std::string>("hello") == "world");
+    REQUIRE(reader->get<std::string>("/records/0/name") == "Bob");
+    REQUIRE(reader->get<uint32_t>("$.arr[5]") == 5);
+
+    delete reader;
+
+    // Integers that don't fit the target are refused, not truncated
+    std::vector<uint8_t> ints = {0x93, 0xcd, 0x01, 0x2c, 0xff, 0xcf, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff}; // [300, -1, UINT64_MAX]
+    MsgPack decoded(ints);
+    auto array = decoded.objects[0]->as_vector();
+    MsgPackRawValue raw;
+    uint8_t small = 0;
+    uint32_t unsigned32 = 0;
+    int64_t signed64 = 0;
+    uint64_t unsigned64 = 0;
+    int16_t signed16 = 0;
+
+    REQUIRE(msgpack_read_value(ints.data(), ints.size(), 1, raw));
+    REQUIRE(!raw.get(small));
+    REQUIRE(!array[0]->get(small));
+    REQUIRE(raw.get(signed16));
+    REQUIRE(signed16 == 300);
+
+    REQUIRE(msgpack_read_value(ints.data(), ints.size(), 4, raw));
+    REQUIRE(!raw.get(unsigned32));
+    REQUIRE(!array[1]->get(unsigned32));
+    REQUIRE(raw.get(signed16));
+    REQUIRE(signed16 == -1);
+    REQUIRE(array[1]->get(signed64));
+    REQUIRE(signed64 == -1);
+
+    REQUIRE(msgpack_read_value(ints.data(), ints.size(), 5, raw));
+    REQUIRE(!raw.get(signed64));
+    REQUIRE(!array[2]->get(signed64));
+    REQUIRE(raw.get(unsigned64));
+    REQUIRE(unsigned64 == UINT64_MAX);
+    REQUIRE(array[2]->get(unsigned64));
+    REQUIRE(unsigned64 == UINT64_MAX);
+}
+
+TEST_CASE("Extractor")
+{
+    // {"hello": "world", "arr": [0, 1, 2, 3, 4, 5], "records": [{"name": "Bob", ...}, {"name": "Fred", ...}]}
+    std::vector<uint8_t> msg = {
+        0x83, 0xa5, 0x68, 0x65, 0x6c, 0x6c, 0x6f, 0xa5, 0x77, 0x6f, 0x72, 0x6c, 0x64, 0xa3, 0x61, 0x72, 0x72, 0x96, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0xa7, 0x72, 0x65, 0x63, 0x6f, 0x72, 0x64, 0x73, 0x92, 0x82, 0xa4, 0x6e, 0x61, 0x6d, 0x65, 0xa3, 0x42, 0x6f, 0x62, 0xa8, 0x6c, 0x6f, 0x63, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0xa4, 0x68, 0x6f, 0x6d, 0x65, 0x82, 0xa4, 0x6e, 0x61, 0x6d, 0x65, 0xa4, 0x46, 0x72, 0x65, 0x64, 0xa8, 0x6c, 0x6f, 0x63, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0xa4, 0x77, 0x6f, 0x72, 0x6b};
+
+    struct Record
+    {
+        std::string hello;
+        int32_t third = 0;
+        std::string first_name;
+        std::string second_location;
+        std::string missing = "unset";
+    };
+
+    MsgPackExtractor extractor;
+    extractor.add("/hello", &Record::hello);
+    extractor.add("/arr/3", &Record::third);
+    extractor.add("/records/0/name", &Record::first_name);
+    extractor.add("$.records[1].location", &Record::second_location);
+    extractor.add("/records/2/name", &Record::missing);
+
+    Record record;
+    REQUIRE(extractor.extract(msg.data(), msg.size(), record) == 4);
+    REQUIRE(record.hello == "world");
+    REQUIRE(record.third == 3);
+    REQUIRE(record.first_name == "Bob");
+    REQUIRE(record.second_location == "work");
+    REQUIRE(record.missing == "unset");
+
+    // Untyped fields
+    MsgPackExtractor fields;
+    size_t records = fields.add("/records");
+    size_t last = fields.add("/arr/5");
+    MsgPackRawValue values[2];
+    REQUIRE(fields.extract(msg.data(), msg.size(), values) == 2);
+    REQUIRE(values[records].is_array());
+    REQUIRE(values[records].size == 2);
+    REQUIRE(values[last].m_int64 == 5);
+
+    // Duplicate keys: the last one counts, as in the tree, and a path
+    // added twice is reported to both fields
+    std::vector<uint8_t> dup = {0x83, 0xa1, 'a', 0x01, 0xa1, 'a', 0x02, 0xa1, 'b', 0x03}; // {"a":1,"a":2,"b":3}
+    MsgPackExtractor dups;
+    size_t a = dups.add("a");
+    size_t b = dups.add("b");
+    size_t again = dups.add("/a");
+    MsgPackRawValue found[3];
+    REQUIRE(dups.extract(dup.data(), dup.size(), found) == 3);
+    REQUIRE(found[a].m_int64 == 2);
+    REQUIRE(found[b].m_int64 == 3);
+    REQUIRE(found[again].m_int64 == 2);
+    MsgPack dup_tree(dup);
+    int64_t from_tree = 0;
+    REQUIRE(MsgPackPath("a").get(dup_tree.objects[0], from_tree));
+    REQUIRE(from_tree == found[a].m_int64);
+
+    // Nested duplicates and string keys before integer keys, against the
+    // tree. {"a": {"b": 1}, "1": 2, "a": {"b": 3, "b": 4}, 1: 5, "c": [6, 7]}
+    std::vector<uint8_t> nested = {0x85, 0xa1, 'a', 0x81, 0xa1, 'b', 0x01, 0xa1, '1', 0x02, 0xa1, 'a', 0x82, 0xa1, 'b', 0x03, 0xa1, 'b', 0x04, 0x01, 0x05, 0xa1, 'c', 0x92, 0x06, 0x07};
+    MsgPack nested_tree(nested);
+    MsgPackExtractor paths;
+    const char *queries[] = {"/a/b", "/1", "$[1]", "/c/1", "$.c[0]", "/a"};
+    for (const char *query : queries)
+        paths.add(query);
+    MsgPackRawValue results[6];
+    REQUIRE(paths.extract(nested.data(), nested.size(), results) == 6);
+    for (size_t i = 0; i < 5; i++)
+    {
+        int64_t expected = 0, actual = 0;
+        REQUIRE(MsgPackPath(queries[i]).get(nested_tree.objects[0], expected));
+        REQUIRE(results[i].get(actual));
+        REQUIRE(actual == expected);
+    }
+    REQUIRE(results[5].size == 2);
+
+    // More paths than fit the inline match table
+    MsgPackExtractor wide;
+    for (int i = 0; i < 100; i++)
+        wide.add("/absent" + std::to_string(i));
+    size_t fourth = wide.add("/arr/4");
+    MsgPackRawValue many[101];
+    REQUIRE(wide.extract(msg.data(), msg.size(), many) == 1);
+    REQUIRE(many[fourth].m_int64 == 4);
+}
+
+static bool decode_point(const MsgPackSlice &payload, std::pair<int16_t, int16_t> &out)
+{
+    if (payload.size() != 4)
+        return false;
+    out.first = (int16_t)msgpack_load16(payload.data());
+    out.second = (int16_t)msgpack_load16(payload.data() + 2);
+    return true;
+}
+
+TEST_CASE("Extensions")
+{
+    std::vector<uint8_t> msg = {
+        0xd4, 0x01, 0x10,                         // FIXEXT1
+        0xd6, 0x05, 0x00, 0x01, 0xff, 0xfe,       // FIXEXT4
+        0xc7, 0x03, 0x05, 0x61, 0x62, 0x63,       // EXT8
+        0xc8, 0x00, 0x00, 0x07,                   // EXT16 (empty)
+        0x92, 0xd5, 0x02, 0x01, 0x02, 0x07,       // [FIXEXT2, 7]
+    };
+    auto *reader = new MsgPack(msg);
+
+    REQUIRE(reader->objects.size() == 5);
+    REQUIRE(reader->objects[0]->is_ext());
+    REQUIRE(reader->objects[0]->m_ext_type == 1);
+    REQUIRE(reader->objects[0]->as_ext().size() == 1);
+    REQUIRE(reader->objects[0]->as_ext()[0] == 0x10);
+    REQUIRE(reader->objects[2]->m_ext_type == 5);
+    REQUIRE(reader->objects[2]->as_ext().size() == 3);
+    REQUIRE(reader->objects[3]->as_ext().empty());
+    REQUIRE(reader->objects[4]->as_vector()[0]->m_ext_type == 2);
+    REQUIRE(reader->objects[4]->as_vector()[1]->as_int32() == 7);
+
+    MsgPackExtRegistry registry;
+    registry.add<std::pair<int16_t, int16_t>>(5, decode_point);
+
+    std::pair<int16_t, int16_t> point;
+    REQUIRE(registry.decode(*reader->objects[1], point));
+    REQUIRE(point.first == 1);
+    REQUIRE(point.second == -2);
+    REQUIRE(!registry.decode(*reader->objects[2], point)); // Wrong size
+    REQUIRE(!registry.decode(*reader->objects[0], point)); // No handler
+
+    MsgPackRawValue raw;
+    REQUIRE(msgpack_read_value(msg.data(), msg.size(), 3, raw));
+    REQUIRE(registry.decode(raw, point));
+
+    // Payloads keep the decoded buffer alive
+    auto ext = reader->objects[2]->as_ext();
+    delete reader;
+    REQUIRE(std::string(ext.begin(), ext.end()) == "abc");
+}
+
+TEST_CASE("Timestamps")
+{
+    std::vector<uint8_t> msg;
+    MsgPackEncoder encoder(msg);
+    encoder.pack_timestamp(1, 0);                       // 32 bit
+    encoder.pack_timestamp(1, 500);                     // 64 bit
+    encoder.pack_timestamp(-2, 999999999);              // 96 bit
+    encoder.pack_timestamp(std::chrono::system_clock::time_point(std::chrono::seconds(10)));
+
+    REQUIRE(msg.size() == 6 + 10 + 15 + 6);
+    REQUIRE(msg[0] == 0xd6);
+    REQUIRE(msg[6] == 0xd7);
+    REQUIRE(msg[16] == 0xc7);
+
+    auto *reader = new MsgPack(msg);
+    REQUIRE(reader->objects.size() == 4);
+    REQUIRE(reader->objects[0]->is_timestamp());
+    REQUIRE(reader->objects[0]->as_timestamp_ns() == 1000000000);
+    REQUIRE(reader->objects[1]->as_timestamp_ns() == 1000000500);
+    REQUIRE(reader->objects[2]->as_timespec().tv_sec == -2);
+    REQUIRE(reader->objects[2]->as_timespec().tv_nsec == 999999999);
+    REQUIRE(reader->objects[2]->as_timestamp_ns() == -1000000001);
+    REQUIRE(reader->objects[3]->as_sys_time().time_since_epoch() == std::chrono::seconds(10));
+    delete reader;
+
+    // Bulk decode of an array of timestamps
+    std::vector<uint8_t> array;
+    MsgPackEncoder array_encoder(array);
+    array_encoder.pack_array(20);
+    for (int i = 0; i < 20; i++)
+        array_encoder.pack_timestamp(i, i * 7);
+
+    size_t current = 0;
+    std::vector<int64_t> ns;
+    REQUIRE(msgpack_read_timestamps(array.data(), array.size(), current, ns));
+    REQUIRE(current == array.size());
+    REQUIRE(ns.size() == 20);
+    REQUIRE(ns[19] == 19000000000ll + 133);
+
+    // Nanoseconds past 999999999 are refused in every form that has them
+    unsigned char payload[12];
+    int64_t seconds = 0;
+    uint32_t nanoseconds = 0;
+    MsgPackEncoder::store64(payload, (1000000000ull << 34) | 1);
+    REQUIRE(!msgpack_read_timestamp(payload, 8, seconds, nanoseconds));
+    MsgPackEncoder::store64(payload, (999999999ull << 34) | 1);
+    REQUIRE(msgpack_read_timestamp(payload, 8, seconds, nanoseconds));
+    MsgPackEncoder::store32(payload, 1000000000);
+    MsgPackEncoder::store64(payload + 4, 1);
+    REQUIRE(!msgpack_read_timestamp(payload, 12, seconds, nanoseconds));
+
+    std::vector<uint8_t> bad_nanoseconds = {0x91, 0xc7, 12, 0xff};
+    bad_nanoseconds.insert(bad_nanoseconds.end(), payload, payload + 12);
+    current = 0;
+    REQUIRE(!msgpack_read_timestamps(bad_nanoseconds.data(), bad_nanoseconds.size(), current, ns));
+    REQUIRE_THROWS(MsgPack(bad_nanoseconds));
+
+    // Nanoseconds since the epoch must fit an int64_t
+    int64_t out = 0;
+    REQUIRE(msgpack_timestamp_ns(INT64_MAX / 1000000000, 854775807, out));
+    REQUIRE(out == INT64_MAX);
+    REQUIRE(!msgpack_timestamp_ns(INT64_MAX / 1000000000, 854775808, out));
+    REQUIRE(msgpack_timestamp_ns(INT64_MIN / 1000000000 - 1, 145224192, out));
+    REQUIRE(out == INT64_MIN);
+    REQUIRE(!msgpack_timestamp_ns(INT64_MIN / 1000000000 - 1, 145224191, out));
+    REQUIRE(!msgpack_timestamp_ns(INT64_MIN / 1000000000 - 2, 999999999, out));
+
+    std::vector<uint8_t> far;
+    MsgPackEncoder far_encoder(far);
+    far_encoder.pack_array(1);
+    far_encoder.pack_timestamp(10000000000ll, 0); // 2286, int64_t nanoseconds end in 2262
+    MsgPack far_reader(far);
+    auto far_stamp = far_reader.objects[0]->as_vector()[0];
+    REQUIRE(far_stamp->as_timespec().tv_sec == 10000000000ll);
+    REQUIRE_THROWS(far_stamp->as_timestamp_ns());
+    MsgPackDocument far_document(far);
+    REQUIRE_THROWS(far_document.root()[0].as_timestamp_ns());
+    current = 0;
+    REQUIRE(!msgpack_read_timestamps(far.data(), far.size(), current, ns));
+}
+
+TEST_CASE("Encoder")
+{
+    std::vector<uint8_t> msg = {
+        0x83, 0xa1, 0x61, 0xd0, 0x80, 0xa1, 0x62, 0x92, 0xcd, 0x01, 0x00, 0xc3, 0x01, 0xcb, 0x3f, 0xf8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    };
+    auto *reader = new MsgPack(msg);
+
+    std::vector<uint8_t> out;
+    MsgPackEncoder(out).pack(*reader->objects[0]);
+    REQUIRE(out == msg);
+    delete reader;
+
+    out.clear();
+    MsgPackEncoder encoder(out);
+    encoder.pack_int(-33);
+    encoder.pack_int(127);
+    encoder.pack_uint(65536);
+    encoder.pack_str(std::string(40, 'x'));
+    REQUIRE(out[0] == 0xd0);
+    REQUIRE(out[2] == 0x7f);
+    REQUIRE(out[3] == 0xce);
+    REQUIRE(out[8] == 0xd9);
+}
+
+TEST_CASE("Binary")
+{
+    std::vector<uint8_t> msg;
+    MsgPackEncoder encoder(msg);
+    std::vector<uint8_t> small(10, 0x11), medium(300, 0x22), large(70000, 0x33);
+    encoder.pack_bin(small.data(), small.size());
+    encoder.pack_bin(medium.data(), medium.size());
+    encoder.pack_bin(large.data(), large.size());
+    encoder.pack_int(7);
+
+    REQUIRE(msg[12] == 0xc5);
+    REQUIRE(msg[315] == 0xc6);
+
+    auto *reader = new MsgPack(msg);
+    REQUIRE(reader->objects.size() == 4);
+    REQUIRE(reader->objects[0]->as_bin().to_vector() == small);
+    REQUIRE(reader->objects[1]->as_bin().to_vector() == medium);
+    REQUIRE(reader->objects[2]->as_bin().to_vector() == large);
+    REQUIRE(reader->objects[3]->as_int32() == 7);
+
+    // Slices keep the decoded buffer alive
+    auto bin = reader->objects[2]->as_bin();
+    delete reader;
+    REQUIRE(bin.size() == large.size());
+    REQUIRE(bin[69999] == 0x33);
+
+    // Shared and borrowed buffers are not copied
+    auto shared = std::make_shared<const std::vector<uint8_t>>(msg);
+    reader = new MsgPack(shared);
+    REQUIRE(reader->objects[1]->as_bin().data() == shared->data() + 15);
+    delete reader;
+
+    reader = new MsgPack(msg.data(), msg.size());
+    REQUIRE(reader->objects[2]->as_bin().data() == msg.data() + 320);
+    REQUIRE(reader->objects[2]->as_bin().is_borrowed());
+    delete reader;
+}
+
+TEST_CASE("Mapped Files")
+{
+    std::vector<uint8_t> records;
+    MsgPackEncoder encoder(records);
+    for (int i = 0; i < 100; i++)
+    {
+        encoder.pack_map(2);
+        encoder.pack_str("id");
+        encoder.pack_int(i);
+        encoder.pack_str("blob");
+        std::vector<uint8_t> blob(i, (uint8_t)i);
+        encoder.pack_bin(blob.data(), blob.size());
+    }
+
+    const char *path = "./mapped_file_test.msgpack";
+    std::ofstream(path, std::ios::binary).write((const char *)records.data(), records.size());
+
+    std::shared_ptr<MsgPackObj> last;
+    {
+        MsgPackFile file(path);
+        REQUIRE(file.size() == records.size());
+
+        int count = 0;
+        while (auto record = file.next())
+        {
+            REQUIRE(record->find("id")->as_int32() == count);
+            REQUIRE(record->find("blob")->as_bin().size() == (size_t)count);
+            last = record;
+            count++;
+        }
+        REQUIRE(count == 100);
+        REQUIRE(file.at_end());
+
+        file.seek(0);
+        MsgPackSlice raw;
+        REQUIRE(file.next(raw));
+        REQUIRE(raw.data() == file.data());
+        REQUIRE(file.offset() == raw.size());
+        file.release_consumed();
+    }
+    std::remove(path);
+
+    // Views keep the mapping alive after the file is closed
+    auto blob = last->find("blob")->as_bin();
+    REQUIRE(blob[98] == 99);
+}
+
+TEST_CASE("Record Index")
+{
+    std::vector<uint8_t> records;
+    MsgPackEncoder encoder(records);
+    for (int i = 0; i < 1000; i++)
+    {
+        encoder.pack_array(2);
+        encoder.pack_int(i);
+        encoder.pack_str(std::string(i % 50, 'x'));
+    }
+
+    // Index a partially written buffer, then the rest of it
+    MsgPackIndex index;
+    size_t partial = records.size() / 2 + 3;
+    size_t first = index.update(records.data(), partial);
+    REQUIRE(first < 1000);
+    REQUIRE(index.end <= partial);
+    REQUIRE(index.update(records.data(), records.size()) == 1000 - first);
+    REQUIRE(index.size() == 1000);
+    REQUIRE(index.end == records.size());
+
+    // A corrupt record is reported, not taken for one still being written
+    std::vector<uint8_t> corrupt(records.begin(), records.begin() + index.offsets[10]);
+    corrupt.insert(corrupt.end(), {0x92, 0x01, 0xc1});
+    MsgPackIndex stopped;
+    MsgPackDecodeError error;
+    REQUIRE(stopped.update(corrupt.data(), corrupt.size(), error) == 10);
+    REQUIRE(error.code == MSGPACK_ERROR_RESERVED);
+    REQUIRE(error.offset == index.offsets[10]);
+    REQUIRE(stopped.end == index.offsets[10]);
+    REQUIRE_THROWS(MsgPackIndex().update(corrupt.data(), corrupt.size()));
+    corrupt.pop_back();
+    error = MsgPackDecodeError();
+    REQUIRE(MsgPackIndex().update(corrupt.data(), corrupt.size(), error) == 10);
+    REQUIRE(!error);
+
+    auto raw = index.record(567, records.data());
+    auto *reader = new MsgPack(raw.data(), raw.size());
+    REQUIRE(reader->objects.size() == 1);
+    REQUIRE(reader->objects[0]->as_vector()[0]->as_int32() == 567);
+    delete reader;
+
+    const char *path = "./record_index_test.msgpack";
+    const char *index_path = "./record_index_test.msgpack.idx";
+    std::ofstream(path, std::ios::binary).write((const char *)records.data(), records.size());
+
+    REQUIRE(index.save(index_path));
+    MsgPackIndex loaded;
+    REQUIRE(loaded.load(index_path, records.size()));
+    REQUIRE(loaded.offsets == index.offsets);
+    REQUIRE(loaded.end == index.end);
+
+    {
+        MsgPackFile file(path);
+        REQUIRE(file.record(loaded, 999)->as_vector()[0]->as_int32() == 999);
+        REQUIRE(file.record(loaded, 0)->as_vector()[0]->as_int32() == 0);
+        REQUIRE_THROWS(file.record(loaded, 1000));
+
+        // An index for a longer file does not load, or read past this one
+        MsgPackIndex longer = index;
+        longer.offsets.push_back(index.end);
+        longer.end = index.end + 10;
+        REQUIRE(!loaded.load(index_path, records.size() - 1));
+        REQUIRE(longer.save(index_path));
+        REQUIRE(!loaded.load(index_path, records.size()));
+        REQUIRE(loaded.end == index.end);
+        REQUIRE_THROWS(file.record(longer, 1000));
+    }
+
+    // Sidecars whose offsets do not increase or run past end are refused
+    MsgPackIndex unordered = index;
+    std::swap(unordered.offsets[3], unordered.offsets[4]);
+    REQUIRE(unordered.save(index_path));
+    REQUIRE(!loaded.load(index_path));
+    MsgPackIndex beyond = index;
+    beyond.end = index.offsets.back();
+    REQUIRE(beyond.save(index_path));
+    REQUIRE(!loaded.load(index_path));
+
+    std::remove(path);
+    std::remove(index_path);
+}
+
+TEST_CASE("Parallel Decode")
+{
+    std::vector<uint8_t> records;
+    MsgPackEncoder encoder(records);
+    for (int i = 0; i < 5000; i++)
+    {
+        encoder.pack_map(3);
+        encoder.pack_str("id");
+        encoder.pack_int(i * 1000);
+        encoder.pack_str("name");
+        encoder.pack_str(std::string(i % 40, 'a' + i % 26));
+        encoder.pack_int(i % 7);
+        encoder.pack_array(2);
+        encoder.pack_double(i / 3.0);
+        encoder.pack_nil();
+    }
+
+    MsgPackParallel parallel;
+    parallel.threads = 4;
+    parallel.min_chunk = 16;
+
+    MsgPack serial(records);
+    MsgPack threaded(records, parallel);
+
+    REQUIRE(threaded.objects.size() == 5000);
+    REQUIRE(threaded.consumed == records.size());
+
+    std::vector<uint8_t> a, b;
+    for (size_t i = 0; i < serial.objects.size(); i++)
+    {
+        MsgPackEncoder(a).pack(*serial.objects[i]);
+        MsgPackEncoder(b).pack(*threaded.objects[i]);
+    }
+    REQUIRE(a == b);
+    REQUIRE(b == records);
+
+    // Borrowing the buffer gives the same objects without copying it
+    MsgPack borrowed(records.data(), records.size(), parallel);
+    std::vector<uint8_t> c;
+    for (const auto &object : borrowed.objects)
+        MsgPackEncoder(c).pack(*object);
+    REQUIRE(c == records);
+
+    // Errors on worker threads reach the caller
+    MsgPackIndex index;
+    index.update(records.data(), records.size());
+    std::vector<uint8_t> bad(records.begin(), records.begin() + index.offsets[2500]);
+    std::vector<uint8_t> timestamp = {0xc7, 0x03, 0xff, 0x01, 0x02, 0x03}; // Invalid timestamp length
+    bad.insert(bad.end(), timestamp.begin(), timestamp.end());
+    bad.insert(bad.end(), records.begin(), records.end());
+    REQUIRE_THROWS(MsgPack(bad, parallel));
+
+    // Options apply on every worker, the node and byte budgets are shared.
+    // Each record is 9 objects.
+    MsgPackOptions options;
+    options.limits.max_nodes = 5000 * 9;
+    REQUIRE(MsgPack(records, parallel, options).objects.size() == 5000);
+    options.limits.max_nodes--;
+    REQUIRE_THROWS(MsgPack(records, parallel, options));
+    REQUIRE_THROWS(MsgPack(records.data(), records.size(), parallel, options));
+
+    options = MsgPackOptions();
+    options.limits.max_bytes = serial.consumed / 4;
+    REQUIRE_THROWS(MsgPack(records, parallel, options));
+    options = MsgPackOptions();
+    options.limits.max_container = 2;
+    REQUIRE_THROWS(MsgPack(records, parallel, options));
+
+    options = MsgPackOptions();
+    options.limit = 10;
+    MsgPack first(records, parallel, options);
+    REQUIRE(first.objects.size() == 10);
+    REQUIRE(first.consumed == index.offsets[10]);
+
+    std::vector<uint8_t> text(records.begin(), records.begin() + index.offsets[4000]);
+    std::vector<uint8_t> invalid = {0xa2, 0xc3, 0x28}; // Bad continuation byte
+    text.insert(text.end(), invalid.begin(), invalid.end());
+    options = MsgPackOptions();
+    REQUIRE(MsgPack(text, parallel, options).objects.size() == 4001);
+    options.strict = true;
+    REQUIRE_THROWS(MsgPack(text, parallel, options));
+}
+
+TEST_CASE("Parallel Array Decode")
+{
+    std::vector<uint8_t> msg;
+    MsgPackEncoder encoder(msg);
+    encoder.pack_array(100000);
+    for (int i = 0; i < 100000; i++)
+    {
+        if (i % 3 == 0)
+        {
+            encoder.pack_array(2);
+            encoder.pack_int(i);
+            encoder.pack_str("element");
+        }
+        else
+        {
+            encoder.pack_int(i);
+        }
+    }
+    encoder.pack_int(-1); // Second top level object
+
+    MsgPackParallel parallel;
+    parallel.threads = 4;
+    parallel.min_array = 1000;
+
+    MsgPack reader(msg, parallel);
+    REQUIRE(reader.objects.size() == 2);
+    REQUIRE(reader.objects[0]->is_array());
+    REQUIRE(reader.objects[0]->m_array.size() == 100000);
+    REQUIRE(reader.objects[0]->m_array[99998]->as_int32() == 99998);
+    REQUIRE(reader.objects[0]->m_array[99999]->m_array[0]->as_int32() == 99999);
+    REQUIRE(reader.objects[1]->as_int32() == -1);
+
+    std::vector<uint8_t> out;
+    MsgPackEncoder(out).pack(*reader.objects[0]);
+    MsgPackEncoder(out).pack(*reader.objects[1]);
+    REQUIRE(out == msg);
+
+    // The elements split across workers count against the same budget
+    MsgPackOptions options;
+    options.limits.max_nodes = 1 + 100000 + 33334 * 2 + 1;
+    REQUIRE(MsgPack(msg, parallel, options).objects.size() == 2);
+    options.limits.max_nodes--;
+    REQUIRE_THROWS(MsgPack(msg, parallel, options));
+}
+
+TEST_CASE("Immutable Documents")
+{
+    // {"hello": "world", "arr": [0, 1, 2, 3, 4, 5], "records": [{"name": "Bob", ...}, {"name": "Fred", ...}]}
+    std::vector<uint8_t> msg = {
+        0x83, 0xa5, 0x68, 0x65, 0x6c, 0x6c, 0x6f, 0xa5, 0x77, 0x6f, 0x72, 0x6c, 0x64, 0xa3, 0x61, 0x72, 0x72, 0x96, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0xa7, 0x72, 0x65, 0x63, 0x6f, 0x72, 0x64, 0x73, 0x92, 0x82, 0xa4, 0x6e, 0x61, 0x6d, 0x65, 0xa3, 0x42, 0x6f, 0x62, 0xa8, 0x6c, 0x6f, 0x63, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0xa4, 0x68, 0x6f, 0x6d, 0x65, 0x82, 0xa4, 0x6e, 0x61, 0x6d, 0x65, 0xa4, 0x46, 0x72, 0x65, 0x64, 0xa8, 0x6c, 0x6f, 0x63, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0xa4, 0x77, 0x6f, 0x72, 0x6b};
+
+    auto document = std::make_shared<const MsgPackDocument>(msg);
+    REQUIRE(document->consumed() == msg.size());
+
+    MsgPackRef root = document->root();
+    REQUIRE(root.is_map());
+    REQUIRE(root.size() == 3);
+    REQUIRE(root.find("hello").as_string() == "world");
+    REQUIRE(root.find("arr")[5].as_int64() == 5);
+    REQUIRE(root.find("records")[1].find("location").as_string() == "work");
+    REQUIRE(!root.find("missing"));
+    REQUIRE(!root.find("arr")[6]);
+    REQUIRE(root.key(2).as_string() == "records");
+
+    std::string name;
+    REQUIRE(MsgPackPath("/records/0/name").get(root, name));
+    REQUIRE(name == "Bob");
+
+    // Many readers share one document
+    std::atomic<int> matches(0);
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; t++)
+    {
+        readers.emplace_back([document, &matches]()
+                             {
+                                 for (int i = 0; i < 1000; i++)
+                                 {
+                                     MsgPackRef record = document->root().find("records")[i % 2];
+                                     if (record.find("name").as_string() == (i % 2 ? "Fred" : "Bob"))
+                                         matches++;
+                                 }
+                             });
+    }
+    for (auto &t : readers)
+        t.join();
+    REQUIRE(matches == 4000);
+
+    // Malformed input
+    MsgPackDocument bad;
+    std::vector<uint8_t> truncated(msg.begin(), msg.end() - 1);
+    REQUIRE(!bad.parse(truncated.data(), truncated.size()));
+    REQUIRE(!bad.root());
+}
+
+TEST_CASE("Decoder Reuse")
+{
+    std::vector<std::vector<uint8_t>> messages;
+    for (int i = 0; i < 10; i++)
+    {
+        std::vector<uint8_t> msg;
+        MsgPackEncoder encoder(msg);
+        encoder.pack_map(3);
+        encoder.pack_str("id");
+        encoder.pack_int(i);
+        encoder.pack_str("values");
+        encoder.pack_array(20);
+        for (int j = 0; j < 20; j++)
+            encoder.pack_double(j * 0.5);
+        encoder.pack_str("name");
+        encoder.pack_str(std::string(10 + i, 'n'));
+        messages.push_back(msg);
+    }
+
+    MsgPackDecoder &decoder = MsgPackDecoder::local();
+    REQUIRE(&decoder == &MsgPackDecoder::local());
+
+    // Warm up to the largest message, then decoding must not allocate
+    decoder.decode(messages.back());
+    size_t before = allocations;
+    int64_t sum = 0;
+    for (int round = 0; round < 100; round++)
+    {
+        for (const auto &msg : messages)
+        {
+            MsgPackRef root = decoder.decode(msg);
+            sum += root.find("id").as_int64() + (int64_t)root.find("name").as_string().size();
+        }
+    }
+    REQUIRE(allocations == before);
+    REQUIRE(sum == 100 * (45 + 145));
+
+    // Pooled documents outlive the next decode and go back to the pool
+    MsgPackDocumentPool &pool = MsgPackDocumentPool::local();
+    {
+        auto a = pool.decode(messages[1].data(), messages[1].size());
+        auto b = pool.decode(messages[2].data(), messages[2].size());
+        REQUIRE(a->root().find("id").as_int64() == 1);
+        REQUIRE(b->root().find("id").as_int64() == 2);
+    }
+    REQUIRE(pool.free_count() == 2);
+
+    auto c = pool.decode(messages.back().data(), messages.back().size());
+    before = allocations;
+    c.reset();
+    c = pool.decode(messages.back().data(), messages.back().size());
+    REQUIRE(allocations == before);
+    REQUIRE(c->root().find("id").as_int64() == 9);
+
+    std::vector<uint8_t> bad = {0x92, 0x01};
+    REQUIRE(!pool.decode(bad.data(), bad.size()));
+}
+
+TEST_CASE("Pipeline Queues")
+{
+    // I/O thread -> decoder thread -> consumer, frames and documents change hands
+    MsgPackSpscQueue<std::vector<uint8_t>> frames(64);
+    MsgPackDocumentQueue documents(64);
+    MsgPackDocumentPool pool;
+    const int count = 20000;
+
+    std::thread reader([&]()
+                       {
+                           for (int i = 0; i < count; i++)
+                           {
+                               std::vector<uint8_t> frame;
+                               MsgPackEncoder encoder(frame);
+                               encoder.pack_array(2);
+                               encoder.pack_int(i);
+                               encoder.pack_str("frame");
+                               while (!frames.try_push(std::move(frame)))
+                                   std::this_thread::yield();
+                           }
+                       });
+
+    std::thread decoder([&]()
+                        {
+                            std::vector<uint8_t> frame;
+                            for (int i = 0; i < count; i++)
+                            {
+                                while (!frames.try_pop(frame))
+                                    std::this_thread::yield();
+                                auto document = pool.decode(frame.data(), frame.size());
+                                while (!documents.try_push(std::move(document)))
+                                    std::this_thread::yield();
+                            }
+                        });
+
+    int64_t sum = 0;
+    int64_t expected = 0;
+    bool in_order = true;
+    MsgPackDocumentPool::Handle document;
+    for (int i = 0; i < count; i++)
+    {
+        while (!documents.try_pop(document))
+            std::this_thread::yield();
+        in_order = in_order && document->root()[0].as_int64() == i;
+        sum += document->root()[0].as_int64();
+        expected += i;
+        document.reset(); // Back to the pool from this thread
+    }
+    reader.join();
+    decoder.join();
+    REQUIRE(in_order);
+    REQUIRE(sum == expected);
+
+    // Many producers and consumers
+    MsgPackMpmcQueue<int> queue(128);
+    std::atomic<int64_t> total(0);
+    std::vector<std::thread> threads;
+    for (int p = 0; p < 4; p++)
+    {
+        threads.emplace_back([&queue, p]()
+                             {
+                                 for (int i = 1; i <= 10000; i++)
+                                 {
+                                     int value = i + p;
+                                     while (!queue.try_push(std::move(value)))
+                                         std::this_thread::yield();
+                                 }
+                             });
+        threads.emplace_back([&queue, &total]()
+                             {
+                                 int value;
+                                 for (int i = 0; i < 10000; i++)
+                                 {
+                                     while (!queue.try_pop(value))
+                                         std::this_thread::yield();
+                                     total += value;
+                                 }
+                             });
+    }
+    for (auto &t : threads)
+        t.join();
+    REQUIRE(total == 4 * (10000 * 10001 / 2) + 10000 * (0 + 1 + 2 + 3));
+
+    // The pool's free list is shared without a lock, handles never alias
+    MsgPackPool<std::vector<int>> buffers(8);
+    std::atomic<bool> aliased(false);
+    threads.clear();
+    for (int t = 0; t < 4; t++)
+    {
+        threads.emplace_back([&buffers, &aliased, t]()
+                             {
+                                 for (int i = 0; i < 10000; i++)
+                                 {
+                                     auto buffer = buffers.acquire();
+                                     buffer->assign(1, t);
+                                     std::this_thread::yield();
+                                     if ((*buffer)[0] != t)
+                                         aliased = true;
+                                 }
+                             });
+    }
+    for (auto &t : threads)
+        t.join();
+    REQUIRE(!aliased);
+    REQUIRE(buffers.free_count() > 0);
+    REQUIRE(buffers.free_count() <= 8);
+}
+
+#if defined(__cpp_impl_coroutine) && __cplusplus >= 202002L
+// Reads every object off a connection, summing the first array element
+static MsgPackTask<void> sum_connection(MsgPackFdSource &source, int64_t &sum, int &count)
+{
+    MsgPackAsyncReader<MsgPackFdSource> reader(source, 16);
+    while (auto object = co_await async_next_object(reader))
+    {
+        sum += object->as_vector()[0]->as_int64();
+        count++;
+    }
+}
+
+// Hands out one byte per read and never suspends
+struct ByteSource
+{
+    const std::vector<uint8_t> *data;
+    size_t position;
+
+    MsgPackTask<size_t> read(unsigned char *buffer, size_t size)
+    {
+        if (position == data->size() || size == 0)
+            co_return 0;
+        buffer[0] = (*data)[position++];
+        co_return 1;
+    }
+};
+
+static MsgPackTask<int> count_frames(ByteSource &source)
+{
+    MsgPackAsyncReader<ByteSource> reader(source, 1);
+    std::vector<unsigned char> frame;
+    int frames = 0;
+    while (co_await reader.next_frame(frame))
+        frames++;
+    co_return frames;
+}
+
+static MsgPackTask<int> count_frames(ByteSource &source, MsgPackDecodeError &error, size_t max_frame = 64 * 1024 * 1024)
+{
+    MsgPackAsyncReader<ByteSource> reader(source, 1, max_frame);
+    std::vector<unsigned char> frame;
+    int frames = 0;
+    while (co_await reader.next_frame(frame, error))
+        frames++;
+    co_return frames;
+}
+#endif
+
+TEST_CASE("Async Decode")
+{
+    std::vector<uint8_t> stream;
+    MsgPackEncoder encoder(stream);
+    for (int i = 0; i < 50; i++)
+    {
+        encoder.pack_array(3);
+        encoder.pack_int(i);
+        encoder.pack_str(std::string(i * 3, 'x'));
+        encoder.pack_map(1);
+        encoder.pack_str("k");
+        encoder.pack_double(i);
+    }
+
+    // Feeding one byte at a time finds the same boundaries as skipping
+    MsgPackStreamScanner scanner;
+    size_t start = 0;
+    int found = 0;
+    for (size_t end = 1; end <= stream.size(); end++)
+    {
+        MsgPackScanStatus status = scanner.scan(stream.data() + start, end - start);
+        REQUIRE(status != MSGPACK_SCAN_MALFORMED);
+        if (status == MSGPACK_SCAN_COMPLETE)
+        {
+            size_t next = start;
+            REQUIRE(msgpack_skip(stream.data(), stream.size(), next));
+            REQUIRE(start + scanner.size() == next);
+            start = next;
+            scanner.reset();
+            found++;
+        }
+    }
+    REQUIRE(found == 50);
+    std::vector<uint8_t> bad = {0x92, 0xc1};
+    scanner.reset();
+    REQUIRE(scanner.scan(bad.data(), bad.size()) == MSGPACK_SCAN_MALFORMED);
+
+    // Nesting is bounded as in the decoders
+    std::vector<uint8_t> nested(MSGPACK_DEFAULT_MAX_DEPTH, 0x91);
+    nested.push_back(0x00);
+    scanner.reset();
+    REQUIRE(scanner.scan(nested.data(), nested.size()) == MSGPACK_SCAN_COMPLETE);
+    REQUIRE(scanner.size() == nested.size());
+    nested.insert(nested.begin(), 0x91);
+    scanner.reset();
+    REQUIRE(scanner.scan(nested.data(), nested.size()) == MSGPACK_SCAN_TOO_DEEP);
+    REQUIRE(msgpack_scan_error(MSGPACK_SCAN_TOO_DEEP) == MSGPACK_ERROR_DEPTH);
+
+#if defined(__cpp_impl_coroutine) && __cplusplus >= 202002L
+    // Several connections on one thread, written a few bytes at a time
+    const int connections = 8;
+    MsgPackReactor reactor;
+    std::vector<std::array<int, 2>> sockets(connections);
+    std::vector<std::unique_ptr<MsgPackFdSource>> sources;
+    std::vector<MsgPackTask<void>> tasks;
+    std::vector<int64_t> sums(connections, 0);
+    std::vector<int> counts(connections, 0);
+    for (int c = 0; c < connections; c++)
+    {
+        REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets[c].data()) == 0);
+        fcntl(sockets[c][0], F_SETFL, fcntl(sockets[c][0], F_GETFL) | O_NONBLOCK);
+        sources.emplace_back(new MsgPackFdSource(sockets[c][0], reactor));
+        tasks.push_back(sum_connection(*sources.back(), sums[c], counts[c]));
+        tasks.back().start();
+    }
+    REQUIRE(reactor.waiting() == connections);
+
+    for (size_t offset = 0; offset < stream.size(); offset += 7)
+    {
+        size_t n = std::min<size_t>(7, stream.size() - offset);
+        for (int c = 0; c < connections; c++)
+            REQUIRE(write(sockets[c][1], stream.data() + offset, n) == (ssize_t)n);
+        reactor.run_once(0);
+    }
+    for (int c = 0; c < connections; c++)
+        close(sockets[c][1]);
+    reactor.run();
+
+    for (int c = 0; c < connections; c++)
+    {
+        REQUIRE(tasks[c].done());
+        tasks[c].result();
+        REQUIRE(counts[c] == 50);
+        REQUIRE(sums[c] == 49 * 50 / 2);
+        close(sockets[c][0]);
+    }
+
+    // User supplied source, errors surface through the task
+    ByteSource source = {&stream, 0};
+    auto frames = count_frames(source);
+    frames.start();
+    REQUIRE(frames.done());
+    REQUIRE(frames.result() == 50);
+
+    std::vector<uint8_t> truncated(stream.begin(), stream.begin() + 5);
+    ByteSource partial = {&truncated, 0};
+    auto failed = count_frames(partial);
+    failed.start();
+    REQUIRE(failed.done());
+    REQUIRE_THROWS(failed.result());
+
+    // Or reported with the offset of the bad object
+    MsgPackDecodeError error;
+    partial = {&truncated, 0};
+    auto reported = count_frames(partial, error);
+    reported.start();
+    REQUIRE(reported.result() == 0);
+    REQUIRE(error.code == MSGPACK_ERROR_TRUNCATED);
+    size_t first = 0;
+    REQUIRE(msgpack_skip(stream.data(), stream.size(), first));
+    std::vector<uint8_t> malformed(stream.begin(), stream.begin() + first);
+    malformed.push_back(0xc1);
+    ByteSource reserved = {&malformed, 0};
+    error = MsgPackDecodeError();
+    reported = count_frames(reserved, error);
+    reported.start();
+    REQUIRE(reported.result() == 1);
+    REQUIRE(error.code == MSGPACK_ERROR_RESERVED);
+    REQUIRE(error.offset == first);
+
+    malformed.pop_back();
+    malformed.insert(malformed.end(), MSGPACK_DEFAULT_MAX_DEPTH + 1, 0x91);
+    ByteSource deep = {&malformed, 0};
+    error = MsgPackDecodeError();
+    reported = count_frames(deep, error);
+    reported.start();
+    REQUIRE(reported.result() == 1);
+    REQUIRE(error.code == MSGPACK_ERROR_DEPTH);
+    REQUIRE(error.offset == first);
+
+    // A header claiming more than max_frame stops buffering at the bound
+    std::vector<uint8_t> huge = {0xdd, 0xff, 0xff, 0xff, 0xff};
+    huge.resize(1000, 0x00);
+    ByteSource endless = {&huge, 0};
+    error = MsgPackDecodeError();
+    reported = count_frames(endless, error, 256);
+    reported.start();
+    REQUIRE(reported.result() == 0);
+    REQUIRE(error.code == MSGPACK_ERROR_LIMIT);
+    REQUIRE(error.offset == 0);
+    REQUIRE(endless.position <= 258);
+#endif
+}
+
+TEST_CASE("Framing")
+{
+    std::vector<uint8_t> messages[3];
+    for (int i = 0; i < 3; i++)
+    {
+        MsgPackEncoder encoder(messages[i]);
+        encoder.pack_map(2);
+        encoder.pack_str("id");
+        encoder.pack_int(i);
+        encoder.pack_str("body");
+        encoder.pack_str(std::string(i * 40, 'b'));
+    }
+
+    std::vector<uint8_t> delimited;
+    std::vector<uint8_t> prefixed;
+    for (const auto &m : messages)
+    {
+        delimited.insert(delimited.end(), m.begin(), m.end());
+        MsgPackFramer::append_prefixed(prefixed, m.data(), m.size());
+    }
+
+    // Arbitrary chunking, frames come out whole and in order
+    for (size_t chunk : {1, 3, 17, 1000})
+    {
+        for (int mode = 0; mode < 2; mode++)
+        {
+            MsgPackFramer framer(mode == 0 ? MSGPACK_FRAMING_DELIMITED : MSGPACK_FRAMING_LENGTH_PREFIXED);
+            const std::vector<uint8_t> &stream = mode == 0 ? delimited : prefixed;
+            std::vector<std::vector<uint8_t>> frames;
+            for (size_t offset = 0; offset < stream.size(); offset += chunk)
+            {
+                size_t n = std::min(chunk, stream.size() - offset);
+                framer.feed(stream.data() + offset, n, [&](const MsgPackSlice &frame)
+                            {
+                                REQUIRE(frame.is_borrowed());
+                                frames.push_back(frame.to_vector());
+                            });
+            }
+            REQUIRE(framer.buffered() == 0);
+            REQUIRE(frames.size() == 3);
+            for (int i = 0; i < 3; i++)
+                REQUIRE(frames[i] == messages[i]);
+        }
+    }
+
+    // Straight from a socket into the receive buffer
+    int sockets[2];
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+    REQUIRE(write(sockets[1], delimited.data(), delimited.size()) == (ssize_t)delimited.size());
+    close(sockets[1]);
+    MsgPackFramer framer;
+    int64_t ids = 0;
+    while (framer.read(sockets[0], [&](const MsgPackSlice &frame)
+                       {
+                           MsgPackDocument document;
+                           REQUIRE(document.parse(frame.data(), frame.size()));
+                           ids += document.root().find("id").as_int64();
+                       }) > 0)
+    {
+    }
+    close(sockets[0]);
+    REQUIRE(ids == 3);
+
+    std::vector<uint8_t> bad = {0x91, 0xc1};
+    MsgPackFramer strict;
+    REQUIRE_THROWS(strict.feed(bad.data(), bad.size(), [](const MsgPackSlice &) {}));
+    MsgPackFramer limited(MSGPACK_FRAMING_LENGTH_PREFIXED, 16);
+    std::vector<uint8_t> huge = {0x00, 0x01, 0x00, 0x00};
+    REQUIRE_THROWS(limited.feed(huge.data(), huge.size(), [](const MsgPackSlice &) {}));
+
+    // The same input reported instead of thrown, with its stream offset
+    std::vector<uint8_t> split = {0x01, 0x91, 0xc1};
+    MsgPackFramer reporting;
+    MsgPackDecodeError error;
+    REQUIRE(reporting.feed(split.data(), 1, [](const MsgPackSlice &) {}, error) == 1);
+    REQUIRE(!error);
+    REQUIRE(reporting.feed(split.data() + 1, 2, [](const MsgPackSlice &) {}, error) == 0);
+    REQUIRE(error.code == MSGPACK_ERROR_RESERVED);
+    REQUIRE(error.offset == 1);
+    MsgPackFramer reporting_limited(MSGPACK_FRAMING_LENGTH_PREFIXED, 16);
+    error = MsgPackDecodeError();
+    REQUIRE(reporting_limited.feed(huge.data(), huge.size(), [](const MsgPackSlice &) {}, error) == 0);
+    REQUIRE(error.code == MSGPACK_ERROR_LIMIT);
+    REQUIRE(error.offset == 0);
+}
+
+TEST_CASE("RPC")
+{
+    MsgPackRpcServer server;
+    std::atomic<int> logged(0);
+    server.add("add", [](const MsgPackRpcMessage &request, MsgPackEncoder &result)
+               {
+                   int64_t a, b;
+                   if (!request.param(0, a) || !request.param(1, b))
+                       throw "expected two integers";
+                   result.pack_int(a + b);
+               });
+    server.add("sum", [](const MsgPackRpcMessage &request, MsgPackEncoder &result)
+               {
+                   int64_t total = 0;
+                   for (auto &value : request.decode_params()->as_vector())
+                       total += value->as_int64();
+                   result.pack_int(total);
+               });
+    server.add("log", [&logged](const MsgPackRpcMessage &, MsgPackEncoder &)
+               { logged++; });
+
+    int sockets[2];
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+
+    // Answers each batch of requests in reverse, the client must match by msgid
+    std::thread serving([&]()
+                        {
+                            MsgPackFramer framer;
+                            std::vector<MsgPackRpcServer::Buffer> responses;
+                            while (framer.read(sockets[0], [&](const MsgPackSlice &frame)
+                                               {
+                                                   auto response = server.dispatch(frame.data(), frame.size());
+                                                   if (response)
+                                                       responses.push_back(std::move(response));
+                                               }) > 0)
+                            {
+                                for (size_t i = responses.size(); i-- > 0;)
+                                    write(sockets[0], responses[i]->data(), responses[i]->size());
+                                responses.clear();
+                            }
+                        });
+
+    MsgPackRpcClient client;
+    std::vector<uint8_t> out;
+    std::vector<int64_t> results(100, -1);
+    for (int i = 0; i < 100; i++)
+    {
+        client.call(
+            out, "add", [i](MsgPackEncoder &params)
+            {
+                params.pack_array(2);
+                params.pack_int(i);
+                params.pack_int(1000);
+            },
+            [&results, i](const MsgPackRpcMessage &response)
+            {
+                REQUIRE(!response.is_error());
+                REQUIRE(response.get_result(results[i]));
+            });
+    }
+    client.notify(out, "log", [](MsgPackEncoder &params)
+                  { params.pack_array(0); });
+
+    int64_t sum = 0;
+    client.call(
+        out, "sum", [](MsgPackEncoder &params)
+        {
+            params.pack_array(3);
+            params.pack_int(1);
+            params.pack_int(2);
+            params.pack_int(3);
+        },
+        [&sum](const MsgPackRpcMessage &response)
+        { response.get_result(sum); });
+
+    std::vector<std::string> errors;
+    auto record_error = [&errors](const MsgPackRpcMessage &response)
+    {
+        std::string error;
+        REQUIRE(response.is_error());
+        REQUIRE(response.get_error(error));
+        errors.push_back(error);
+    };
+    client.call(
+        out, "add", [](MsgPackEncoder &params)
+        {
+            params.pack_array(1);
+            params.pack_str("one");
+        },
+        record_error);
+    client.call(
+        out, "missing", [](MsgPackEncoder &params)
+        { params.pack_array(0); },
+        record_error);
+    REQUIRE(client.pending() == 103);
+
+    REQUIRE(write(sockets[1], out.data(), out.size()) == (ssize_t)out.size());
+    MsgPackFramer framer;
+    while (client.pending() > 0)
+    {
+        REQUIRE(framer.read(sockets[1], [&](const MsgPackSlice &frame)
+                            { REQUIRE(client.complete(frame.data(), frame.size())); }) > 0);
+    }
+    shutdown(sockets[1], SHUT_WR);
+    serving.join();
+    close(sockets[0]);
+    close(sockets[1]);
+
+    for (int i = 0; i < 100; i++)
+        REQUIRE(results[i] == i + 1000);
+    REQUIRE(sum == 6);
+    REQUIRE(logged == 1);
+    std::sort(errors.begin(), errors.end());
+    REQUIRE(errors == std::vector<std::string>{"expected two integers", "method not found"});
+    REQUIRE(server.buffers().free_count() > 0);
+
+    std::vector<uint8_t> bad = {0x93, 0x05, 0x00, 0x00};
+    REQUIRE_THROWS(server.dispatch(bad.data(), bad.size()));
+    MsgPackRpcServer::Buffer response;
+    REQUIRE(!server.try_dispatch(bad.data(), bad.size(), response));
+    REQUIRE(!response);
+
+    // Parameters that are not an array make the request malformed
+    std::vector<uint8_t> scalar = {0x94, 0x00, 0x01, 0xa3, 'a', 'd', 'd', 0x05}; // [0, 1, "add", 5]
+    MsgPackRpcMessage message;
+    REQUIRE(!message.parse(scalar.data(), scalar.size()));
+    REQUIRE(!server.try_dispatch(scalar.data(), scalar.size(), response));
+
+    // Parameters that skip but do not decode give nullptr, nothing is thrown
+    std::vector<uint8_t> stamp = {0x94, 0x00, 0x01, 0xa3, 's', 'u', 'm', 0x91, 0xd5, 0xff, 0x00, 0x00}; // [0, 1, "sum", [bad timestamp]]
+    REQUIRE(message.parse(stamp.data(), stamp.size()));
+    REQUIRE(message.param_count() == 1);
+    REQUIRE_NOTHROW(message.decode_params());
+    REQUIRE(message.decode_params() == nullptr);
+}
+
+TEST_CASE("JSON Output")
+{
+    std::vector<uint8_t> raw;
+    MsgPackEncoder encoder(raw);
+    encoder.pack_map(6);
+    encoder.pack_str("name");
+    encoder.pack_str("a \"quoted\"\\ line\n\x01 caf\xc3\xa9 and a longer tail to cross sixteen bytes\t");
+    encoder.pack_str("values");
+    encoder.pack_array(7);
+    encoder.pack_nil();
+    encoder.pack_bool(true);
+    encoder.pack_int(-42);
+    encoder.pack_uint(UINT64_MAX);
+    encoder.pack_float(0.1f);
+    encoder.pack_double(2.5);
+    encoder.pack_array(0);
+    encoder.pack_int(7);
+    encoder.pack_map(0);
+    encoder.pack_str("bin");
+    std::vector<uint8_t> bytes = {'h', 'e', 'l', 'l', 'o'};
+    encoder.pack_bin(bytes.data(), bytes.size());
+    encoder.pack_str("ext");
+    encoder.pack_ext(5, bytes.data(), 4);
+    encoder.pack_str("nan");
+    encoder.pack_double(NAN);
+
+    std::string json;
+    REQUIRE(msgpack_to_json(raw.data(), raw.size(), json));
+    REQUIRE(json == "{\"name\":\"a \\\"quoted\\\"\\\\ line\\n\\u0001 caf\xc3\xa9 and a longer tail to cross sixteen bytes\\t\","
+                    "\"values\":[null,true,-42,18446744073709551615,0.1,2.5,[]],"
+                    "\"7\":{},\"bin\":\"aGVsbG8=\",\"ext\":{\"type\":5,\"data\":\"aGVsbA==\"},\"nan\":null}");
+
+    // Escapes found at every position of a SIMD block
+    for (size_t i = 0; i < 40; i++)
+    {
+        std::string text(40, 'x');
+        text[i] = '"';
+        std::string escaped;
+        msgpack_json_escape(escaped, text.data(), text.size());
+        REQUIRE(escaped == "\"" + text.substr(0, i) + "\\\"" + text.substr(i + 1) + "\"");
+    }
+
+    // Concatenated objects one after another, truncation is caught
+    std::vector<uint8_t> two = {0x91, 0x01, 0xa1, 'z'};
+    size_t current = 0;
+    std::string first, second;
+    REQUIRE(msgpack_to_json(two.data(), two.size(), current, first));
+    REQUIRE(msgpack_to_json(two.data(), two.size(), current, second));
+    REQUIRE(first == "[1]");
+    REQUIRE(second == "\"z\"");
+    REQUIRE(current == two.size());
+    std::string partial;
+    REQUIRE(!msgpack_to_json(raw.data(), raw.size() - 3, partial));
+
+    // Non string keys still produce valid JSON
+    std::vector<uint8_t> keys;
+    MsgPackEncoder key_encoder(keys);
+    key_encoder.pack_map(3);
+    key_encoder.pack_bin(bytes.data(), 1);
+    key_encoder.pack_int(1);
+    key_encoder.pack_ext(5, bytes.data(), 1);
+    key_encoder.pack_int(2);
+    key_encoder.pack_bool(false);
+    key_encoder.pack_int(3);
+    std::string keyed;
+    REQUIRE(msgpack_to_json(keys.data(), keys.size(), keyed));
+    REQUIRE(keyed == "{\"aA==\":1,\"{\\\"type\\\":5,\\\"data\\\":\\\"aA==\\\"}\":2,\"false\":3}");
+    std::vector<uint8_t> parsed;
+    REQUIRE(msgpack_from_json(keyed, parsed));
+    MsgPackDocument keyed_document(parsed.data(), parsed.size());
+    REQUIRE(keyed_document.root().find("{\"type\":5,\"data\":\"aA==\"}").as_int64() == 2);
+}
+
+TEST_CASE("JSON Input")
+{
+    std::vector<uint8_t> raw;
+    REQUIRE(msgpack_from_json(" {\"a\" : [1, -1, 300, -40000, 5000000000, 18446744073709551615, 0.5, 0.1, 1e3, 1e30, true, false, null],"
+                              " \"b\":{}, \"c\":[], \"s\":\"tab\\t\\u00e9\\ud83d\\ude00 \\\"q\\\"\"} ",
+                              raw));
+
+    // Narrowest encodings
+    MsgPack reader(raw);
+    auto root = reader.objects[0];
+    auto a = root->as_map()[MsgPackKey("a")]->as_vector();
+    REQUIRE(a.size() == 13);
+    REQUIRE(a[0]->type == MsgpackType::POSITIVE_FIXINT);
+    REQUIRE(a[1]->type == MsgpackType::NEGATIVE_FIXINT);
+    REQUIRE(a[2]->type == MsgpackType::UINT16);
+    REQUIRE(a[3]->type == MsgpackType::INT32);
+    REQUIRE(a[4]->type == MsgpackType::UINT64);
+    REQUIRE(a[5]->as_uint64() == UINT64_MAX);
+    REQUIRE(a[6]->type == MsgpackType::FLOAT32);
+    REQUIRE(a[7]->type == MsgpackType::FLOAT64);
+    REQUIRE(a[8]->type == MsgpackType::FLOAT32);
+    REQUIRE(a[9]->type == MsgpackType::FLOAT64);
+    REQUIRE(a[12]->type == MsgpackType::NIL);
+    REQUIRE(root->as_map()[MsgPackKey("s")]->as_string() == "tab\t\xc3\xa9\xf0\x9f\x98\x80 \"q\"");
+
+    // Back to JSON gives the canonical form
+    std::string json;
+    REQUIRE(msgpack_to_json(raw.data(), raw.size(), json));
+    REQUIRE(json == "{\"a\":[1,-1,300,-40000,5000000000,18446744073709551615,0.5,0.1,1000,1e+30,true,false,null],"
+                    "\"b\":{},\"c\":[],\"s\":\"tab\\t\xc3\xa9\xf0\x9f\x98\x80 \\\"q\\\"\"}");
+
+    // Headers widen past 15 and 65535 entries
+    MsgPackJsonParser parser;
+    for (size_t count : {16, 70000})
+    {
+        std::string text = "[{\"k\":[";
+        for (size_t i = 0; i < count; i++)
+            text += i ? ",7" : "7";
+        text += "]}, \"end\"]";
+        raw.clear();
+        REQUIRE(parser.parse(text, raw));
+        MsgPack wide(raw);
+        auto outer = wide.objects[0]->as_vector();
+        REQUIRE(outer.size() == 2);
+        REQUIRE(outer[0]->as_map()[MsgPackKey("k")]->as_vector().size() == count);
+        REQUIRE(outer[1]->as_string() == "end");
+    }
+
+    // Nested containers of every header size, appended after existing bytes,
+    // match the encoder byte for byte
+    std::string nested;
+    std::vector<uint8_t> expected = {0xc0};
+    MsgPackEncoder nested_encoder(expected);
+    for (size_t count : {3, 20, 70000})
+    {
+        nested += "[";
+        nested_encoder.pack_array(count);
+        for (size_t i = 1; i < count; i++)
+        {
+            nested += "1,";
+            nested_encoder.pack_int(1);
+        }
+    }
+    nested += "{}]]]";
+    nested_encoder.pack_map(0);
+    raw.assign(1, 0xc0);
+    REQUIRE(parser.parse(nested, raw));
+    REQUIRE(raw == expected);
+
+    // -0 keeps its sign as a float
+    raw.clear();
+    REQUIRE(msgpack_from_json("[-0, 0, -0.0]", raw));
+    MsgPackDocument zeros(raw);
+    REQUIRE(zeros.root()[0].type() == MsgpackType::FLOAT32);
+    REQUIRE(std::signbit(zeros.root()[0].as_double()));
+    REQUIRE(zeros.root()[1].type() == MsgpackType::POSITIVE_FIXINT);
+    REQUIRE(std::signbit(zeros.root()[2].as_double()));
+
+    // Strings must be UTF-8 outside escapes too, the output is then valid
+    // for strict decoding
+    raw.clear();
+    REQUIRE(msgpack_from_json("[\"\xc3\xa9\\n\xf0\x9f\x98\x80\"]", raw));
+    MsgPackDocument strict;
+    strict.set_strict(true);
+    REQUIRE(strict.parse(raw.data(), raw.size()));
+
+    // Errors point at the offending character
+    const std::pair<std::string, size_t> errors[] = {
+        {"[1, 2,]", 6},
+        {"{\"a\" 1}", 5},
+        {"[\"tab\there\"]", 5},
+        {"01", 1},
+        {"[1] x", 4},
+        {"\"\\ud800\"", 7},
+        {"[tru]", 1},
+        {"[\"a\xff\"]", 2},
+        {"[\"\\n\xc3\"]", 4},
+        {"[\"\xc3\\n\"]", 2},
+    };
+    for (const auto &error : errors)
+    {
+        raw.clear();
+        REQUIRE(!parser.parse(error.first, raw));
+        REQUIRE(parser.error_offset() == error.second);
+    }
+}
+
+TEST_CASE("Formatting")
+{
+    std::vector<uint8_t> raw;
+    MsgPackEncoder encoder(raw);
+    encoder.pack_map(4);
+    encoder.pack_str("id");
+    encoder.pack_uint(300);
+    encoder.pack_str("tags");
+    encoder.pack_array(3);
+    encoder.pack_str("alpha");
+    encoder.pack_int(-3);
+    encoder.pack_nil();
+    encoder.pack_int(7);
+    encoder.pack_map(1);
+    encoder.pack_str("deep");
+    encoder.pack_array(1);
+    encoder.pack_bool(true);
+    encoder.pack_str("blob");
+    std::vector<uint8_t> bytes = {0x01, 0xab, 0x00};
+    encoder.pack_bin(bytes.data(), bytes.size());
+
+    MsgPack reader(raw);
+    auto root = reader.objects[0];
+    REQUIRE(root->format() == "MAP(id : UINT16(300), tags : ARRAY(STR(alpha), NEGATIVE_FIXINT(-3), NIL), "
+                              "POSITIVE_FIXINT(7) : MAP(deep : ARRAY(BOOL(true))), blob : BIN(0x1,0xab,0x0,))");
+    REQUIRE(root->to_string().str() == root->format() + "\n");
+
+    MsgPackFormatOptions options;
+    options.max_depth = 1;
+    options.max_items = 2;
+    options.max_bytes = 2;
+    REQUIRE(root->format(options) == "MAP(id : UINT16(300), tags : ARRAY(...), ...)");
+    REQUIRE(root->as_map()[MsgPackKey("tags")]->format(options) == "ARRAY(STR(al...), NEGATIVE_FIXINT(-3), ...)");
+
+    // One buffer reused across messages, nothing allocated per node
+    std::string line;
+    line.reserve(1024);
+    size_t before = allocations;
+    for (int i = 0; i < 10; i++)
+    {
+        line.clear();
+        root->format(line);
+    }
+    REQUIRE(allocations == before);
+
+    char fixed[64];
+    char *end = root->as_map()[MsgPackKey("id")]->format_to(fixed);
+    REQUIRE(std::string(fixed, end) == "UINT16(300)");
+}
+
+TEST_CASE("Validation")
+{
+    std::vector<uint8_t> raw;
+    MsgPackEncoder encoder(raw);
+    encoder.pack_map(2);
+    encoder.pack_str("name");
+    encoder.pack_str("caf\xc3\xa9 \xf0\x9f\x98\x80 with enough ascii to fill a vector register");
+    encoder.pack_str("items");
+    encoder.pack_array(3);
+    encoder.pack_array(0);
+    encoder.pack_double(1.5);
+    encoder.pack_bin(raw.data(), 4);
+
+    size_t offset = 0;
+    MsgPackValidateOptions utf8;
+    utf8.utf8 = true;
+    size_t before = allocations;
+    REQUIRE(msgpack_validate(raw.data(), raw.size()));
+    REQUIRE(msgpack_validate(raw.data(), raw.size(), &offset, utf8));
+    REQUIRE(allocations == before);
+
+    // Truncation, trailing bytes and the reserved byte report where they are
+    REQUIRE(!msgpack_validate(raw.data(), raw.size() - 1, &offset));
+    REQUIRE(offset == raw.size() - 6);
+    std::vector<uint8_t> trailing = raw;
+    trailing.push_back(0x01);
+    REQUIRE(!msgpack_validate(trailing.data(), trailing.size(), &offset));
+    REQUIRE(offset == raw.size());
+    std::vector<uint8_t> reserved = {0x92, 0x01, 0xc1};
+    REQUIRE(!msgpack_validate(reserved.data(), reserved.size(), &offset));
+    REQUIRE(offset == 2);
+    std::vector<uint8_t> huge_count = {0xdd, 0xff, 0xff, 0xff, 0xff, 0x01};
+    REQUIRE(!msgpack_validate(huge_count.data(), huge_count.size(), &offset));
+    REQUIRE(offset == 0);
+
+    // Depth
+    std::vector<uint8_t> nested(100, 0x91);
+    nested.push_back(0xc0);
+    REQUIRE(!msgpack_validate(nested.data(), nested.size(), &offset));
+    REQUIRE(offset == 64);
+    MsgPackValidateOptions deep;
+    deep.max_depth = 100;
+    REQUIRE(msgpack_validate(nested.data(), nested.size(), &offset, deep));
+
+    // UTF-8
+    const std::vector<std::vector<uint8_t>> invalid = {
+        {0xc0, 0x80},       // Overlong
+        {0xed, 0xa0, 0x80}, // Surrogate
+        {0xf4, 0x90, 0x80, 0x80},
+        {0xf5, 0x80, 0x80, 0x80},
+        {0xe2, 0x82},
+        {0x80},
+    };
+    for (const auto &bytes : invalid)
+    {
+        std::string text(40, 'a');
+        text.append(bytes.begin(), bytes.end());
+        std::vector<uint8_t> str;
+        MsgPackEncoder(str).pack_str(text);
+        REQUIRE(msgpack_validate(str.data(), str.size()));
+        REQUIRE(!msgpack_validate(str.data(), str.size(), &offset, utf8));
+        REQUIRE(offset == 0);
+    }
+
+    // Agrees with skipping on corrupted input
+    srand(7);
+    for (int i = 0; i < 2000; i++)
+    {
+        std::vector<uint8_t> corrupt = raw;
+        corrupt[rand() % corrupt.size()] = (uint8_t)rand();
+        corrupt.resize(corrupt.size() - rand() % 3);
+        size_t next = 0;
+        bool skips = msgpack_skip(corrupt.data(), corrupt.size(), next) && next == corrupt.size();
+        REQUIRE(msgpack_validate(corrupt.data(), corrupt.size()) == skips);
+    }
+}
+
+TEST_CASE("UTF-8")
+{
+    // Vectorised and scalar checks agree on valid text and on every kind of damage
+    const char *samples[] = {"plain ascii", "caf\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80", "\xef\xbf\xbf", "\xf4\x8f\xbf\xbf"};
+    srand(11);
+    for (int i = 0; i < 20000; i++)
+    {
+        std::string text;
+        size_t length = rand() % 150;
+        while (text.size() < length)
+            text += samples[rand() % 6];
+        bool valid = true;
+        if (i % 2)
+        {
+            text[rand() % (text.size() + 1 > 1 ? text.size() : 1)] = (char)rand();
+            valid = msgpack_utf8_valid_scalar((const unsigned char *)text.data(), text.size());
+        }
+        REQUIRE(msgpack_utf8_valid((const unsigned char *)text.data(), text.size()) == valid);
+
+        std::string copy(text.size(), '\0');
+        REQUIRE(msgpack_utf8_copy((const unsigned char *)text.data(), text.size(), (unsigned char *)copy.data()) == valid);
+        REQUIRE(copy == text);
+
+        // Every variant this CPU can run, whatever the dispatch picked
+#if defined(MSGPACK_X86_SIMD)
+        if (text.size() >= 32 && msgpack_simd_level() >= MSGPACK_SIMD_SSSE3)
+            REQUIRE(msgpack_utf8_valid_ssse3((const unsigned char *)text.data(), text.size()) == valid);
+        if (text.size() >= 32 && msgpack_simd_level() >= MSGPACK_SIMD_AVX2)
+            REQUIRE(msgpack_utf8_valid_avx2((const unsigned char *)text.data(), text.size()) == valid);
+#endif
+    }
+
+    // Cut off at every position across block boundaries
+    std::string text(40, 'a');
+    text += "\xf0\x9f\x98\x80";
+    for (size_t cut = 0; cut <= text.size(); cut++)
+    {
+        bool valid = cut <= 40 || cut == text.size();
+        REQUIRE(msgpack_utf8_valid((const unsigned char *)text.data(), cut) == valid);
+    }
+
+    // Strict decoding
+    std::vector<uint8_t> raw;
+    MsgPackEncoder encoder(raw);
+    encoder.pack_array(2);
+    encoder.pack_str("caf\xc3\xa9");
+    encoder.pack_str(std::string(50, 'x') + "\xed\xa0\x80");
+
+    MsgPackOptions strict;
+    strict.strict = true;
+    REQUIRE(MsgPack(raw).objects[0]->as_vector().size() == 2);
+    REQUIRE_THROWS(MsgPack(raw, strict));
+    raw.resize(7);
+    raw[0] = 0x91;
+    REQUIRE(MsgPack(raw, strict).objects[0]->as_vector()[0]->as_string() == "caf\xc3\xa9");
+
+    MsgPackDocument document;
+    document.set_strict(true);
+    REQUIRE(document.parse(raw.data(), raw.size()));
+    raw[6] = 0xff;
+    REQUIRE(!document.parse(raw.data(), raw.size()));
+}
+
+TEST_CASE("Decode Errors")
+{
+    std::vector<uint8_t> raw;
+    MsgPackEncoder encoder(raw);
+    encoder.pack_map(2);
+    encoder.pack_str("records");
+    encoder.pack_array(2);
+    encoder.pack_map(1);
+    encoder.pack_str("name");
+    encoder.pack_str("first");
+    encoder.pack_map(1);
+    encoder.pack_int(5);
+    encoder.pack_array(2);
+    encoder.pack_nil();
+    size_t bad = raw.size();
+    encoder.pack_nil();
+    encoder.pack_str("tail");
+    encoder.pack_int(1);
+
+    auto ok = MsgPack::try_decode(raw.data(), raw.size());
+    REQUIRE(ok);
+    REQUIRE(ok->objects.size() == 1);
+
+    // Reserved byte deep inside, reported with its offset and path
+    raw[bad] = 0xc1;
+    auto result = MsgPack::try_decode(raw.data(), raw.size());
+    REQUIRE(!result);
+    REQUIRE(result.error().code == MSGPACK_ERROR_RESERVED);
+    REQUIRE(result.error().offset == bad);
+    REQUIRE(result.error().path == "/records/1/5/1");
+    REQUIRE_THROWS(result.value());
+    REQUIRE_THROWS(MsgPack(raw));
+
+    MsgPackDocument document;
+    REQUIRE(!document.parse(raw.data(), raw.size()));
+    REQUIRE(document.error().code == MSGPACK_ERROR_RESERVED);
+    REQUIRE(document.error().offset == bad);
+    REQUIRE(document.error().path == "/records/1/5/1");
+
+    // The path leads back to the object once it is repaired
+    raw[bad] = 0xc0;
+    MsgPackRawValue found;
+    REQUIRE(MsgPackPath(document.error().path).get(raw.data(), raw.size(), found));
+    REQUIRE(found.offset == bad);
+
+    // Truncation inside a container and inside a scalar
+    result = MsgPack::try_decode(raw.data(), bad);
+    REQUIRE(result.error().code == MSGPACK_ERROR_TRUNCATED);
+    REQUIRE(result.error().offset == bad);
+    REQUIRE(result.error().path == "/records/1/5");
+    std::vector<uint8_t> scalar = {0x92, 0x01, 0xcd, 0x01};
+    result = MsgPack::try_decode(scalar);
+    REQUIRE(result.error().code == MSGPACK_ERROR_TRUNCATED);
+    REQUIRE(result.error().offset == 2);
+    REQUIRE(result.error().path == "/1");
+
+    // Strict UTF-8 and keys that are not strings
+    std::vector<uint8_t> text = {0x81, 0xa1, '~', 0x81, 0x02, 0xa1, 0xff};
+    MsgPackOptions strict;
+    strict.strict = true;
+    result = MsgPack::try_decode(text, strict);
+    REQUIRE(result.error().code == MSGPACK_ERROR_INVALID_UTF8);
+    REQUIRE(result.error().offset == 5);
+    REQUIRE(result.error().path == "/~0/2");
+    REQUIRE(std::string(result.error().message()) == "invalid utf-8");
+
+    // A timestamp EXT with a payload of the wrong size is reported, not thrown
+    std::vector<uint8_t> stamp = {0x91, 0xd5, 0xff, 0x00, 0x00};
+    REQUIRE_NOTHROW(result = MsgPack::try_decode(stamp));
+    REQUIRE(result.error().code == MSGPACK_ERROR_TIMESTAMP);
+    REQUIRE(result.error().offset == 1);
+    REQUIRE(result.error().path == "/0");
+    REQUIRE(std::string(result.error().message()) == "invalid timestamp");
+
+    // So are nanoseconds past 999999999, by the tree and the document
+    std::vector<uint8_t> nanoseconds = {0x92, 0x01, 0xd7, 0xff};
+    unsigned char payload[8];
+    MsgPackEncoder::store64(payload, (1000000000ull << 34) | 1);
+    nanoseconds.insert(nanoseconds.end(), payload, payload + 8);
+    REQUIRE_NOTHROW(result = MsgPack::try_decode(nanoseconds));
+    REQUIRE(result.error().code == MSGPACK_ERROR_TIMESTAMP);
+    REQUIRE(result.error().offset == 2);
+    REQUIRE(result.error().path == "/1");
+    REQUIRE(!document.parse(nanoseconds.data(), nanoseconds.size()));
+    REQUIRE(document.error().code == MSGPACK_ERROR_TIMESTAMP);
+    REQUIRE(document.error().offset == 2);
+    REQUIRE(document.error().path == "/1");
+}
+
+TEST_CASE("Fixed Storage")
+{
+    std::vector<uint8_t> raw;
+    MsgPackEncoder encoder(raw);
+    encoder.pack_map(2);
+    encoder.pack_str("id");
+    encoder.pack_int(42);
+    encoder.pack_str("values");
+    encoder.pack_array(3);
+    for (int i = 0; i < 3; i++)
+        encoder.pack_double(i * 1.5);
+
+    unsigned char bytes[64];
+    MsgPackNode nodes[8];
+    uint32_t children[8];
+    MsgPackFixedDocument document(bytes, nodes, children);
+
+    size_t before = allocations;
+    REQUIRE(document.parse(raw.data(), raw.size()));
+    REQUIRE(document.root().find("id").as_int64() == 42);
+    REQUIRE(document.root().find("values")[2].as_double() == 3.0);
+    REQUIRE(document.node_count() == 8);
+    REQUIRE(allocations == before);
+
+    // One node short, then too few bytes for the source
+    MsgPackFixedDocument small(bytes, MsgPackFixedTable<MsgPackNode>(nodes, 7), children);
+    REQUIRE(!small.parse(raw.data(), raw.size()));
+    REQUIRE(small.error().code == MSGPACK_ERROR_CAPACITY);
+    REQUIRE(small.error().offset == raw.size() - 9);
+    REQUIRE(small.error().path.empty());
+    REQUIRE(!small.root());
+    REQUIRE(allocations == before);
+
+    MsgPackFixedDocument tiny(MsgPackFixedTable<unsigned char>(bytes, 8), nodes, children);
+    REQUIRE(!tiny.parse(raw.data(), raw.size()));
+    REQUIRE(tiny.error().code == MSGPACK_ERROR_CAPACITY);
+    REQUIRE(std::string(tiny.error().message()) == "out of capacity");
+
+    // Malformed input still fails as it would on the heap
+    raw.pop_back();
+    REQUIRE(!document.parse(raw.data(), raw.size()));
+    REQUIRE(document.error().code == MSGPACK_ERROR_TRUNCATED);
+}
+
+TEST_CASE("Decode Limits")
+{
+    // Headers claiming billions of elements must not reserve for them
+    std::vector<uint8_t> array = {0xdd, 0xff, 0xff, 0xff, 0xff, 0x01};
+    std::vector<uint8_t> map = {0xdf, 0xff, 0xff, 0xff, 0xff, 0x01};
+    REQUIRE_NOTHROW(MsgPack::try_decode(array));
+    REQUIRE(MsgPack::try_decode(array).error().code == MSGPACK_ERROR_TRUNCATED);
+    REQUIRE(MsgPack::try_decode(map).error().code == MSGPACK_ERROR_TRUNCATED);
+    MsgPackDocument document;
+    REQUIRE(!document.parse(array.data(), array.size()));
+    REQUIRE(document.error().code == MSGPACK_ERROR_TRUNCATED);
+
+    std::vector<uint8_t> raw;
+    MsgPackEncoder encoder(raw);
+    encoder.pack_array(3);
+    encoder.pack_array(1);
+    encoder.pack_array(1);
+    encoder.pack_array(1);
+    encoder.pack_nil();
+    encoder.pack_str(std::string(10, 'a'));
+    size_t third = raw.size();
+    std::vector<uint8_t> payload(10, 1);
+    encoder.pack_bin(payload.data(), payload.size());
+
+    MsgPackOptions options;
+    REQUIRE(MsgPack::try_decode(raw, options));
+
+    // Each bound on its own, with the object that crossed it
+    auto check = [&](MsgPackLimits limits, MsgPackError code, size_t offset, const std::string &path)
+    {
+        options.limits = limits;
+        auto result = MsgPack::try_decode(raw, options);
+        REQUIRE(!result);
+        REQUIRE(result.error().code == code);
+        REQUIRE(result.error().offset == offset);
+        REQUIRE(result.error().path == path);
+
+        document.set_limits(limits);
+        REQUIRE(!document.parse(raw.data(), raw.size()));
+        REQUIRE(document.error().code == code);
+        REQUIRE(document.error().offset == offset);
+        REQUIRE(document.error().path == path);
+    };
+
+    MsgPackLimits limits;
+    limits.max_depth = 3;
+    check(limits, MSGPACK_ERROR_DEPTH, 3, "/0/0/0");
+
+    limits = MsgPackLimits();
+    limits.max_container = 2;
+    check(limits, MSGPACK_ERROR_LIMIT, 0, "");
+
+    limits = MsgPackLimits();
+    limits.max_nodes = 6;
+    check(limits, MSGPACK_ERROR_LIMIT, third, "/2");
+
+    limits = MsgPackLimits();
+    limits.max_bytes = 15;
+    check(limits, MSGPACK_ERROR_LIMIT, third, "/2");
+
+    // Exactly at every bound is fine
+    limits.max_depth = 4;
+    limits.max_container = 3;
+    limits.max_nodes = 7;
+    limits.max_bytes = 20;
+    options.limits = limits;
+    REQUIRE(MsgPack::try_decode(raw, options));
+    document.set_limits(limits);
+    REQUIRE(document.parse(raw.data(), raw.size()));
+    REQUIRE(document.root()[1].as_string().size() == 10);
+
+    // The depth is bounded by default, deep input fails instead of
+    // overflowing the stack
+    std::vector<uint8_t> nested(2000000, 0x91);
+    nested.push_back(0xc0);
+    auto deep = MsgPack::try_decode(nested);
+    REQUIRE(deep.error().code == MSGPACK_ERROR_DEPTH);
+    REQUIRE(deep.error().offset == MSGPACK_DEFAULT_MAX_DEPTH);
+    MsgPackDocument deep_document;
+    REQUIRE(!deep_document.parse(nested.data(), nested.size()));
+    REQUIRE(deep_document.error().code == MSGPACK_ERROR_DEPTH);
+    REQUIRE(deep_document.error().offset == MSGPACK_DEFAULT_MAX_DEPTH);
+    MsgPackParallel parallel;
+    parallel.threads = 2;
+    REQUIRE_THROWS(MsgPack(nested, parallel));
+
+    // Nested headers claiming four billion elements each
+    std::vector<uint8_t> claims;
+    for (int i = 0; i < 100; i++)
+        claims.insert(claims.end(), {0xdd, 0xff, 0xff, 0xff, 0xff});
+    deep = MsgPack::try_decode(claims);
+    REQUIRE(deep.error().code == MSGPACK_ERROR_TRUNCATED);
+    REQUIRE(!deep_document.parse(claims.data(), claims.size()));
+    REQUIRE(deep_document.error().code == MSGPACK_ERROR_TRUNCATED);
+    REQUIRE(deep_document.error().offset == 0);
+}
+
 uint8_t from_hex(std::string str)
 {
     uint8_t x;
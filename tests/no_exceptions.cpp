@@ -0,0 +1,89 @@
+// Built with -fno-exceptions to check the library compiles and decodes
+// without exceptions or iostream:
+//
+//     g++ -fno-exceptions -O3 no_exceptions.cpp -o no_exceptions -lpthread
+
+#define MSGPACK_NO_EXCEPTIONS
+#define MSGPACK_NO_IOSTREAM
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "../msgpack.hpp"
+#include "alloc_count.hpp"
+
+static int failures = 0;
+
+#define CHECK(x)                                                          \
+    do                                                                    \
+    {                                                                     \
+        if (!(x))                                                         \
+        {                                                                 \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #x);  \
+            failures++;                                                   \
+        }                                                                 \
+    } while (0)
+
+int main(void)
+{
+    std::vector<uint8_t> msg = {
+        0x82,                                      // Map of 2 elements
+        0xa2, 'i', 'd', 0x2a,                      // "id": 42
+        0xa6, 'v', 'a', 'l', 'u', 'e', 's', 0x93,  // "values": [
+        0x01, 0xcd, 0x01, 0x00, 0xa3, 'a', 'b', 'c' //   1, 256, "abc"]
+    };
+
+    // Fixed storage, no allocation and no exceptions
+    static unsigned char bytes[256];
+    static MsgPackNode nodes[16];
+    static uint32_t children[16];
+    MsgPackFixedDocument document(bytes, nodes, children);
+
+    size_t before = allocations;
+    CHECK(document.parse(msg.data(), msg.size()));
+    CHECK(document.root().find("id").as_int64() == 42);
+    CHECK(document.root().find("values")[1].as_int64() == 256);
+    CHECK(document.root().find("values")[2].as_string() == "abc");
+    CHECK(allocations == before);
+
+    MsgPackFixedDocument small(bytes, MsgPackFixedTable<MsgPackNode>(nodes, 4), children);
+    CHECK(!small.parse(msg.data(), msg.size()));
+    CHECK(small.error().code == MSGPACK_ERROR_CAPACITY);
+    CHECK(allocations == before);
+
+    std::vector<uint8_t> truncated(msg.begin(), msg.end() - 1);
+    CHECK(!document.parse(truncated.data(), truncated.size()));
+    CHECK(document.error().code == MSGPACK_ERROR_TRUNCATED);
+    CHECK(document.error().offset == msg.size() - 4);
+
+    // The object tree reports errors instead of throwing
+    auto result = MsgPack::try_decode(msg);
+    CHECK(result && result->objects[0]->as_str_map()["id"]->as_int32() == 42);
+    result = MsgPack::try_decode(truncated);
+    CHECK(!result);
+    CHECK(result.error().path == "/values/2");
+    std::vector<uint8_t> stamp = {0x91, 0xd5, 0xff, 0x00, 0x00};
+    result = MsgPack::try_decode(stamp);
+    CHECK(result.error().code == MSGPACK_ERROR_TIMESTAMP);
+
+    // Bad input from a peer is reported, not aborted on
+    MsgPackFramer framer;
+    MsgPackDecodeError error;
+    size_t frames = 0;
+    std::vector<uint8_t> stream = msg;
+    stream.push_back(0xc1);
+    framer.feed(stream.data(), stream.size(), [&](const MsgPackSlice &) { frames++; }, error);
+    CHECK(frames == 1);
+    CHECK(error.code == MSGPACK_ERROR_RESERVED);
+    CHECK(error.offset == msg.size());
+
+    MsgPackRpcServer server;
+    MsgPackRpcServer::Buffer response;
+    CHECK(!server.try_dispatch(truncated.data(), truncated.size(), response));
+
+    if (failures)
+        return 1;
+    printf("All checks passed\n");
+    return 0;
+}
@@ -0,0 +1,48 @@
+#include <iostream>
+#include <string>
+
+#include "../msgpack.hpp"
+
+// Builds or extends the record offset index for a file of concatenated
+// objects. Usage: msgpack_index <file> [index file, default <file>.idx]
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "usage: " << argv[0] << " <file> [index]" << std::endl;
+        return 1;
+    }
+
+    std::string path = argv[1];
+    std::string index_path = argc > 2 ? argv[2] : path + ".idx";
+
+    MsgPackFile file(path);
+
+    // Start from scratch if missing, corrupt or the file was truncated
+    MsgPackIndex index;
+    index.load(index_path, file.size());
+
+    MsgPackDecodeError error;
+    size_t added = index.update(file.data(), file.size(), error);
+
+    if (!index.save(index_path))
+    {
+        std::cerr << "could not write " << index_path << std::endl;
+        return 1;
+    }
+
+    if (error)
+    {
+        std::cerr << "malformed record at offset " << error.offset << ": " << error.message() << std::endl;
+        return 1;
+    }
+
+    std::cout << index.size() << " records (" << added << " new)";
+    if (index.end < file.size())
+    {
+        std::cout << ", " << file.size() - index.end << " trailing bytes not indexed";
+    }
+    std::cout << std::endl;
+
+    return 0;
+}